@@ -0,0 +1,446 @@
+// Throughput and latency benchmarks for dispatch sockets. Everything runs on localhost, and each
+// result is printed to stdout as one JSON object per line, e.g.
+//   {"benchmark":"pubsub","transport":"tcp","size":1024,"messages":1000,...,"p99_us":41.2}
+// so that results from before and after a change can be compared by a script.
+//
+// pubsub: one publisher and one subscriber. Latency is measured one message at a time, then
+// throughput by sending a burst as fast as possible.
+// reqrep: round trips from a ServiceClient to a Service that echoes each request.
+// fanout: one publisher and several subscribers. Latency is the time until the last subscriber has
+// the message.
+// directory: a DirectoryTopicStore with exact and prefix observers, and topics from many nodes.
+// Latencies are of adding each topic (directory_add), of each lookup of the topics still missing
+// (directory_missing), and of evicting each node (directory_evict). "size" is the topic count,
+// "subscribers" the observer count, and "lost" of directory_missing the topics never advertised.
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <functional>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "gflags/gflags.h"
+#include "spdlog/spdlog.h"
+
+#include "a17/capnp_msgs/test.capnp.h"
+#include "a17/utils/size_class_pool.h"
+
+#include "directory.h"
+#include "publisher.h"
+#include "service.h"
+#include "service_client.h"
+#include "smart_capnp_builder.h"
+#include "smart_capnp_reader.h"
+#include "subscriber.h"
+
+DEFINE_string(benchmarks, "pubsub,reqrep,fanout,directory", "Comma-separated benchmarks to run");
+DEFINE_string(transports, "tcp,ipc,inproc", "Comma-separated transports to run them over");
+DEFINE_int32(min_size, 64, "Smallest message size in bytes");
+DEFINE_int32(max_size, 16 * 1024 * 1024, "Largest message size in bytes");
+DEFINE_int32(messages, 10000,
+             "Messages in each throughput burst, reduced for large messages so that a burst is at "
+             "most 256 MB");
+DEFINE_int32(samples, 1000,
+             "Latency samples in each run, reduced for large messages so that a run sends at most "
+             "64 MB");
+DEFINE_string(fanout_subscribers, "1,4,16", "Comma-separated subscriber counts for fanout");
+DEFINE_int32(timeout_ms, 5000, "Time to wait for a message before counting it as lost");
+DEFINE_int32(directory_topics, 10000, "Topics in the directory benchmark");
+DEFINE_int32(directory_observers, 1000, "Observers in the directory benchmark");
+
+namespace a17 {
+namespace dispatch {
+namespace benchmark {
+
+namespace {
+
+using TestType = a17::capnp_msgs::test::TestType;
+
+int64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+std::vector<std::string> Split(const std::string &list) {
+  std::vector<std::string> items;
+  std::istringstream stream(list);
+  std::string item;
+  while (std::getline(stream, item, ',')) {
+    if (!item.empty()) items.push_back(item);
+  }
+  return items;
+}
+
+bool Enabled(const std::string &list, const std::string &item) {
+  auto items = Split(list);
+  return std::find(items.begin(), items.end(), item) != items.end();
+}
+
+std::vector<size_t> Sizes() {
+  std::vector<size_t> sizes;
+  for (size_t size = 64; size <= static_cast<size_t>(FLAGS_max_size); size *= 4) {
+    if (size >= static_cast<size_t>(FLAGS_min_size)) sizes.push_back(size);
+  }
+  return sizes;
+}
+
+size_t Scaled(int count, size_t size, size_t max_bytes) {
+  return std::max<size_t>(10, std::min<size_t>(count, max_bytes / size));
+}
+
+// Returns a bindable endpoint that no other run uses.
+std::string Endpoint(const std::string &transport) {
+  static int run = 0;
+  run++;
+  if (transport == "tcp") return "tcp://127.0.0.1:*";
+  std::string name = "a17_dispatch_benchmark_" + std::to_string(getpid()) + "_" +
+                     std::to_string(run);
+  if (transport == "ipc") return "ipc:///tmp/" + name;
+  return "inproc://" + name;
+}
+
+// Waits for done() to return true, giving up after the timeout.
+bool WaitFor(std::function<bool()> done) {
+  auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(FLAGS_timeout_ms);
+  while (!done()) {
+    if (std::chrono::steady_clock::now() > deadline) return false;
+    std::this_thread::yield();
+  }
+  return true;
+}
+
+// A message of roughly size bytes, stamped with the time it is built. Probes are stamped with 0.
+azmq::message_vector BuildMessage(a17::utils::SizeClassPool &pool, size_t size, bool probe) {
+  SmartCapnpBuilder builder(pool);
+  auto message = builder.initRoot<TestType>();
+  message.initAlist(size / sizeof(int32_t));
+  message.setTimestamp(probe ? 0 : NowNs());
+  return builder.getSmartMessage();
+}
+
+int64_t Timestamp(azmq::message_vector &message) {
+  SmartCapnpReader reader(message);
+  return reader.getRoot<TestType>().getTimestamp();
+}
+
+// Runs an io_service on its own threads until destroyed. Sockets that use it must be created
+// before start(), since azmq sockets aren't thread-safe.
+class IoThreads {
+ public:
+  void start(size_t count = 1) {
+    for (size_t i = 0; i < count; i++) {
+      threads_.emplace_back([this]() {
+        boost::asio::io_service::work work(ios);
+        ios.run();
+      });
+    }
+  }
+
+  // Stops the threads, after which state shared with handlers may be read.
+  void stop() {
+    ios.stop();
+    for (auto &thread : threads_) thread.join();
+    threads_.clear();
+  }
+
+  ~IoThreads() { stop(); }
+
+  boost::asio::io_service ios;
+
+ private:
+  std::vector<std::thread> threads_;
+};
+
+struct Result {
+  std::string benchmark;
+  std::string transport;
+  size_t size = 0;
+  size_t subscribers = 0;
+  size_t messages = 0;
+  size_t lost = 0;
+  double seconds = 0;
+  std::vector<int64_t> latencies_ns;
+};
+
+double PercentileUs(std::vector<int64_t> &sorted, double fraction) {
+  if (sorted.empty()) return 0;
+  size_t index = std::min(sorted.size() - 1, static_cast<size_t>(fraction * sorted.size()));
+  return sorted[index] / 1000.0;
+}
+
+void Print(Result &result) {
+  std::sort(result.latencies_ns.begin(), result.latencies_ns.end());
+  double rate = result.seconds > 0 ? result.messages / result.seconds : 0;
+  printf(
+      "{\"benchmark\":\"%s\",\"transport\":\"%s\",\"size\":%zu,\"subscribers\":%zu,"
+      "\"messages\":%zu,\"lost\":%zu,\"seconds\":%.6f,\"msgs_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+      "\"samples\":%zu,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f}\n",
+      result.benchmark.c_str(), result.transport.c_str(), result.size, result.subscribers,
+      result.messages, result.lost, result.seconds, rate, rate * result.size / (1024 * 1024),
+      result.latencies_ns.size(), PercentileUs(result.latencies_ns, 0.5),
+      PercentileUs(result.latencies_ns, 0.99), PercentileUs(result.latencies_ns, 0.999));
+  fflush(stdout);
+}
+
+// Publishes to subscriber_count subscribers. With one subscriber, latencies are taken from the
+// send time in each message; with more, from when the publisher sees that all have it.
+Result RunPubSub(const std::string &benchmark, const std::string &transport, size_t size,
+                 size_t subscriber_count) {
+  a17::utils::SizeClassPool pool;
+  Result result;
+  result.benchmark = benchmark;
+  result.transport = transport;
+  result.size = size;
+  result.subscribers = subscriber_count;
+
+  // The benchmark counts losses itself, so nothing is dropped at the high-water marks.
+  boost::asio::io_service pub_ios;
+  Publisher pub(pub_ios, Endpoint(transport), QosProfile::reliable());
+
+  IoThreads io;
+  std::atomic<uint64_t> probes{0};
+  std::atomic<uint64_t> received{0};
+  std::atomic<int64_t> last_receive_ns{0};
+  std::vector<int64_t> latencies;
+  std::vector<std::unique_ptr<Subscriber>> subs;
+  for (size_t i = 0; i < subscriber_count; i++) {
+    bool record = subscriber_count == 1;
+    auto handler = [&, record](azmq::message_vector &message) {
+      int64_t now = NowNs();
+      int64_t sent = Timestamp(message);
+      if (!sent) {
+        probes++;
+        return;
+      }
+      if (record) latencies.push_back(now - sent);
+      last_receive_ns = now;
+      received++;
+    };
+    subs.emplace_back(
+        new Subscriber(io.ios, "", handler, ErrorHandler(), {""}, QosProfile::reliable()));
+    subs.back()->connect(pub.address());
+  }
+  io.start(std::min<size_t>(subscriber_count, std::thread::hardware_concurrency()));
+
+  // Subscriptions take a moment to reach the publisher, and messages sent before then are lost.
+  bool joined = WaitFor([&]() {
+    if (probes >= subscriber_count) return true;
+    pub.send(BuildMessage(pool, 64, true));
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    return false;
+  });
+  if (!joined) {
+    fprintf(stderr, "%s %s: subscribers did not connect\n", result.benchmark.c_str(),
+            transport.c_str());
+    return result;
+  }
+  // Let the remaining probes arrive.
+  std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  size_t samples = Scaled(FLAGS_samples, size, 64 * 1024 * 1024);
+  std::vector<int64_t> fanout_latencies;
+  for (size_t i = 0; i < samples; i++) {
+    uint64_t expected = received + subscriber_count;
+    auto message = BuildMessage(pool, size, false);
+    int64_t sent = Timestamp(message);
+    pub.send(message);
+    if (!WaitFor([&]() { return received >= expected; })) {
+      result.lost += expected - received;
+      received = expected;
+      continue;
+    }
+    fanout_latencies.push_back(NowNs() - sent);
+  }
+
+  size_t count = Scaled(FLAGS_messages, size, 256 * 1024 * 1024);
+  uint64_t expected = received + count * subscriber_count;
+  int64_t start = NowNs();
+  for (size_t i = 0; i < count; i++) {
+    pub.send(BuildMessage(pool, size, false));
+  }
+  if (!WaitFor([&]() { return received >= expected; })) {
+    result.lost += expected - received;
+  }
+  result.messages = count;
+  result.seconds = std::max<int64_t>(0, last_receive_ns - start) / 1e9;
+
+  io.stop();
+  if (subscriber_count == 1) {
+    latencies.resize(std::min(latencies.size(), samples));
+    result.latencies_ns = latencies;
+  } else {
+    result.latencies_ns = fanout_latencies;
+  }
+  return result;
+}
+
+// Round trips to a Service that echoes requests.
+Result RunReqRep(const std::string &transport, size_t size) {
+  a17::utils::SizeClassPool pool;
+  Result result;
+  result.benchmark = "reqrep";
+  result.transport = transport;
+  result.size = size;
+
+  IoThreads server_io;
+  Service service(server_io.ios, Endpoint(transport),
+                  [](azmq::message_vector &request, ReplySender reply) { reply(request); });
+  IoThreads client_io;
+  ServiceClient client(client_io.ios, service.address());
+  server_io.start();
+  client_io.start();
+
+  std::atomic<uint64_t> replies{0};
+  std::atomic<uint64_t> errors{0};
+  std::vector<int64_t> latencies;
+  auto request = [&]() {
+    int64_t sent = NowNs();
+    auto ec = client.request(
+        BuildMessage(pool, size, false),
+        [&, sent](azmq::message_vector &) {
+          latencies.push_back(NowNs() - sent);
+          replies++;
+        },
+        [&](const boost::system::error_code &) { errors++; }, FLAGS_timeout_ms);
+    if (ec) errors++;
+  };
+
+  size_t samples = Scaled(FLAGS_samples, size, 64 * 1024 * 1024);
+  for (size_t i = 0; i < samples; i++) {
+    uint64_t expected = replies + errors + 1;
+    request();
+    WaitFor([&]() { return replies + errors >= expected; });
+  }
+
+  // Pipelined requests, as many in flight at once as the client sends.
+  size_t count = Scaled(FLAGS_messages, size, 256 * 1024 * 1024);
+  uint64_t expected = replies + errors + count;
+  int64_t start = NowNs();
+  for (size_t i = 0; i < count; i++) request();
+  WaitFor([&]() { return replies + errors >= expected; });
+  result.messages = count;
+  result.seconds = (NowNs() - start) / 1e9;
+  result.lost = errors + (expected - std::min<uint64_t>(expected, replies + errors));
+
+  client_io.stop();
+  latencies.resize(std::min(latencies.size(), samples));
+  result.latencies_ns = latencies;
+  return result;
+}
+
+// Topics are named node<n>/group<g>/topic<t>, and advertised by 100 nodes. Half of the observers
+// watch single topics, a tenth of them ones that are never advertised, and the other half watch
+// the topics of a group.
+std::vector<Result> RunDirectory() {
+  const size_t topics = FLAGS_directory_topics;
+  const size_t observers = FLAGS_directory_observers;
+  const size_t nodes = 100;
+  const size_t groups = 10;
+  auto name = [&](size_t topic) {
+    return "node" + std::to_string(topic % nodes) + "/group" +
+           std::to_string(topic / nodes % groups) + "/topic" + std::to_string(topic);
+  };
+
+  DirectoryTopicStore store("benchmark");
+  auto handler = [](const std::string &, const GuidTopicMap &) {};
+  for (size_t i = 0; i < observers; i++) {
+    if (i % 2 == 0) {
+      size_t topic = i * topics / observers;
+      store.observe(i % 20 == 0 ? name(topic) + "/never" : name(topic), handler);
+    } else {
+      store.observe("node" + std::to_string(i / 2 % nodes) + "/group" +
+                        std::to_string(i / 2 / nodes % groups) + "/*",
+                    handler);
+    }
+  }
+
+  std::vector<Result> results(3);
+  const char *benchmarks[] = {"directory_add", "directory_missing", "directory_evict"};
+  for (size_t i = 0; i < results.size(); i++) {
+    results[i].benchmark = benchmarks[i];
+    results[i].transport = "store";
+    results[i].size = topics;
+    results[i].subscribers = observers;
+  }
+
+  auto measure = [](Result &result, std::function<void()> operation) {
+    int64_t start = NowNs();
+    operation();
+    int64_t latency = NowNs() - start;
+    result.latencies_ns.push_back(latency);
+    result.seconds += latency / 1e9;
+    result.messages++;
+  };
+
+  for (size_t topic = 0; topic < topics; topic++) {
+    DirectoryTopic entry;
+    entry.name = name(topic);
+    entry.socketType = ZMQ_PUB;
+    entry.address = "tcp://127.0.0.1:" + std::to_string(10000 + topic % nodes);
+    entry.guid = "node" + std::to_string(topic % nodes);
+    measure(results[0], [&]() { store.add(entry); });
+    // The directory looks up the missing topics on every query.
+    if (topic % 10 == 0) {
+      measure(results[1], [&]() { results[1].lost = store.getMissing().size(); });
+    }
+  }
+  for (size_t node = 0; node < nodes; node++) {
+    measure(results[2], [&]() { store.evict("node" + std::to_string(node)); });
+  }
+  return results;
+}
+
+}  // namespace
+
+int Run() {
+  auto transports = Split(FLAGS_transports);
+  if (Enabled(FLAGS_benchmarks, "pubsub")) {
+    for (const auto &transport : transports) {
+      for (size_t size : Sizes()) {
+        auto result = RunPubSub("pubsub", transport, size, 1);
+        Print(result);
+      }
+    }
+  }
+  if (Enabled(FLAGS_benchmarks, "reqrep")) {
+    for (const auto &transport : transports) {
+      for (size_t size : Sizes()) {
+        auto result = RunReqRep(transport, size);
+        Print(result);
+      }
+    }
+  }
+  if (Enabled(FLAGS_benchmarks, "fanout")) {
+    for (const auto &transport : transports) {
+      for (const auto &subscribers : Split(FLAGS_fanout_subscribers)) {
+        auto result = RunPubSub("fanout", transport, 1024, std::stoul(subscribers));
+        Print(result);
+      }
+    }
+  }
+  if (Enabled(FLAGS_benchmarks, "directory")) {
+    for (auto &result : RunDirectory()) {
+      Print(result);
+    }
+  }
+  return 0;
+}
+
+}  // namespace benchmark
+}  // namespace dispatch
+}  // namespace a17
+
+int main(int argc, char *argv[]) {
+  gflags::SetUsageMessage("Dispatch throughput and latency benchmarks, printed as JSON lines");
+  gflags::ParseCommandLineFlags(&argc, &argv, true);
+  spdlog::set_level(spdlog::level::warn);
+  return a17::dispatch::benchmark::Run();
+}
@@ -0,0 +1,165 @@
+#include "chunked_message.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <stdexcept>
+
+#include "message_helpers.h"
+
+namespace a17 {
+namespace dispatch {
+
+namespace {
+
+struct ChunkIdFrame {
+  SmartMessageHeader header;
+  SmartMessageChunk chunk;
+};
+
+// Chunk data points into the original frame, which the hint keeps alive.
+void FreeSlice(void *, void *hint) { delete static_cast<azmq::message *>(hint); }
+
+void FreeFrame(void *data, void *) { free(data); }
+
+azmq::message slice(const azmq::message &frame, size_t offset, size_t size) {
+  if (offset == 0 && size == frame.size()) return frame;
+  auto data = static_cast<const uint8_t *>(frame.data()) + offset;
+  azmq::nocopy_t nocopy;
+  return azmq::message(nocopy, boost::asio::mutable_buffer(const_cast<uint8_t *>(data), size),
+                       new azmq::message(frame), FreeSlice);
+}
+
+}  // namespace
+
+std::vector<azmq::message_vector> chunkSmartMessage(const azmq::message_vector &message,
+                                                    size_t chunk_size, uint64_t stream,
+                                                    uint64_t sequence) {
+  if (chunk_size == 0) {
+    throw std::invalid_argument("Chunk size must be positive");
+  }
+
+  uint32_t count = 0;
+  for (const auto &frame : message) {
+    count += std::max<size_t>(1, (frame.size() + chunk_size - 1) / chunk_size);
+  }
+
+  ChunkIdFrame id_frame{};
+  id_frame.header.id = message.empty() ? 0 : idFromSmartMessage(message);
+  id_frame.header.flags = SMART_MESSAGE_CHUNK;
+  id_frame.chunk.stream = stream;
+  id_frame.chunk.message = sequence;
+  id_frame.chunk.count = count;
+
+  std::vector<azmq::message_vector> chunks;
+  chunks.reserve(count);
+  for (uint32_t frame = 0; frame < message.size(); frame++) {
+    size_t frame_size = message[frame].size();
+    size_t offset = 0;
+    do {
+      size_t size = std::min(chunk_size, frame_size - offset);
+      id_frame.chunk.index = chunks.size();
+      id_frame.chunk.frame = frame;
+      id_frame.chunk.offset = offset;
+      id_frame.chunk.frame_size = frame_size;
+      azmq::message_vector chunk;
+      chunk.push_back(azmq::message(boost::asio::const_buffer(&id_frame, sizeof(id_frame))));
+      chunk.push_back(slice(message[frame], offset, size));
+      chunks.push_back(std::move(chunk));
+      offset += size;
+    } while (offset < frame_size);
+  }
+  return chunks;
+}
+
+ChunkAssembler::ChunkAssembler(size_t max_message_size) : max_message_size_(max_message_size) {}
+
+size_t ChunkAssembler::pending() const { return streams_.size(); }
+
+void ChunkAssembler::discard(uint64_t stream) {
+  if (streams_.erase(stream)) incomplete_++;
+}
+
+bool ChunkAssembler::add(azmq::message_vector &received, azmq::message_vector &message) {
+  if (!(flagsFromSmartMessage(received) & SMART_MESSAGE_CHUNK)) {
+    message.swap(received);
+    return true;
+  }
+
+  ChunkIdFrame id_frame;
+  if (received.size() > 2 || received[0].size() < sizeof(id_frame)) return false;
+  memcpy(&id_frame, received[0].data(), sizeof(id_frame));
+  const SmartMessageChunk &chunk = id_frame.chunk;
+  // Sockets don't keep empty frames, so an empty piece leaves just the id frame.
+  const azmq::message piece = received.size() == 2 ? received[1] : azmq::message();
+
+  if (chunk.index == 0) {
+    // A message that never finished is overtaken by the next one.
+    discard(chunk.stream);
+    Assembly &assembly = streams_[chunk.stream];
+    assembly.message = chunk.message;
+    assembly.count = chunk.count;
+  }
+  auto iter = streams_.find(chunk.stream);
+  if (iter == streams_.end() || iter->second.message != chunk.message ||
+      iter->second.next_index != chunk.index) {
+    // The start of this message, or a chunk in the middle of it, was lost.
+    discard(chunk.stream);
+    return false;
+  }
+  Assembly &assembly = iter->second;
+
+  // Each frame starts with a chunk at offset 0, and continues with consecutive pieces.
+  if (chunk.offset == 0) {
+    assembly.bytes += chunk.frame_size;
+    if (chunk.frame != assembly.frames.size() || assembly.bytes > max_message_size_) {
+      discard(chunk.stream);
+      return false;
+    }
+    assembly.frame_data = static_cast<uint8_t *>(malloc(std::max<size_t>(chunk.frame_size, 1)));
+    if (!assembly.frame_data) {
+      throw std::runtime_error("malloc failed");
+    }
+    azmq::nocopy_t nocopy;
+    assembly.frames.push_back(azmq::message(
+        nocopy, boost::asio::mutable_buffer(assembly.frame_data, chunk.frame_size), nullptr,
+        FreeFrame));
+    assembly.filled = 0;
+  } else if (chunk.frame + 1 != assembly.frames.size() || chunk.offset != assembly.filled) {
+    discard(chunk.stream);
+    return false;
+  }
+  if (assembly.filled + piece.size() > assembly.frames.back().size()) {
+    discard(chunk.stream);
+    return false;
+  }
+  if (piece.size() > 0) {
+    memcpy(assembly.frame_data + assembly.filled, piece.data(), piece.size());
+  }
+  assembly.filled += piece.size();
+  assembly.next_index++;
+
+  if (progress_handler_) {
+    progress_handler_(ChunkProgress{id_frame.header.id, chunk, piece.data(), piece.size()});
+  }
+
+  if (assembly.next_index < assembly.count) return false;
+  if (assembly.filled != assembly.frames.back().size()) {
+    discard(chunk.stream);
+    return false;
+  }
+  message.swap(assembly.frames);
+  streams_.erase(iter);
+  return true;
+}
+
+SmartMessageHandler ChunkAssembler::wrap(std::shared_ptr<ChunkAssembler> assembler,
+                                         SmartMessageHandler handler) {
+  return [assembler, handler](azmq::message_vector &received) {
+    azmq::message_vector message;
+    if (assembler->add(received, message)) handler(message);
+  };
+}
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include "defs.h"
+#include "handlers.h"
+
+namespace a17 {
+namespace dispatch {
+
+// A very large message sent as one frame has to arrive whole before a subscriber can do anything
+// with it. Publishers can instead send it as a stream of chunk messages (see
+// Publisher::setChunking()), which subscribers put back together before calling their handler, and
+// can process as they arrive (see Subscriber::setProgressHandler()).
+//
+// Each chunk is a smart message of its own: an id frame with the SMART_MESSAGE_CHUNK flag, the
+// message's capnp id and a SmartMessageChunk, followed by one frame with a piece of one frame of
+// the original message. The original id frame is the first chunk, so its flags and trace survive.
+// Chunks share the data of the original frames rather than copying it.
+struct SmartMessageChunk {
+  // Random id of the sender. Messages from different senders are put back together separately.
+  uint64_t stream;
+  // Sequence number of the message in the stream.
+  uint64_t message;
+  // Index of this chunk among the count chunks of the message.
+  uint32_t index;
+  uint32_t count;
+  // Frame of the original message that the piece belongs to, and where in it.
+  uint32_t frame;
+  uint32_t reserved;
+  uint64_t offset;
+  uint64_t frame_size;
+};
+
+// Splits a smart message into chunks of at most chunk_size bytes of data each.
+std::vector<azmq::message_vector> chunkSmartMessage(const azmq::message_vector &message,
+                                                    size_t chunk_size, uint64_t stream,
+                                                    uint64_t sequence);
+
+// A chunk as it arrives, for handlers that process large messages progressively, e.g. to show
+// progress or write them out before the rest arrives.
+struct ChunkProgress {
+  // Capnp id of the message.
+  unsigned long long id;
+  const SmartMessageChunk &chunk;
+  const void *data;
+  size_t size;
+};
+using ChunkHandler = std::function<void(const ChunkProgress &)>;
+
+// Puts chunked messages back together. Chunks of a message from one stream must arrive in order;
+// if one is lost, the rest of that message is discarded and counted by incomplete(). Only streams
+// with a message partly put back together are kept. Not thread-safe: subscribers use it on their
+// socket's strand.
+class ChunkAssembler {
+ public:
+  // @param max_message_size largest message, in bytes, that is put back together
+  explicit ChunkAssembler(size_t max_message_size = 1024 * 1024 * 1024);
+
+  // Adds a received message. Returns true with the complete message in message when it is the
+  // last chunk of a message, or when it isn't a chunk at all.
+  bool add(azmq::message_vector &received, azmq::message_vector &message);
+
+  // Called with every chunk that is added in order.
+  inline void setProgressHandler(ChunkHandler handler) { progress_handler_ = std::move(handler); }
+
+  // Messages that were discarded because chunks were lost or the message was too large.
+  inline uint64_t incomplete() const { return incomplete_; }
+  // Messages that are partly put back together.
+  size_t pending() const;
+
+  // Wraps a message handler so that it is called with complete messages.
+  static SmartMessageHandler wrap(std::shared_ptr<ChunkAssembler> assembler,
+                                  SmartMessageHandler handler);
+
+ private:
+  struct Assembly {
+    uint64_t message = 0;
+    uint32_t next_index = 0;
+    uint32_t count = 0;
+    size_t bytes = 0;
+    // The last frame, and how much of it has been written.
+    uint8_t *frame_data = nullptr;
+    size_t filled = 0;
+    azmq::message_vector frames;
+  };
+
+  // Drops the partly put back together message of a stream, if there is one.
+  void discard(uint64_t stream);
+
+  size_t max_message_size_;
+  std::unordered_map<uint64_t, Assembly> streams_;
+  ChunkHandler progress_handler_;
+  uint64_t incomplete_ = 0;
+};
+
+}  // namespace dispatch
+}  // namespace a17
@@ -3,26 +3,51 @@
 #include "spdlog/spdlog.h"
 
 #include "directory.h"
+#include "publisher_mux.h"
+#include "shm_ring.h"
 
 namespace a17 {
 namespace dispatch {
 
+namespace {
+
+std::string ConnectEndpoint(const std::string &address) {
+  return ShmConnectEndpoint(MuxConnectEndpoint(address));
+}
+
+}  // namespace
+
 Client::Client(boost::asio::io_service &ios, int socketType, const std::string &class_name,
                Directory &directory, const std::string &topic_name, ConnectionHandler on_connect,
-               ConnectionHandler on_disconnect)
-    : Socket(ios, socketType, class_name),
+               ConnectionHandler on_disconnect, const QosProfile &qos)
+    : Socket(ios, socketType, class_name, qos),
       on_connect_(on_connect),
       on_disconnect_(on_disconnect),
       topic_name_(topic_name),
-      class_name_(class_name) {
+      class_name_(class_name),
+      directory_(&directory) {
   log_name_ += " [" + topic_name + "]";
-  monitor_ref_ = directory.observe(topic_name, bind2(&Client::onDirectoryTopicsChanged));
-  on_destroy_ = [this, &directory]() { directory.unobserve(topic_name_, monitor_ref_); };
+  // Observers run on whichever thread changed the directory, with its lock held, but the socket is
+  // only safe to change from the strand.
+  std::weak_ptr<Client *> weak_self = self_;
+  monitor_ref_ = directory.observe(
+      topic_name, [weak_self](const std::string &name, const GuidTopicMap &guid_topic_map) {
+        auto self = weak_self.lock();
+        if (!self) return;
+        (*self)->strand().post([weak_self, name, guid_topic_map]() {
+          auto self = weak_self.lock();
+          if (self) (*self)->onDirectoryTopicsChanged(name, guid_topic_map);
+        });
+      });
+  on_destroy_ = [this, &directory]() {
+    directory.unobserve(topic_name_, monitor_ref_);
+    if (isLocal()) directory.detachLocal(topic_name_, local_ref_);
+  };
 }
 
 Client::Client(boost::asio::io_service &ios, int socketType, const std::string &class_name,
-               const std::string &address)
-    : Socket(ios, socketType, class_name), class_name_(class_name) {
+               const std::string &address, const QosProfile &qos)
+    : Socket(ios, socketType, class_name, qos), class_name_(class_name) {
   if (!address.empty()) connect(address);
 }
 
@@ -41,15 +66,34 @@ Client::Client(boost::asio::io_service &ios, int socketType, const std::string &
 }
 
 Client::~Client() {
+  self_.reset();
   if (on_destroy_) on_destroy_();
 }
 
 void Client::onDirectoryTopicsChanged(const std::string &topic_name,
                                       const GuidTopicMap &guid_topic_map) {
   auto new_addresses = std::vector<std::string>{};
+  bool local = false;
   for (const auto &item : guid_topic_map) {
+    // Topics published by our own node are delivered in-process rather than through zmq.
+    if (local_handler_ && item.first == directory_->guid()) {
+      local = true;
+      continue;
+    }
     new_addresses.push_back(item.second.address);
   }
+  if (local && !isLocal()) {
+    auto logger = spdlog::get("Socket");
+    if (logger) logger->info("{0} @ local", log_name_);
+    local_ref_ = directory_->attachLocal(topic_name_, local_handler_);
+    if (on_connect_) on_connect_(topic_name_);
+  } else if (!local && isLocal()) {
+    auto logger = spdlog::get("Socket");
+    if (logger) logger->info("{0} !@ local", log_name_);
+    directory_->detachLocal(topic_name_, local_ref_);
+    local_ref_.clear();
+    if (on_disconnect_) on_disconnect_(topic_name_);
+  }
   // Connect to any new addresses that we aren't already connected to.
   for (const auto &new_address : new_addresses) {
     if (std::find(addresses_.begin(), addresses_.end(), new_address) == addresses_.end()) {
@@ -58,7 +102,7 @@ void Client::onDirectoryTopicsChanged(const std::string &topic_name,
   }
   // Disconnect from any addresses that we are currently connected to, but are no longer in the list
   // of directory topics. This currently will happen when a node disconnects gracefully.
-  for (const auto &address : addresses_) {
+  for (const auto &address : std::set<std::string>(addresses_)) {
     if (std::find(new_addresses.begin(), new_addresses.end(), address) == new_addresses.end()) {
       disconnect(address);
     }
@@ -70,7 +114,7 @@ void Client::connect(const std::string &address) {
     auto logger = spdlog::get("Socket");
     if (logger) logger->info("{0} @ {1}", log_name_, address);
     addresses_.insert(address);
-    azmqsocket_.connect(address);
+    azmqsocket_->connect(ConnectEndpoint(address));
     if (log_name_ == class_name_) log_name_ += "(" + address + ")";
     if (on_connect_) on_connect_(topic_name_);
   }
@@ -81,13 +125,19 @@ void Client::disconnect(const std::string &address) {
   if (addresses_.count(address)) {
     if (logger) logger->info("{0} !@ {1}", log_name_, address);
     addresses_.erase(address);
-    azmqsocket_.disconnect(address);
+    azmqsocket_->disconnect(ConnectEndpoint(address));
     if (on_disconnect_) on_disconnect_(topic_name_);
   } else {
     if (logger) logger->info("{0} already disconnected from {1}", log_name_, address);
   }
 }
 
+void Client::enableLocalDelivery(LocalDeliveryHandler handler) {
+  if (directory_ && directory_->intraProcess()) {
+    local_handler_ = std::move(handler);
+  }
+}
+
 void Client::setConnectionHandlers(ConnectionHandler on_connect, ConnectionHandler on_disconnect) {
   on_connect_ = on_connect;
   on_disconnect_ = on_disconnect;
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <memory>
+
 #include "azmq/socket.hpp"
 
 #include "directory.h"
@@ -21,6 +23,10 @@ class Client : public Socket {
   std::string monitor_ref_;
   std::function<void()> on_destroy_;
 
+  Directory *directory_ = nullptr;
+  LocalDeliveryHandler local_handler_;
+  std::string local_ref_;
+
  public:
   // Connect client to a specific topic in the directory.
   // Declared socket type must be compatible with the topic's socket type (sub->pub, etc.)
@@ -31,12 +37,13 @@ class Client : public Socket {
   Client(boost::asio::io_service &ios, int socketType, const std::string &class_name,
          Directory &directory, const std::string &topic_name,
          ConnectionHandler on_connect = ConnectionHandler(),
-         ConnectionHandler on_disconnect = ConnectionHandler());
+         ConnectionHandler on_disconnect = ConnectionHandler(),
+         const QosProfile &qos = QosProfile());
 
   // Connect client to a socket at a specific address. If empty address is provided, no connection
   // will be made, allowing the caller to call connect() at a later time.
   Client(boost::asio::io_service &ios, int socketType, const std::string &class_name,
-         const std::string &address = "");
+         const std::string &address = "", const QosProfile &qos = QosProfile());
 
   Client(boost::asio::io_service &ios, int socketType, const std::string &class_name,
          const std::set<std::string> &addresses);
@@ -45,15 +52,29 @@ class Client : public Socket {
 
   ~Client();
 
+  // Called on the client's strand.
   void onDirectoryTopicsChanged(const std::string &topic_name, const GuidTopicMap &guid_topic_map);
   virtual void connect(const std::string &address);
-  void disconnect(const std::string &address);
+  virtual void disconnect(const std::string &address);
 
   inline const std::string &topic() const { return topic_name_; }
   inline const std::set<std::string> &addresses() const { return addresses_; }
-  inline bool isConnected(unsigned long count = 1) { return addresses_.size() >= count; }
+  // Whether the client is attached to a publisher in its own node, bypassing zmq.
+  inline bool isLocal() const { return !local_ref_.empty(); }
+  inline bool isConnected(unsigned long count = 1) {
+    return addresses_.size() + (isLocal() ? 1 : 0) >= count;
+  }
   void setConnectionHandlers(ConnectionHandler on_connect,
                              ConnectionHandler on_disconnect = ConnectionHandler());
+
+ protected:
+  // Lets handlers posted to the strand detect that the client was destroyed before they ran.
+  std::shared_ptr<Client *> self_ = std::make_shared<Client *>(this);
+
+  // Receive messages from topics advertised by the client's own directory through the given
+  // handler instead of a zmq connection. Only has an effect if the directory allows intra-process
+  // delivery.
+  void enableLocalDelivery(LocalDeliveryHandler handler);
 };
 
 }  // namespace dispatch
@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <chrono>
+#include <fstream>
 #include <iostream>
 #include <sstream>
 
@@ -32,6 +34,9 @@ const boost::posix_time::time_duration QUERY_INTERVAL_MAX = boost::posix_time::s
 const boost::posix_time::time_duration QUERY_ZERO = boost::posix_time::milliseconds(50);
 const int QUERY_INTERVAL_MULT = 2;
 
+// How often leases are checked when this directory sends no heartbeats.
+const std::chrono::milliseconds LEASE_CHECK_INTERVAL = std::chrono::seconds(1);
+
 static std::string GenerateUuid() {
   static boost::uuids::random_generator uuid_generator;
   static std::mutex mtx;
@@ -47,6 +52,42 @@ static std::string GenerateUuid() {
 // same process.
 static std::unique_ptr<std::atomic<uint16_t>> next_directory_port;
 
+DiscoveryRecord makeRecord(char command, const std::string &name = "") {
+  DiscoveryRecord record;
+  record.command = command;
+  record.name = name;
+  return record;
+}
+
+DiscoveryRecord availableRecord(const DirectoryTopic &topic) {
+  DiscoveryRecord record = makeRecord(DISCOVERY_AVAILABLE, topic.name);
+  record.socketType = topic.socketType;
+  record.address = topic.address;
+  record.inputTypes = topic.inputTypes;
+  record.outputTypes = topic.outputTypes;
+  return record;
+}
+
+// The topics that answer a search for the names.
+std::vector<DiscoveryRecord> answerSearch(const std::map<std::string, DirectoryTopic> &topics,
+                                          const std::vector<std::string> &names) {
+  std::vector<DiscoveryRecord> records;
+  for (const auto &name : names) {
+    // respond to wildcard query with all topics
+    if (name == "*") {
+      for (const auto &topic : topics) {
+        records.push_back(availableRecord(topic.second));
+      }
+    } else {
+      auto iter = topics.find(name);
+      if (iter != topics.end()) {
+        records.push_back(availableRecord(iter->second));
+      }
+    }
+  }
+  return records;
+}
+
 }  // namespace
 
 // Directory
@@ -61,23 +102,10 @@ Directory::Directory(boost::asio::io_service &ios, const std::string &name, uint
       asioReceiveBuffer_(boost::asio::buffer(receiveBuffer_, EVENT_BUFFER_SIZE)),
       topics_(my_guid_),
       queryTimer_(ios),
-      queryFn_(bind1(&Directory::queryMissingTopics)) {
-  logger_ = spdlog::get("Directory|" + name_);
-  if (logger_ == nullptr) {
-    try {
-      logger_ = spdlog::stdout_color_mt("Directory|" + name_);
-    } catch (...) {
-      logger_ = spdlog::get("Directory|" + name_);
-      if (!logger_) {
-        throw std::runtime_error("Directory logger get() failed twice.");
-      }
-    }
-  }
-
-  if (logger_) {
-    if (logger_) logger_->set_pattern("[%Y-%m-%d %T.%e] [%n](%l) %v");
-    logger_->info("listening on {}:{}", multicastAddress, port);
-  }
+      queryFn_(bind1(&Directory::queryMissingTopics)),
+      heartbeatTimer_(ios) {
+  init();
+  if (logger_) logger_->info("listening on {}:{}", multicastAddress, port);
 
   try {
     auto listen_endpoint = boost::asio::ip::udp::endpoint(boost::asio::ip::udp::v4(), port);
@@ -99,26 +127,74 @@ Directory::Directory(boost::asio::io_service &ios, const std::string &name, uint
     throw std::runtime_error("Error joining multicast group");
   }
 
+  receive();
+  startHeartbeatTimer();
+
+  if (!DEFAULT_MANIFEST.empty()) loadManifestFile(DEFAULT_MANIFEST);
+  if (!DEFAULT_MANIFEST_TOPICS.empty()) {
+    std::string topics = DEFAULT_MANIFEST_TOPICS;
+    std::replace(topics.begin(), topics.end(), ';', '\n');
+    std::istringstream manifest(topics);
+    loadManifest(manifest);
+  }
+}
+
+Directory::Directory(boost::asio::io_service &ios, const std::string &name, NoSocket)
+    : ios_(ios),
+      name_(name),
+      my_guid_(name + "_" + OwnAddress::instance().address() + "_" + GenerateUuid()),
+      multicastSocket_(ios),
+      sendPool_(EVENT_BUFFER_SIZE, 1, true),
+      asioReceiveBuffer_(boost::asio::buffer(receiveBuffer_, EVENT_BUFFER_SIZE)),
+      topics_(my_guid_),
+      queryTimer_(ios),
+      queryFn_(bind1(&Directory::queryMissingTopics)),
+      heartbeatTimer_(ios) {
+  init();
+}
+
+void Directory::init() {
+  logger_ = spdlog::get("Directory|" + name_);
+  if (logger_ == nullptr) {
+    try {
+      logger_ = spdlog::stdout_color_mt("Directory|" + name_);
+    } catch (...) {
+      logger_ = spdlog::get("Directory|" + name_);
+      if (!logger_) {
+        throw std::runtime_error("Directory logger get() failed twice.");
+      }
+    }
+  }
+  if (logger_) logger_->set_pattern("[%Y-%m-%d %T.%e] [%n](%l) %v");
+
   if (next_directory_port) {
     nextServerPort_ = next_directory_port->fetch_add(50);
   }
-
-  receive();
 }
 
 Directory::~Directory() {
   if (logger_) logger_->info("exiting");
+  heartbeatTimer_.cancel();
+  if (!multicastSocket_.is_open()) return;
 
   // synchronous send of BYE, since we're probably no longer in the asio loop
-  std::ostringstream os;
-  os << DISPATCH << my_guid_ << ' ' << DISCOVERY_EXIT;
-  multicastSocket_.send_to(boost::asio::buffer(os.str()), multicastEndpoint_);
+  if (sendsBinary()) {
+    for (const auto &datagram : encodeDiscovery(my_guid_, {makeRecord(DISCOVERY_EXIT)})) {
+      multicastSocket_.send_to(boost::asio::buffer(datagram), multicastEndpoint_);
+    }
+  }
+  if (sendsText()) {
+    std::ostringstream os;
+    os << DISPATCH << my_guid_ << ' ' << DISCOVERY_EXIT;
+    multicastSocket_.send_to(boost::asio::buffer(os.str()), multicastEndpoint_);
+  }
 }
 
 // topics
 bool Directory::add(const std::string &topic_name, int socketType, const std::string &address,
                     const std::set<message_type> &inputTypes,
                     const std::set<message_type> &outputTypes, const std::string &guid) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   auto now = static_cast<long int>(std::chrono::duration_cast<std::chrono::milliseconds>(
                                        std::chrono::system_clock::now().time_since_epoch())
                                        .count());
@@ -128,9 +204,21 @@ bool Directory::add(const std::string &topic_name, int socketType, const std::st
       inputTypes, outputTypes,
       guid,       buildTopicInfo(topic_name, socketType, address, inputTypes, outputTypes)};
 
-  if (topics_.add(topic)) {
-    assert(topics_.beginLocal() != topics_.endLocal());
-    broadcast(DISCOVERY_AVAILABLE, topic.info);
+  auto hosted = hosted_.find(guid);
+  if (hosted != hosted_.end()) {
+    if (hosted->second.count(topic_name)) {
+      throw std::runtime_error("Duplicate topic: " + topic_name);
+    }
+    hosted->second[topic_name] = topic;
+  }
+
+  bool added_mine = topics_.add(topic) || hosted != hosted_.end();
+  // Announced topics replace their manifest entries, after they're added so that observers never
+  // see the topic go.
+  if (guid != MANIFEST_GUID) topics_.remove(MANIFEST_GUID, topic_name);
+
+  if (added_mine) {
+    announce({availableRecord(topic)}, guid);
 
     if (logger_) {
       logger_->debug("registered {} topic {} @ {}",
@@ -149,19 +237,52 @@ bool Directory::add(const std::string &topic_name, int socketType, const std::st
   }
 }
 
-void Directory::remove(const std::string &topic_name) {
-  if (topics_.remove(my_guid_, topic_name)) {
-    broadcast(DISCOVERY_REMOVE, topic_name);
+void Directory::remove(const std::string &topic_name) { remove(topic_name, my_guid_); }
+
+void Directory::remove(const std::string &topic_name, const std::string &guid) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto hosted = hosted_.find(guid);
+  if (guid != my_guid_ && hosted == hosted_.end()) return;
+
+  bool removed_hosted = hosted != hosted_.end() && hosted->second.erase(topic_name) > 0;
+  if (topics_.remove(guid, topic_name) || removed_hosted) {
+    announce({makeRecord(DISCOVERY_REMOVE, topic_name)}, guid);
     if (logger_) logger_->debug("removed topic {}", topic_name);
   }
 }
 
+void Directory::host(const std::string &guid) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  hosted_.emplace(guid, std::map<std::string, DirectoryTopic>());
+  if (logger_) logger_->debug("hosting {}", guid);
+}
+
+void Directory::unhost(const std::string &guid) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto hosted = hosted_.find(guid);
+  if (hosted == hosted_.end()) return;
+  hosted_.erase(hosted);
+  topics_.evict(guid);
+  announce({makeRecord(DISCOVERY_EXIT)}, guid);
+  startQueryTimer();
+  if (logger_) logger_->debug("stopped hosting {}", guid);
+}
+
 std::string Directory::observe(const std::string &topic_name, DirectoryTopicEventHandler handler) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   std::string ref = topics_.observe(topic_name, handler);
+  // Patterns aren't searched for until found, but ask once for every topic, which other nodes
+  // answer with their own.
+  if (DirectoryTopicStore::isPattern(topic_name)) {
+    announce({makeRecord(DISCOVERY_SEARCH, "*")});
+  }
 
   // call handler immediately for all matching topics, but only after we exit
   // back to event loop
-  ios_.post([this, topic_name, handler]() { topics_.callImmediate(topic_name, handler); });
+  ios_.post([this, topic_name, handler]() {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    topics_.callImmediate(topic_name, handler);
+  });
 
   startQueryTimer();
 
@@ -169,10 +290,50 @@ std::string Directory::observe(const std::string &topic_name, DirectoryTopicEven
 }
 
 void Directory::unobserve(const std::string &topic_name, const std::string &ref) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   topics_.unobserve(topic_name, ref);
   startQueryTimer();
 }
 
+std::string Directory::attachLocal(const std::string &topic_name, LocalDeliveryHandler handler) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto ref = GenerateUuid();
+  local_deliveries_.emplace(topic_name, LocalDelivery{handler, ref});
+  if (logger_) logger_->debug("attached local subscriber to {}", topic_name);
+  return ref;
+}
+
+void Directory::detachLocal(const std::string &topic_name, const std::string &ref) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  auto range = local_deliveries_.equal_range(topic_name);
+  auto iter = range.first;
+  while (iter != range.second) {
+    if (iter->second.ref == ref) {
+      iter = local_deliveries_.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+}
+
+bool Directory::deliverLocal(const std::string &topic_name, const azmq::message_vector &message) {
+  // Save handlers to execute outside the lock.
+  std::vector<LocalDeliveryHandler> handlers;
+  {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    if (local_deliveries_.empty()) return false;
+    auto range = local_deliveries_.equal_range(topic_name);
+    for (auto iter = range.first; iter != range.second; ++iter) {
+      handlers.push_back(iter->second.handler);
+    }
+  }
+
+  for (auto &handler : handlers) {
+    handler(message);
+  }
+  return !handlers.empty();
+}
+
 void Directory::startQueryTimer() {
   if (queryTimerActive_) queryTimer_.cancel();
   queryTimerActive_ = true;
@@ -184,6 +345,7 @@ void Directory::startQueryTimer() {
 void Directory::queryMissingTopics(const boost::system::error_code &ec) {
   if (ec) return;
 
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   std::set<std::string> requests = topics_.getMissing();
   if (!requests.empty()) {
     queryTimer_.expires_from_now(queryInterval_);
@@ -191,6 +353,17 @@ void Directory::queryMissingTopics(const boost::system::error_code &ec) {
     if (queryInterval_ < QUERY_INTERVAL_MAX) queryInterval_ *= QUERY_INTERVAL_MULT;
     if (queryInterval_ > QUERY_INTERVAL_MAX) queryInterval_ = QUERY_INTERVAL_MAX;
 
+    if (sendsBinary()) {
+      std::vector<DiscoveryRecord> records;
+      for (const std::string &topic_name : requests) {
+        records.push_back(makeRecord(DISCOVERY_SEARCH, topic_name));
+      }
+      for (const auto &datagram : encodeDiscovery(my_guid_, records)) {
+        sendDatagram(multicastEndpoint_, datagram);
+      }
+    }
+    if (!sendsText()) return;
+
     char *buf = nullptr;
     int count = 0;
     size_t pos = 0;
@@ -200,7 +373,10 @@ void Directory::queryMissingTopics(const boost::system::error_code &ec) {
     for (const std::string &topic_name : requests) {
       // max number of topics to group in a single query
       if (!buf || pos + 1 + topic_name.size() >= EVENT_BUFFER_SIZE || count >= 4) {
-        if (buf) _send(multicastEndpoint_, buf, 0, pos);
+        if (buf) {
+          if (logger_) logger_->debug("sending \"{}\"", std::string(buf, pos));
+          _send(multicastEndpoint_, buf, 0, pos);
+        }
         buf = static_cast<char *>(sendPool_.malloc());
         sprintf(buf, "%s%s %c", DISPATCH.c_str(), my_guid_.c_str(), DISCOVERY_SEARCH);
         start = startLen;
@@ -214,12 +390,124 @@ void Directory::queryMissingTopics(const boost::system::error_code &ec) {
       count++;
     }
 
-    if (pos > start) _send(multicastEndpoint_, buf, 0, pos);
+    if (pos > start) {
+      if (logger_) logger_->debug("sending \"{}\"", std::string(buf, pos));
+      _send(multicastEndpoint_, buf, 0, pos);
+    }
   } else {
     queryTimerActive_ = false;
   }
 }
 
+void Directory::setHeartbeat(std::chrono::milliseconds interval,
+                             std::chrono::milliseconds lease) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  heartbeatInterval_ = interval;
+  lease_ = lease;
+  heartbeatTimer_.cancel();
+  startHeartbeatTimer();
+}
+
+void Directory::startHeartbeatTimer() {
+  auto interval = heartbeatInterval_.count() > 0 ? heartbeatInterval_ : LEASE_CHECK_INTERVAL;
+  heartbeatTimer_.expires_from_now(boost::posix_time::milliseconds(interval.count()));
+  heartbeatTimer_.async_wait(bind1(&Directory::heartbeat));
+}
+
+void Directory::heartbeat(const boost::system::error_code &ec) {
+  if (ec) return;
+
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  // Nodes without topics have nothing to keep alive.
+  if (heartbeatInterval_.count() > 0) {
+    DiscoveryRecord record = makeRecord(DISCOVERY_HEARTBEAT, std::to_string(lease_.count()));
+    if (topics_.localSize() > 0) announce({record});
+    for (const auto &hosted : hosted_) {
+      if (!hosted.second.empty()) announce({record}, hosted.first);
+    }
+  }
+  expireLeases();
+  startHeartbeatTimer();
+}
+
+void Directory::heartbeatReceived(const std::string &guid, std::chrono::milliseconds lease) {
+  if (lease.count() <= 0) {
+    leases_.erase(guid);
+    return;
+  }
+  leases_[guid] = Lease{lease, std::chrono::steady_clock::now() + lease};
+}
+
+void Directory::renewLease(const std::string &guid) {
+  auto iter = leases_.find(guid);
+  if (iter != leases_.end()) {
+    iter->second.expiry = std::chrono::steady_clock::now() + iter->second.duration;
+  }
+}
+
+void Directory::expireLeases() {
+  auto now = std::chrono::steady_clock::now();
+  std::vector<std::string> expired;
+  for (auto iter = leases_.begin(); iter != leases_.end();) {
+    if (iter->second.expiry <= now) {
+      expired.push_back(iter->first);
+      binary_peers_.erase(iter->first);
+      iter = leases_.erase(iter);
+    } else {
+      iter++;
+    }
+  }
+  if (expired.empty()) return;
+
+  // Observers see the topics go as if the nodes had exited, and connect elsewhere.
+  for (const auto &guid : expired) {
+    if (logger_) logger_->info("lease of {} expired, evicting its topics", guid);
+    topics_.evict(guid);
+  }
+  startQueryTimer();
+}
+
+size_t Directory::loadManifest(std::istream &manifest, std::chrono::milliseconds lease) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  std::vector<DiscoveryRecord> searches;
+  std::string line;
+  for (int number = 1; std::getline(manifest, line); number++) {
+    std::istringstream fields(line.substr(0, line.find('#')));
+    std::string name, type, address, ins = NO_TYPES, outs = NO_TYPES;
+    if (!(fields >> name)) continue;
+    fields >> type >> address >> ins >> outs;
+
+    int socketType = SocketTypes::instance.fromName(type);
+    if (socketType < 0 || address.empty()) {
+      throw std::runtime_error("Malformed manifest line " + std::to_string(number) + ": " + line);
+    }
+    // The network knows better.
+    if (topics_.hasTopic(name)) continue;
+
+    std::set<message_type> inputTypes;
+    std::set<message_type> outputTypes;
+    parseTypes(inputTypes, ins);
+    parseTypes(outputTypes, outs);
+    add(name, socketType, address, inputTypes, outputTypes, MANIFEST_GUID);
+    searches.push_back(makeRecord(DISCOVERY_SEARCH, name));
+  }
+  if (searches.empty()) return 0;
+
+  heartbeatReceived(MANIFEST_GUID, lease);
+  // The nodes of the topics answer with what they actually publish.
+  announce(searches);
+  if (logger_) logger_->info("loaded {} topics from manifest", searches.size());
+  return searches.size();
+}
+
+size_t Directory::loadManifestFile(const std::string &path, std::chrono::milliseconds lease) {
+  std::ifstream manifest(path);
+  if (!manifest) {
+    throw std::runtime_error("Could not open manifest " + path);
+  }
+  return loadManifest(manifest, lease);
+}
+
 // I/O
 void Directory::receive() {
   multicastSocket_.async_receive_from(asioReceiveBuffer_, lastReceivedEndpoint_,
@@ -228,20 +516,67 @@ void Directory::receive() {
 
 void Directory::send(const boost::asio::ip::udp::endpoint &endpoint, const char command,
                      const std::string &args) {
+  sendText(endpoint, my_guid_, command, args);
+}
+
+void Directory::sendText(const boost::asio::ip::udp::endpoint &endpoint, const std::string &guid,
+                         const char command, const std::string &args) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   char *buf = static_cast<char *>(sendPool_.malloc());
   int len;
 
   if (!args.empty()) {
-    len = sprintf(buf, "%s%s %c %s", DISPATCH.c_str(), my_guid_.c_str(), command, args.c_str());
+    len = sprintf(buf, "%s%s %c %s", DISPATCH.c_str(), guid.c_str(), command, args.c_str());
   } else {
-    len = sprintf(buf, "%s%s %c", DISPATCH.c_str(), my_guid_.c_str(), command);
+    len = sprintf(buf, "%s%s %c", DISPATCH.c_str(), guid.c_str(), command);
   }
 
+  if (logger_) logger_->debug("sending \"{}\"", buf);
   _send(endpoint, buf, 0, len);
 }
 
+void Directory::sendDatagram(const boost::asio::ip::udp::endpoint &endpoint,
+                             const std::string &datagram) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  char *buf = static_cast<char *>(sendPool_.malloc());
+  memcpy(buf, datagram.data(), datagram.size());
+  if (logger_) logger_->debug("sending {} byte binary datagram", datagram.size());
+  _send(endpoint, buf, 0, datagram.size());
+}
+
+void Directory::announce(const std::vector<DiscoveryRecord> &records) {
+  announce(records, my_guid_);
+}
+
+void Directory::announce(const std::vector<DiscoveryRecord> &records, const std::string &guid) {
+  if (records.empty()) return;
+  if (sendsBinary()) {
+    for (const auto &datagram : encodeDiscovery(guid, records)) {
+      sendDatagram(multicastEndpoint_, datagram);
+    }
+  }
+  if (sendsText()) {
+    for (const auto &record : records) {
+      std::string args = record.command == DISCOVERY_AVAILABLE
+                             ? buildTopicInfo(record.name, record.socketType, record.address,
+                                              record.inputTypes, record.outputTypes)
+                             : record.name;
+      if (guid == my_guid_) {
+        send(multicastEndpoint_, record.command, args);
+      } else {
+        sendText(multicastEndpoint_, guid, record.command, args);
+      }
+    }
+  }
+}
+
 void Directory::_send(const boost::asio::ip::udp::endpoint &endpoint, char *buf, size_t pos,
                       size_t len) {
+  if (!multicastSocket_.is_open()) {
+    std::lock_guard<std::recursive_mutex> lock(mutex_);
+    sendPool_.free(buf);
+    return;
+  }
   multicastSocket_.async_send_to(
       boost::asio::buffer(buf + pos, len), endpoint,
       [this, &endpoint, buf, pos, len](const boost::system::error_code &ec, size_t bytes) {
@@ -253,11 +588,10 @@ void Directory::_send(const boost::asio::ip::udp::endpoint &endpoint, char *buf,
         } else if (bytes < len) {
           _send(endpoint, buf, pos + bytes, len - bytes);
         } else {
+          std::lock_guard<std::recursive_mutex> lock(mutex_);
           sendPool_.free(buf);
         }
       });
-
-  if (logger_) logger_->debug("sending \"{}\"", buf);
 }
 
 // events
@@ -268,6 +602,12 @@ void Directory::event(const boost::system::error_code &ec, size_t bytes) {
     return;
   }
 
+  if (isBinaryDiscovery(receiveBuffer_, bytes)) {
+    handleDatagram(receiveBuffer_, bytes);
+    receive();
+    return;
+  }
+
   bool badChar = false;
   for (int i = 0; i < static_cast<int>(bytes); i++) {
     if (!isprint(receiveBuffer_[i])) {
@@ -287,6 +627,7 @@ void Directory::event(const boost::system::error_code &ec, size_t bytes) {
 }
 
 void Directory::handleEvent(char *event) {
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
   if (strncmp(event, &DISPATCH[0], DISPATCH.size())) {
     if (logger_) logger_->trace("ignoring event missing DISPATCH tag: {}", event);
     return;
@@ -296,8 +637,13 @@ void Directory::handleEvent(char *event) {
   if (logger_) logger_->trace("event: {}", &event[pos]);
   size_t next = nextToken(event, pos);
 
-  if (strcmp(&event[pos], &my_guid_[0])) {
+  if (strcmp(&event[pos], &my_guid_[0]) && !hosted_.count(&event[pos]) &&
+      !binary_peers_.count(&event[pos])) {
     const char *guid = &event[pos];
+    if (protocol_ == DiscoveryProtocol::AUTO && !text_peers_.exchange(true) && logger_) {
+      logger_->info("{} uses the text discovery protocol, sending text as well", guid);
+    }
+    renewLease(guid);
     pos = next;
     next = nextToken(event, pos);
     char *data = &event[next];
@@ -315,6 +661,9 @@ void Directory::handleEvent(char *event) {
       case DISCOVERY_REMOVE:
         discoveryRemove(guid, data);
         break;
+      case DISCOVERY_HEARTBEAT:
+        discoveryHeartbeat(guid, data);
+        break;
       default:
         if (logger_) logger_->trace("ignoring event, unknown type: {}", event[pos]);
         break;
@@ -322,6 +671,47 @@ void Directory::handleEvent(char *event) {
   }
 }
 
+void Directory::handleDatagram(const char *data, size_t size) {
+  std::string guid;
+  std::vector<DiscoveryRecord> records;
+  if (!decodeDiscovery(data, size, guid, records)) {
+    if (logger_) logger_->debug("ignoring binary datagram of another version or malformed");
+    return;
+  }
+
+  std::lock_guard<std::recursive_mutex> lock(mutex_);
+  if (guid == my_guid_ || hosted_.count(guid)) return;
+  if (logger_) logger_->trace("received {} records from {}", records.size(), guid);
+  binary_peers_.insert(guid);
+  renewLease(guid);
+
+  // Searches are answered together, in as few datagrams as the answer fits in.
+  std::vector<std::string> searches;
+  for (const auto &record : records) {
+    switch (record.command) {
+      case DISCOVERY_AVAILABLE:
+        available(guid, record);
+        break;
+      case DISCOVERY_SEARCH:
+        searches.push_back(record.name);
+        break;
+      case DISCOVERY_EXIT:
+        leases_.erase(guid);
+        topics_.evict(guid);
+        startQueryTimer();
+        break;
+      case DISCOVERY_REMOVE:
+        topics_.remove(guid, record.name);
+        startQueryTimer();
+        break;
+      case DISCOVERY_HEARTBEAT:
+        heartbeatReceived(guid, std::chrono::milliseconds(std::atol(record.name.c_str())));
+        break;
+    }
+  }
+  search(searches);
+}
+
 void Directory::discoveryAvailable(const char *guid, char *data) {
   size_t pos = 0;
   size_t next = nextToken(data, pos);
@@ -351,24 +741,37 @@ void Directory::discoveryAvailable(const char *guid, char *data) {
   if (next == pos) return;
   const char *outs = &data[pos];
 
-  Address addressParts = Address::parse(address);
-  if (!OwnAddress::instance().onNetwork(addressParts.ip())) {
-    if (logger_) logger_->info("ignoring topic from other network: {} {}", name, address);
-    return;
-  }
-
   int socketType = SocketTypes::instance.fromName(type);
   if (socketType < 0) {
     if (logger_) logger_->debug("unknown socket type: {}", type);
     return;
   }
 
-  std::set<std::string> inputTypes;
-  parseTypes(inputTypes, ins);
-  std::set<std::string> outputTypes;
-  parseTypes(outputTypes, outs);
+  DiscoveryRecord record = makeRecord(DISCOVERY_AVAILABLE, name);
+  record.socketType = socketType;
+  record.address = address;
+  parseTypes(record.inputTypes, ins);
+  parseTypes(record.outputTypes, outs);
+  available(guid, record);
+}
+
+void Directory::available(const std::string &guid, const DiscoveryRecord &record) {
+  if (record.name.empty() || record.address.empty()) return;
+
+  Address addressParts = Address::parse(record.address);
+  if (!OwnAddress::instance().onNetwork(addressParts.ip())) {
+    if (logger_) {
+      logger_->info("ignoring topic from other network: {} {}", record.name, record.address);
+    }
+    return;
+  }
+
+  if (record.socketType < 0 || record.socketType > ZMQ_STREAM) {
+    if (logger_) logger_->debug("unknown socket type: {}", record.socketType);
+    return;
+  }
 
-  add(name, socketType, address, inputTypes, outputTypes, guid);
+  add(record.name, record.socketType, record.address, record.inputTypes, record.outputTypes, guid);
 }
 
 void Directory::discoveryRemove(const char *guid, char *data) {
@@ -379,6 +782,7 @@ void Directory::discoveryRemove(const char *guid, char *data) {
 }
 
 void Directory::discoveryExit(const char *guid, char *data) {
+  leases_.erase(guid);
   topics_.evict(guid);
   startQueryTimer();
 
@@ -386,26 +790,26 @@ void Directory::discoveryExit(const char *guid, char *data) {
 }
 
 void Directory::discoverySearch(const char *guid, char *data) {
+  std::vector<std::string> names;
   size_t pos = 0;
   while (data[pos]) {
     size_t next = nextToken(data, pos);
-    const char *name = &data[pos];
-    if (*name) {
-      // respond to wildcard query with all topics
-      if (name[0] == '*' && name[1] == 0) {
-        for (auto iter = topics_.beginLocal(); iter != topics_.endLocal(); iter++) {
-          reply(DISCOVERY_AVAILABLE, iter->second.info);
-        }
-      } else {
-        auto iter = topics_.findLocal(name);
-        if (iter != topics_.endLocal()) {
-          reply(DISCOVERY_AVAILABLE, iter->second.info);
-        }
-      }
-    }
-
+    if (data[pos]) names.push_back(&data[pos]);
     pos = next;
   }
+  search(names);
+}
+
+void Directory::discoveryHeartbeat(const char *guid, char *data) {
+  nextToken(data, 0);
+  heartbeatReceived(guid, std::chrono::milliseconds(std::atol(data)));
+}
+
+void Directory::search(const std::vector<std::string> &names) {
+  announce(answerSearch(topics_.localTopics(), names));
+  for (const auto &hosted : hosted_) {
+    announce(answerSearch(hosted.second, names), hosted.first);
+  }
 }
 
 std::string Directory::buildTopicInfo(const std::string &name, int socketType,
@@ -471,19 +875,17 @@ bool DirectoryTopicStore::add(const DirectoryTopic &topic) {
     local_topics_[topic.name] = topic;
   }
 
-  if (network_topics_.count(topic.name)) {
-    GuidTopicMap &guid_topic_map = network_topics_[topic.name];
-    if (!guid_topic_map.count(topic.guid)) {
-      guid_topic_map[topic.guid] = topic;
-      callObservers(topic.name, guid_topic_map);
-    } else if (guid_topic_map[topic.guid].address != topic.address) {
-      guid_topic_map[topic.guid] = topic;
-      callObservers(topic.name, guid_topic_map);
-    }
-  } else {
-    GuidTopicMap guid_topic_map;
+  auto iter = network_topics_.find(topic.name);
+  if (iter == network_topics_.end()) {
+    iter = network_topics_.emplace(topic.name, GuidTopicMap()).first;
+    topic_names_.insert(topic.name);
+    missing_.erase(topic.name);
+  }
+  GuidTopicMap &guid_topic_map = iter->second;
+  auto existing = guid_topic_map.find(topic.guid);
+  if (existing == guid_topic_map.end() || existing->second.address != topic.address) {
     guid_topic_map[topic.guid] = topic;
-    network_topics_[topic.name] = guid_topic_map;
+    guid_topics_[topic.guid].insert(topic.name);
     callObservers(topic.name, guid_topic_map);
   }
   return added_mine;
@@ -494,96 +896,132 @@ bool DirectoryTopicStore::remove(const std::string &guid, const std::string &top
   if (guid == my_guid_) {
     removed_mine = local_topics_.erase(topic_name) > 0;
   }
-  if (network_topics_.count(topic_name)) {
-    auto &guid_topic_map = network_topics_[topic_name];
-    if (guid_topic_map.erase(guid) > 0) {
-      ;
-      callObservers(topic_name, guid_topic_map);
-    }
-    if (guid_topic_map.empty()) {
-      network_topics_.erase(topic_name);
-    }
+  auto iter = guid_topics_.find(guid);
+  if (iter != guid_topics_.end() && iter->second.erase(topic_name) > 0) {
+    if (iter->second.empty()) guid_topics_.erase(iter);
+    erase(guid, topic_name);
   }
   return removed_mine;
 }
 
 void DirectoryTopicStore::evict(const std::string &guid) {
-  for (auto iter = network_topics_.begin(); iter != network_topics_.end();) {
-    const auto topic_name = iter->first;
-    auto &guid_topic_map = iter->second;
-    if (guid_topic_map.erase(guid) > 0) {
-      std::cout << "CALLING CALLBACK for topic_name: " << topic_name << " guid: " << guid
-                << std::endl;
-      callObservers(topic_name, guid_topic_map);
-    }
-    if (guid_topic_map.empty()) {
-      iter = network_topics_.erase(iter);
-    } else {
-      ++iter;
-    }
+  auto iter = guid_topics_.find(guid);
+  if (iter == guid_topics_.end()) return;
+  std::set<std::string> topic_names = std::move(iter->second);
+  guid_topics_.erase(iter);
+  for (const auto &topic_name : topic_names) {
+    erase(guid, topic_name);
   }
 }
 
+void DirectoryTopicStore::erase(const std::string &guid, const std::string &topic_name) {
+  auto iter = network_topics_.find(topic_name);
+  if (iter == network_topics_.end() || iter->second.erase(guid) == 0) return;
+  callObservers(topic_name, iter->second);
+  // Observers may have changed the topics.
+  iter = network_topics_.find(topic_name);
+  if (iter != network_topics_.end() && iter->second.empty()) {
+    network_topics_.erase(iter);
+    topic_names_.erase(topic_name);
+    if (observers_.count(topic_name)) missing_.insert(topic_name);
+  }
+}
+
+bool DirectoryTopicStore::isPattern(const std::string &topic_name, std::string *prefix) {
+  bool all = topic_name.empty() || topic_name == "*";
+  size_t size = topic_name.size();
+  bool under = size >= 2 && topic_name[size - 1] == '*' && topic_name[size - 2] == '/';
+  if (prefix) *prefix = all ? "" : topic_name.substr(0, size - 1);
+  return all || under;
+}
+
 std::string DirectoryTopicStore::observe(const std::string &topic_name,
                                          DirectoryTopicEventHandler handler) {
   auto ref = GenerateUuid();
-  observers.emplace(topic_name, DirectoryObserver{handler, ref});
+  auto observer = std::make_shared<const DirectoryObserver>(DirectoryObserver{handler, ref});
+  std::string prefix;
+  if (isPattern(topic_name, &prefix)) {
+    prefix_observers_[prefix].push_back(observer);
+  } else {
+    observers_[topic_name].push_back(observer);
+    if (!network_topics_.count(topic_name)) missing_.insert(topic_name);
+  }
   return ref;
 }
 
 void DirectoryTopicStore::callImmediate(const std::string &topic_name,
                                         DirectoryTopicEventHandler handler) {
-  auto iter = network_topics_.find(topic_name);
-  if (iter != network_topics_.cend()) {
-    handler(topic_name, iter->second);
+  std::string prefix;
+  if (!isPattern(topic_name, &prefix)) {
+    auto iter = network_topics_.find(topic_name);
+    if (iter != network_topics_.cend()) {
+      handler(topic_name, iter->second);
+    }
+    return;
+  }
+
+  // The handler may change the topics, so find them first.
+  std::vector<std::string> matches;
+  for (auto iter = topic_names_.lower_bound(prefix);
+       iter != topic_names_.end() && iter->compare(0, prefix.size(), prefix) == 0; iter++) {
+    matches.push_back(*iter);
+  }
+  for (const auto &match : matches) {
+    auto iter = network_topics_.find(match);
+    if (iter != network_topics_.cend()) {
+      handler(match, iter->second);
+    }
   }
 }
 
 void DirectoryTopicStore::unobserve(const std::string &topic_name, const std::string &ref) {
-  auto range = observers.equal_range(topic_name);
-  auto iter = range.first;
-  while (iter != range.second) {
-    if (iter->second.ref == ref) {
-      iter = observers.erase(iter);
-    } else {
-      iter++;
-    }
+  std::string prefix;
+  bool pattern = isPattern(topic_name, &prefix);
+  auto &observers = pattern ? prefix_observers_ : observers_;
+  auto iter = observers.find(pattern ? prefix : topic_name);
+  if (iter == observers.end()) return;
+
+  ObserverList &list = iter->second;
+  list.erase(std::remove_if(list.begin(), list.end(),
+                            [&ref](const std::shared_ptr<const DirectoryObserver> &observer) {
+                              return observer->ref == ref;
+                            }),
+             list.end());
+  if (list.empty()) {
+    observers.erase(iter);
+    if (!pattern) missing_.erase(topic_name);
   }
 }
 
 void DirectoryTopicStore::callObservers(const std::string &topic_name,
                                         const GuidTopicMap &guid_topic_map) {
-  // Save handlers to execute outside loops.
-  std::vector<DirectoryTopicEventHandler> handlers;
+  // Collect the observers first, since they may observe or unobserve.
+  ObserverList called;
 
   // Observers seeking updates to this topic.
-  auto range = observers.equal_range(topic_name);
-  for (auto iter = range.first; iter != range.second; ++iter) {
-    handlers.push_back(iter->second.handler);
-  }
-
-  // Observers seeking all updates.
-  auto range2 = observers.equal_range("");
-  for (auto iter2 = range2.first; iter2 != range2.second; ++iter2) {
-    handlers.push_back(iter2->second.handler);
+  auto iter = observers_.find(topic_name);
+  if (iter != observers_.end()) {
+    called.insert(called.end(), iter->second.begin(), iter->second.end());
   }
 
-  for (auto handler : handlers) {
-    handler(topic_name, guid_topic_map);
-  }
-}
-
-std::set<std::string> DirectoryTopicStore::getMissing() {
-  std::set<std::string> topics;
-
-  for (auto &entry : observers) {
-    const std::string &topic_name = entry.first;
-    if (network_topics_.count(topic_name) == 0) {
-      topics.insert(topic_name);
+  // Observers seeking updates to the topics under one of its prefixes, then to all topics.
+  if (!prefix_observers_.empty()) {
+    for (size_t pos = topic_name.find('/'); pos != std::string::npos;
+         pos = topic_name.find('/', pos + 1)) {
+      auto prefix = prefix_observers_.find(topic_name.substr(0, pos + 1));
+      if (prefix != prefix_observers_.end()) {
+        called.insert(called.end(), prefix->second.begin(), prefix->second.end());
+      }
+    }
+    auto all = prefix_observers_.find("");
+    if (all != prefix_observers_.end()) {
+      called.insert(called.end(), all->second.begin(), all->second.end());
     }
   }
 
-  return topics;
+  for (const auto &observer : called) {
+    observer->handler(topic_name, guid_topic_map);
+  }
 }
 
 std::map<std::string, DirectoryTopic>::const_iterator DirectoryTopicStore::findLocal(
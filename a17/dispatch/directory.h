@@ -1,8 +1,15 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
 #include <functional>
+#include <istream>
 #include <map>
 #include <memory>
+#include <mutex>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 #include "boost/asio.hpp"
@@ -16,6 +23,7 @@
 #include "address.h"
 #include "defs.h"
 #include "directory_topic.h"
+#include "discovery_protocol.h"
 #include "socket_types.h"
 
 namespace a17 {
@@ -27,12 +35,29 @@ const uint16_t DEFAULT_DIRECTORY_PORT =
     std::getenv("DISPATCH_PORT") ? std::atoi(std::getenv("DISPATCH_PORT")) : 8888;
 const std::string DEFAULT_DIRECTORY_MULTICAST =
     std::getenv("DISPATCH_MULTICAST") ? std::getenv("DISPATCH_MULTICAST") : "224.0.88.1";
-
-const char DISCOVERY_EXIT = 'X';
-const char DISCOVERY_AVAILABLE = 'A';
-const char DISCOVERY_REMOVE = 'R';
-const char DISCOVERY_SEARCH = 'S';
-const size_t EVENT_BUFFER_SIZE = 1500;
+// Set DISPATCH_INTRA_PROCESS=0 to send messages between sockets of the same node through zmq.
+const bool DEFAULT_INTRA_PROCESS = !std::getenv("DISPATCH_INTRA_PROCESS") ||
+                                   std::string(std::getenv("DISPATCH_INTRA_PROCESS")) != "0";
+// Milliseconds between the heartbeats of a directory with topics. Set DISPATCH_HEARTBEAT_MS=0 to
+// send none, so that other nodes never evict the topics of this one.
+const int DEFAULT_HEARTBEAT_MS =
+    std::getenv("DISPATCH_HEARTBEAT_MS") ? std::atoi(std::getenv("DISPATCH_HEARTBEAT_MS")) : 1000;
+// Milliseconds other nodes keep the topics of this one for after its last heartbeat.
+const int DEFAULT_LEASE_MS = std::getenv("DISPATCH_LEASE_MS")
+                                 ? std::atoi(std::getenv("DISPATCH_LEASE_MS"))
+                                 : 3 * DEFAULT_HEARTBEAT_MS;
+// Path of a topic manifest that every directory is preloaded with (see Directory::loadManifest()).
+const std::string DEFAULT_MANIFEST =
+    std::getenv("DISPATCH_MANIFEST") ? std::getenv("DISPATCH_MANIFEST") : "";
+// Manifest lines separated by ';', for when there is no manifest file to point at.
+const std::string DEFAULT_MANIFEST_TOPICS =
+    std::getenv("DISPATCH_MANIFEST_TOPICS") ? std::getenv("DISPATCH_MANIFEST_TOPICS") : "";
+// Milliseconds that manifest topics no node has announced are kept for. Zero keeps them.
+const int DEFAULT_MANIFEST_LEASE_MS = std::getenv("DISPATCH_MANIFEST_LEASE_MS")
+                                          ? std::atoi(std::getenv("DISPATCH_MANIFEST_LEASE_MS"))
+                                          : 10000;
+// The guid that manifest topics are held under until their nodes announce them.
+const std::string MANIFEST_GUID = "manifest";
 
 using GuidTopicMap = std::map<std::string, DirectoryTopic>;
 using DirectoryTopicEventHandler =
@@ -43,6 +68,20 @@ struct DirectoryObserver {
   std::string ref;
 };
 
+using LocalDeliveryHandler = std::function<void(const azmq::message_vector &message)>;
+
+struct LocalDelivery {
+  LocalDeliveryHandler handler;
+  std::string ref;
+};
+
+// Topics known to a directory, and the observers of their changes.
+//
+// An observer watches one topic, the topics under a prefix ("drone1/perception/*" matches every
+// topic whose name starts with "drone1/perception/"), or every topic ("" or "*"). Topics and
+// observers are hash-indexed, and the prefix observers of a topic are found by looking up each of
+// its '/'-terminated prefixes, so a change costs the same however many topics and observers there
+// are. The topics that observers are waiting for are kept up to date as topics come and go.
 class DirectoryTopicStore {
  public:
   DirectoryTopicStore(const std::string &my_guid) : my_guid_(my_guid) {}
@@ -57,7 +96,8 @@ class DirectoryTopicStore {
   bool hasTopic(const std::string &topic_name) const {
     return network_topics_.count(topic_name) > 0;
   }
-  std::set<std::string> getMissing();
+  // Topics with an observer of their own that no node has advertised yet.
+  const std::set<std::string> &getMissing() const { return missing_; }
 
   size_t localSize() const { return local_topics_.size(); }
   std::map<std::string, DirectoryTopic>::const_iterator findLocal(const std::string &topic_name);
@@ -65,14 +105,29 @@ class DirectoryTopicStore {
     return local_topics_.cbegin();
   }
   std::map<std::string, DirectoryTopic>::const_iterator endLocal() { return local_topics_.cend(); }
+  const std::map<std::string, DirectoryTopic> &localTopics() const { return local_topics_; }
+
+  // Whether an observed name matches several topics, and if so the prefix of their names.
+  static bool isPattern(const std::string &topic_name, std::string *prefix = nullptr);
 
  private:
+  using ObserverList = std::vector<std::shared_ptr<const DirectoryObserver>>;
+
   std::string my_guid_;
   std::map<std::string, DirectoryTopic> local_topics_;
-  std::map<std::string, GuidTopicMap> network_topics_;
-  std::multimap<std::string, DirectoryObserver> observers;
+  std::unordered_map<std::string, GuidTopicMap> network_topics_;
+  // The names of network_topics_ in order, for finding the topics under a prefix.
+  std::set<std::string> topic_names_;
+  // The names of the network topics advertised by each guid.
+  std::unordered_map<std::string, std::set<std::string>> guid_topics_;
+  // Observers of one topic by its name, and of several by their prefix.
+  std::unordered_map<std::string, ObserverList> observers_;
+  std::unordered_map<std::string, ObserverList> prefix_observers_;
+  std::set<std::string> missing_;
 
   void callObservers(const std::string &topic_name, const GuidTopicMap &guid_topic_map);
+  // Removes a guid's entry for a topic, and the topic once no guid has it.
+  void erase(const std::string &guid, const std::string &topic_name);
 };
 
 /**
@@ -83,38 +138,115 @@ class DirectoryTopicStore {
  * DISCOVERY_AVAILABLE - Inform other nodes that a specific topic/socket is available
  * DISCOVERY_SEARCH - Ask other nodes if a specific topic/socket is available
  * DISCOVERY_REMOVE - Inform all nodes to remove a specific topic/socket
+ * DISCOVERY_HEARTBEAT - The node is alive, and its topics are leased for the given milliseconds
+ *
+ * Commands are sent as text or binary datagrams (see DiscoveryProtocol). Binary datagrams carry
+ * several commands each, so that a node answers a search for all topics with a few datagrams
+ * rather than one per topic. A node that sends both is only heard through its binary datagrams.
  *
  * When a client needs to connect to a particular topic, it looks in the local list.
  * If not present, the directory sends a DISCOVERY_SEARCH on a repeater until a
  * DISCOVERY_AVAILABLE with the topic info is received from another node.
+ *
+ * A node that crashes never sends DISCOVERY_EXIT. So while a directory has topics, it sends a
+ * heartbeat every heartbeat interval with its lease, and other directories evict the topics of a
+ * node once they have heard nothing from it for its lease, within a heartbeat interval of their
+ * own. Observers then see the topic change as if the node had exited, and search for it again.
+ * Nodes that never send heartbeats, such as the Python dispatch, are never evicted.
+ *
+ * Discovery takes from 50ms to seconds after a restart, as searches back off. A directory may be
+ * preloaded with the topics it will need from a manifest instead (see loadManifest()), which
+ * discovery then verifies.
+ *
+ * Topics advertised with the directory's own guid are published by this process. Subscribers to
+ * them attach a LocalDeliveryHandler instead of connecting through zmq, and the publisher hands
+ * them its messages directly with deliverLocal(). The zmq frames are reference-counted, so nothing
+ * is copied.
+ *
+ * The directory may be used from several threads running the same io_service. Topic and observer
+ * changes are serialized on an internal lock, which is held while observers are called, on whichever
+ * thread made the change. Observers must not touch zmq sockets there: a Client posts the
+ * connections that it makes and drops onto its socket's strand.
+ *
+ * A directory may also host the topics of other guids, which it announces, answers searches for
+ * and sends heartbeats for as if they were its own. That is how the Nodes of a process share one
+ * directory (see DirectoryView).
  */
 class Directory {
- public:
  public:
   Directory(boost::asio::io_service &ios, const std::string &name,
             uint16_t port = DEFAULT_DIRECTORY_PORT,
             const std::string &multicastAddress = DEFAULT_DIRECTORY_MULTICAST);
 
-  ~Directory();
+  virtual ~Directory();
   Directory(const Directory &) = delete;
   Directory(Directory &&) = delete;
 
   inline const std::string &guid() const { return my_guid_; }
-  inline const DirectoryTopicStore &topics() const { return topics_; }
-  bool add(const std::string &topic_name, int socketType, const std::string &address,
-           const std::set<message_type> &inputTypes, const std::set<message_type> &outputTypes,
-           const std::string &guid);
-  void remove(const std::string &topic_name);
-  std::string observe(const std::string &topic_name, DirectoryTopicEventHandler handler);
-  void unobserve(const std::string &topic_name, const std::string &ref);
+  // A copy of the topics, so that a DirectoryView can return them from another thread.
+  virtual DirectoryTopicStore topics() const { return topics_; }
+  virtual bool add(const std::string &topic_name, int socketType, const std::string &address,
+                   const std::set<message_type> &inputTypes,
+                   const std::set<message_type> &outputTypes, const std::string &guid);
+  virtual void remove(const std::string &topic_name);
+  // The topic name may also be a prefix such as "drone1/perception/*", or "*" for every topic (see
+  // DirectoryTopicStore). Only single topics are searched for until they are found; observing a
+  // pattern sends one search for every topic.
+  virtual std::string observe(const std::string &topic_name, DirectoryTopicEventHandler handler);
+  virtual void unobserve(const std::string &topic_name, const std::string &ref);
+
+  // Hosting of the topics of other guids. add() of a topic with a hosted guid announces it, and
+  // unhost() removes the topics of the guid and announces that it exited.
+  virtual void host(const std::string &guid);
+  virtual void unhost(const std::string &guid);
+  virtual void remove(const std::string &topic_name, const std::string &guid);
+
+  // Intra-process delivery to subscribers of topics published by this directory's node.
+  inline bool intraProcess() const { return intra_process_; }
+  inline void setIntraProcess(bool intra_process) { intra_process_ = intra_process; }
+  std::string attachLocal(const std::string &topic_name, LocalDeliveryHandler handler);
+  void detachLocal(const std::string &topic_name, const std::string &ref);
+  // Returns true if the message was handed to at least one local subscriber.
+  bool deliverLocal(const std::string &topic_name, const azmq::message_vector &message);
+
+  // Encoding of the datagrams this directory sends. It reads both.
+  virtual DiscoveryProtocol discoveryProtocol() const { return protocol_; }
+  virtual void setDiscoveryProtocol(DiscoveryProtocol protocol) { protocol_ = protocol; }
+  // Whether text datagrams are sent, which in AUTO mode is once another node has sent one.
+  inline bool sendsText() const {
+    return protocol_ == DiscoveryProtocol::TEXT ||
+           (protocol_ == DiscoveryProtocol::AUTO && text_peers_);
+  }
+  inline bool sendsBinary() const { return protocol_ != DiscoveryProtocol::TEXT; }
+
+  // Liveness (see above). An interval of zero sends no heartbeats.
+  virtual std::chrono::milliseconds heartbeatInterval() const { return heartbeatInterval_; }
+  virtual std::chrono::milliseconds lease() const { return lease_; }
+  virtual void setHeartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds lease);
+
+  // Preloads topics, so that clients connect to them at once rather than after discovery. Each line
+  // is "<topic> <socket type> <address> [<input types> <output types>]", as in a
+  // DISCOVERY_AVAILABLE, and '#' starts a comment. The topics are held under MANIFEST_GUID and
+  // searched for. Each one is replaced when its node announces it, and those still unannounced
+  // after the lease are evicted. Returns the number of topics loaded, and throws
+  // std::runtime_error for a malformed line. DISPATCH_MANIFEST and DISPATCH_MANIFEST_TOPICS are
+  // loaded by the constructor.
+  virtual size_t loadManifest(std::istream &manifest,
+                              std::chrono::milliseconds lease =
+                                  std::chrono::milliseconds(DEFAULT_MANIFEST_LEASE_MS));
+  size_t loadManifestFile(const std::string &path,
+                          std::chrono::milliseconds lease =
+                              std::chrono::milliseconds(DEFAULT_MANIFEST_LEASE_MS));
 
   void handleEvent(char *event);
+  void handleDatagram(const char *data, size_t size);
   void discoveryExit(const char *guid, char *data);
   void discoveryAvailable(const char *guid, char *data);
   void discoveryRemove(const char *guid, char *data);
   void discoverySearch(const char *guid, char *data);
+  void discoveryHeartbeat(const char *guid, char *data);
 
-  // Send message to other directories
+  // Send a text command to other directories
   inline void broadcast(const char command, const std::string &args = "") {
     send(multicastEndpoint_, command, args);
   }
@@ -128,15 +260,37 @@ class Directory {
                              const std::set<message_type> &outputTypes);
 
  protected:
+  // Without a multicast socket, for directories that leave discovery to another one. They send
+  // nothing.
+  struct NoSocket {};
+  Directory(boost::asio::io_service &ios, const std::string &name, NoSocket);
+
   void receive();
   virtual void send(const boost::asio::ip::udp::endpoint &endpoint, const char command,
                     const std::string &args = "");
+  void sendText(const boost::asio::ip::udp::endpoint &endpoint, const std::string &guid,
+                const char command, const std::string &args);
 
   void event(const boost::system::error_code &error, size_t bytes);
 
   void startQueryTimer();
   void queryMissingTopics(const boost::system::error_code &ec);
 
+  // Sends the commands in the protocols this directory uses.
+  void announce(const std::vector<DiscoveryRecord> &records);
+  void announce(const std::vector<DiscoveryRecord> &records, const std::string &guid);
+  void sendDatagram(const boost::asio::ip::udp::endpoint &endpoint, const std::string &datagram);
+  void available(const std::string &guid, const DiscoveryRecord &record);
+  void search(const std::vector<std::string> &names);
+
+  void startHeartbeatTimer();
+  void heartbeat(const boost::system::error_code &ec);
+  // Starts, renews or, with a lease of zero, ends the lease of a node that sends heartbeats.
+  void heartbeatReceived(const std::string &guid, std::chrono::milliseconds lease);
+  // Renews the lease of a node that has one, whenever anything is heard from it.
+  void renewLease(const std::string &guid);
+  void expireLeases();
+
   void writeTypes(std::ostream &, const std::set<message_type> &types);
   void parseTypes(std::set<message_type> &types, const std::string &str);
 
@@ -160,8 +314,34 @@ class Directory {
   bool queryTimerActive_ = false;
   std::function<void(const boost::system::error_code &ec)> queryFn_;
 
+  struct Lease {
+    std::chrono::milliseconds duration;
+    std::chrono::steady_clock::time_point expiry;
+  };
+  boost::asio::deadline_timer heartbeatTimer_;
+  std::chrono::milliseconds heartbeatInterval_{DEFAULT_HEARTBEAT_MS};
+  std::chrono::milliseconds lease_{DEFAULT_LEASE_MS};
+  // Leases of the nodes that send heartbeats, by guid.
+  std::unordered_map<std::string, Lease> leases_;
+
+  // Topics of the hosted guids by name, by guid.
+  std::unordered_map<std::string, std::map<std::string, DirectoryTopic>> hosted_;
+
   uint16_t nextServerPort_ = 0;
 
+  DiscoveryProtocol protocol_ = DEFAULT_DISCOVERY_PROTOCOL;
+  std::atomic<bool> text_peers_{false};
+  // Nodes that have sent binary datagrams. Their text datagrams repeat the binary ones, so they are
+  // ignored, and don't make this directory send text.
+  std::unordered_set<std::string> binary_peers_;
+
+  bool intra_process_ = DEFAULT_INTRA_PROCESS;
+  std::multimap<std::string, LocalDelivery> local_deliveries_;
+
+  // Recursive, since observers may call back into the directory.
+  std::recursive_mutex mutex_;
+
+  void init();
   void _send(const boost::asio::ip::udp::endpoint &endpoint, char *buf, size_t pos, size_t len);
   size_t nextToken(char *event, size_t start);
 };
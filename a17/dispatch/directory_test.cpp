@@ -4,6 +4,7 @@
 
 #include "directory.h"
 #include "message_helpers.h"
+#include "shared_directory.h"
 
 namespace a17 {
 namespace dispatch {
@@ -75,6 +76,40 @@ TEST_CASE("Query topic", "[directory]") {
   t1.join();
 }
 
+TEST_CASE("Observe pattern late", "[directory]") {
+  boost::asio::io_service ios1;
+  a17::dispatch::Directory directory1(ios1, "test1", TEST_PORT, TEST_MULTICAST);
+  directory1.add("TEST/LATE/TOPIC", ZMQ_PUB, a17::dispatch::Address(45455), {}, {},
+                 directory1.guid());
+  std::thread t1([&ios1]() {
+    boost::asio::deadline_timer timer(ios1);
+    timer.expires_from_now(boost::posix_time::seconds(2));
+    timer.async_wait([&](const boost::system::error_code &ec) { ios1.stop(); });
+    ios1.run();
+  });
+  // Join after the topic was announced, so that only a search finds it.
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+
+  boost::asio::io_service ios2;
+  a17::dispatch::Directory directory2(ios2, "test2", TEST_PORT, TEST_MULTICAST);
+  bool received = false;
+  directory2.observe("TEST/LATE/*", [&](const std::string &topic_name,
+                                        const a17::dispatch::GuidTopicMap &guid_topic_map) {
+    if (topic_name != "TEST/LATE/TOPIC" || !guid_topic_map.count(directory1.guid())) return;
+    received = true;
+    ios2.stop();
+  });
+
+  boost::asio::deadline_timer timer(ios2);
+  timer.expires_from_now(boost::posix_time::seconds(1));
+  timer.async_wait([&ios2](const boost::system::error_code &ec) { ios2.stop(); });
+  ios2.run();
+
+  CHECK(received);
+
+  t1.join();
+}
+
 TEST_CASE("Discovery Search", "[directory]") {
   boost::asio::io_service ios;
   TestDirectory directory(ios);
@@ -109,6 +144,217 @@ TEST_CASE("Discovery Exit", "[directory]") {
   REQUIRE(directory.topics().size() == 0);
 }
 
+TEST_CASE("Lease expiry", "[directory]") {
+  char buf[a17::dispatch::EVENT_BUFFER_SIZE + 1];
+
+  boost::asio::io_service ios;
+  a17::dispatch::Directory directory(ios, "test", TEST_PORT, TEST_MULTICAST);
+  directory.setHeartbeat(std::chrono::milliseconds(20), std::chrono::milliseconds(60));
+
+  // A node without heartbeats is kept, one with a lease is evicted once the lease runs out.
+  sprintf(buf, "DISPATCH legacy-guid A TEST/LEGACY PUB tcp://%s:40961 - 41",
+          a17::dispatch::OwnAddress::instance().address().c_str());
+  directory.handleEvent(buf);
+  sprintf(buf, "DISPATCH some-other-guid A TEST/TOPIC PUB tcp://%s:40960 - 41",
+          a17::dispatch::OwnAddress::instance().address().c_str());
+  directory.handleEvent(buf);
+  strcpy(buf, "DISPATCH some-other-guid H 100");
+  auto start = std::chrono::steady_clock::now();
+  directory.handleEvent(buf);
+  REQUIRE(directory.topics().size() == 2);
+
+  bool evicted = false;
+  directory.observe("TEST/TOPIC", [&](const std::string &topic_name,
+                                      const a17::dispatch::GuidTopicMap &guid_topic_map) {
+    if (guid_topic_map.empty()) {
+      evicted = true;
+      ios.stop();
+    }
+  });
+
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::seconds(2));
+  timer.async_wait([&ios](const boost::system::error_code &ec) { ios.stop(); });
+
+  ios.run();
+  REQUIRE(evicted);
+  CHECK(std::chrono::steady_clock::now() - start >= std::chrono::milliseconds(100));
+  CHECK(directory.topics().size() == 1);
+  CHECK(directory.topics().hasTopic("TEST/LEGACY"));
+}
+
+TEST_CASE("Topic manifest", "[directory]") {
+  const std::string ip = a17::dispatch::OwnAddress::instance().address();
+  std::istringstream manifest("# Preloaded topics\n"
+                              "TEST/VERIFIED PUB tcp://" + ip + ":40960 . 41\n"
+                              "\n"
+                              "TEST/STALE REP tcp://" + ip + ":40961  # Not announced\n");
+
+  boost::asio::io_service ios;
+  TestDirectory directory(ios);
+  directory.setDiscoveryProtocol(a17::dispatch::DiscoveryProtocol::TEXT);
+  directory.setHeartbeat(std::chrono::milliseconds(20), std::chrono::milliseconds(60));
+  REQUIRE(directory.loadManifest(manifest, std::chrono::milliseconds(100)) == 2);
+  REQUIRE(directory.topics().size() == 2);
+  // The topics are searched for, to be verified.
+  CHECK(directory.command_ == a17::dispatch::DISCOVERY_SEARCH);
+
+  std::map<std::string, a17::dispatch::GuidTopicMap> seen;
+  auto observer = [&](const std::string &topic_name,
+                      const a17::dispatch::GuidTopicMap &guid_topic_map) {
+    seen[topic_name] = guid_topic_map;
+  };
+  directory.observe("TEST/VERIFIED", observer);
+  directory.observe("TEST/STALE", observer);
+  ios.poll();
+  REQUIRE(seen["TEST/VERIFIED"].count(a17::dispatch::MANIFEST_GUID) == 1);
+  CHECK(seen["TEST/VERIFIED"].at(a17::dispatch::MANIFEST_GUID).outputTypes.count("41") == 1);
+  REQUIRE(seen["TEST/STALE"].count(a17::dispatch::MANIFEST_GUID) == 1);
+
+  // The node of a topic replaces its manifest entry.
+  char buf[a17::dispatch::EVENT_BUFFER_SIZE + 1];
+  sprintf(buf, "DISPATCH some-other-guid A TEST/VERIFIED PUB tcp://%s:40962 . 41", ip.c_str());
+  directory.handleEvent(buf);
+  REQUIRE(seen["TEST/VERIFIED"].size() == 1);
+  CHECK(seen["TEST/VERIFIED"].at("some-other-guid").address == "tcp://" + ip + ":40962");
+
+  // Entries that no node announces are evicted after the lease.
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::milliseconds(500));
+  timer.async_wait([&ios](const boost::system::error_code &ec) { ios.stop(); });
+  ios.run();
+  CHECK(seen["TEST/STALE"].empty());
+  CHECK(directory.topics().size() == 1);
+
+  std::istringstream malformed("TEST/BAD NOT_A_SOCKET tcp://" + ip + ":40963\n");
+  CHECK_THROWS_AS(directory.loadManifest(malformed), std::runtime_error);
+}
+
+TEST_CASE("Shared directory", "[directory]") {
+  const std::string address = "tcp://" + a17::dispatch::OwnAddress::instance().address();
+  auto shared = a17::dispatch::SharedDirectory::instance(TEST_PORT, TEST_MULTICAST);
+  REQUIRE(a17::dispatch::SharedDirectory::instance() == shared);
+
+  boost::asio::io_service ios1;
+  boost::asio::io_service ios2;
+  auto view1 = std::make_unique<a17::dispatch::DirectoryView>(ios1, "test1", shared);
+  a17::dispatch::DirectoryView view2(ios2, "test2", shared);
+  REQUIRE(view1->guid() != view2.guid());
+
+  // Settings are those of the shared directory.
+  view1->setHeartbeat(std::chrono::milliseconds(500), std::chrono::milliseconds(1500));
+  CHECK(view2.heartbeatInterval() == std::chrono::milliseconds(500));
+  CHECK(view2.lease() == std::chrono::milliseconds(1500));
+
+  // Both nodes may publish a topic, as they could with directories of their own.
+  view1->add("TEST/SHARED", ZMQ_PUB, address + ":40970", {}, {}, view1->guid());
+  view2.add("TEST/SHARED", ZMQ_PUB, address + ":40971", {}, {}, view2.guid());
+
+  std::thread::id observer_thread;
+  a17::dispatch::GuidTopicMap seen;
+  view2.observe("TEST/SHARED", [&](const std::string &topic_name,
+                                   const a17::dispatch::GuidTopicMap &guid_topic_map) {
+    observer_thread = std::this_thread::get_id();
+    seen = guid_topic_map;
+    ios2.stop();
+  });
+  auto run = [&ios2]() {
+    boost::asio::deadline_timer timer(ios2);
+    timer.expires_from_now(boost::posix_time::seconds(2));
+    timer.async_wait([&ios2](const boost::system::error_code &ec) { ios2.stop(); });
+    ios2.reset();
+    ios2.run();
+  };
+
+  // Observers are called on the io_service of their view.
+  run();
+  CHECK(observer_thread == std::this_thread::get_id());
+  REQUIRE(seen.size() == 2);
+  CHECK(seen.at(view1->guid()).address == address + ":40970");
+
+  // The topics of a view go with it.
+  view1.reset();
+  run();
+  REQUIRE(seen.size() == 1);
+  CHECK(seen.count(view2.guid()) == 1);
+}
+
+TEST_CASE("Binary discovery", "[directory]") {
+  const std::string address =
+      "tcp://" + a17::dispatch::OwnAddress::instance().address() + ":40960";
+  std::vector<a17::dispatch::DiscoveryRecord> records;
+  for (int i = 0; i < 100; i++) {
+    a17::dispatch::DiscoveryRecord record;
+    record.command = a17::dispatch::DISCOVERY_AVAILABLE;
+    record.name = "TEST/BINARY/" + std::to_string(i);
+    record.socketType = ZMQ_PUB;
+    record.address = address;
+    record.outputTypes = {"17488419364809454706"};
+    records.push_back(record);
+  }
+  a17::dispatch::DiscoveryRecord search;
+  search.command = a17::dispatch::DISCOVERY_SEARCH;
+  search.name = "*";
+  records.push_back(search);
+
+  auto datagrams = a17::dispatch::encodeDiscovery("some-other-guid", records);
+  // Many topics per datagram, each under the size limit.
+  REQUIRE(datagrams.size() > 1);
+  REQUIRE(datagrams.size() < 10);
+  std::vector<a17::dispatch::DiscoveryRecord> decoded;
+  for (const auto &datagram : datagrams) {
+    REQUIRE(datagram.size() <= a17::dispatch::EVENT_BUFFER_SIZE);
+    REQUIRE(a17::dispatch::isBinaryDiscovery(datagram.data(), datagram.size()));
+    std::string guid;
+    REQUIRE(a17::dispatch::decodeDiscovery(datagram.data(), datagram.size(), guid, decoded));
+    REQUIRE(guid == "some-other-guid");
+  }
+  REQUIRE(decoded.size() == records.size());
+  CHECK(decoded[42].name == "TEST/BINARY/42");
+  CHECK(decoded[42].socketType == ZMQ_PUB);
+  CHECK(decoded[42].address == address);
+  CHECK(decoded[42].inputTypes.empty());
+  CHECK(decoded[42].outputTypes == records[42].outputTypes);
+  CHECK(decoded.back().command == a17::dispatch::DISCOVERY_SEARCH);
+  CHECK(decoded.back().name == "*");
+
+  // Truncated datagrams and text are rejected.
+  std::string guid;
+  std::vector<a17::dispatch::DiscoveryRecord> rejected;
+  CHECK(!a17::dispatch::decodeDiscovery(datagrams[0].data(), datagrams[0].size() - 1, guid,
+                                        rejected));
+  const char text[] = "DISPATCH some-other-guid X";
+  CHECK(!a17::dispatch::isBinaryDiscovery(text, sizeof(text) - 1));
+
+  boost::asio::io_service ios;
+  TestDirectory directory(ios);
+  REQUIRE(directory.discoveryProtocol() == a17::dispatch::DiscoveryProtocol::AUTO);
+  for (const auto &datagram : datagrams) {
+    directory.handleDatagram(datagram.data(), datagram.size());
+  }
+  REQUIRE(directory.topics().size() == 100);
+  REQUIRE(!directory.sendsText());
+
+  a17::dispatch::DiscoveryRecord exit;
+  exit.command = a17::dispatch::DISCOVERY_EXIT;
+  auto exit_datagram = a17::dispatch::encodeDiscovery("some-other-guid", {exit});
+  REQUIRE(exit_datagram.size() == 1);
+  directory.handleDatagram(exit_datagram[0].data(), exit_datagram[0].size());
+  REQUIRE(directory.topics().size() == 0);
+
+  // Text from a node that also sends binary repeats its binary datagrams, and is ignored.
+  char buf[a17::dispatch::EVENT_BUFFER_SIZE + 1];
+  sprintf(buf, "DISPATCH some-other-guid A TEST/TEXT PUB %s - 41", address.c_str());
+  directory.handleEvent(buf);
+  CHECK(directory.topics().size() == 0);
+  CHECK(!directory.sendsText());
+
+  // A node that only speaks text makes the directory answer in text as well.
+  strcpy(buf, "DISPATCH text-only-guid S TEST/NONE");
+  directory.handleEvent(buf);
+  CHECK(directory.sendsText());
+}
+
 }  // namespace test
 }  // namespace dispatch
 }  // namespace a17
@@ -0,0 +1,233 @@
+#include "discovery_protocol.h"
+
+#include <cstring>
+#include <limits>
+#include <map>
+#include <stdexcept>
+
+namespace a17 {
+namespace dispatch {
+
+namespace {
+
+// A binary datagram is, with integers little-endian:
+//   "DSPB" | version u8 | guid size u16 | guid
+//   type count u16 | (size u16 | type)*
+//   (command u8 | size u16 | value)*
+// The value of an available record is:
+//   socket type u8 | name size u16 | name | address size u16 | address
+//   input count u16 | type index u16* | output count u16 | type index u16*
+// and the value of the other records is their name. Types are indexes into the datagram's table.
+const char BINARY_MAGIC[4] = {'D', 'S', 'P', 'B'};
+const size_t MAX_FIELD_SIZE = std::numeric_limits<uint16_t>::max();
+
+void putU8(std::string &out, uint8_t value) { out.push_back(static_cast<char>(value)); }
+
+void putU16(std::string &out, size_t value) {
+  if (value > MAX_FIELD_SIZE) {
+    throw std::runtime_error("Discovery field of " + std::to_string(value) + " is too large");
+  }
+  out.push_back(static_cast<char>(value & 0xff));
+  out.push_back(static_cast<char>((value >> 8) & 0xff));
+}
+
+void putString(std::string &out, const std::string &str) {
+  putU16(out, str.size());
+  out += str;
+}
+
+// Reads fields from a datagram, failing once any read goes past its end.
+class Reader {
+ public:
+  Reader(const char *data, size_t size)
+      : data_(reinterpret_cast<const uint8_t *>(data)), size_(size) {}
+
+  inline bool ok() const { return ok_; }
+  inline bool done() const { return pos_ >= size_; }
+
+  uint8_t u8() {
+    if (!have(1)) return 0;
+    return data_[pos_++];
+  }
+
+  uint16_t u16() {
+    if (!have(2)) return 0;
+    uint16_t value = data_[pos_] | (data_[pos_ + 1] << 8);
+    pos_ += 2;
+    return value;
+  }
+
+  std::string bytes(size_t size) {
+    if (!have(size)) return std::string();
+    std::string str(reinterpret_cast<const char *>(data_ + pos_), size);
+    pos_ += size;
+    return str;
+  }
+
+  std::string string() { return bytes(u16()); }
+
+ private:
+  bool have(size_t size) {
+    if (ok_ && pos_ + size <= size_) return true;
+    ok_ = false;
+    return false;
+  }
+
+  const uint8_t *data_;
+  size_t size_;
+  size_t pos_ = 0;
+  bool ok_ = true;
+};
+
+// Types of a datagram being encoded, by index.
+struct TypeTable {
+  std::vector<message_type> types;
+  std::map<message_type, uint16_t> index;
+  size_t size = 2;
+
+  uint16_t intern(const message_type &type) {
+    auto iter = index.find(type);
+    if (iter != index.end()) return iter->second;
+    uint16_t i = static_cast<uint16_t>(types.size());
+    index[type] = i;
+    types.push_back(type);
+    size += 2 + type.size();
+    return i;
+  }
+};
+
+void putTypes(std::string &out, TypeTable &table, const std::set<message_type> &types) {
+  putU16(out, types.size());
+  for (const auto &type : types) {
+    putU16(out, table.intern(type));
+  }
+}
+
+std::string encodeRecord(const DiscoveryRecord &record, TypeTable &table) {
+  std::string value;
+  if (record.command == DISCOVERY_AVAILABLE) {
+    putU8(value, static_cast<uint8_t>(record.socketType));
+    putString(value, record.name);
+    putString(value, record.address);
+    putTypes(value, table, record.inputTypes);
+    putTypes(value, table, record.outputTypes);
+  } else {
+    value = record.name;
+  }
+
+  std::string encoded;
+  putU8(encoded, static_cast<uint8_t>(record.command));
+  putString(encoded, value);
+  return encoded;
+}
+
+bool readTypes(Reader &reader, const std::vector<message_type> &table,
+               std::set<message_type> &types) {
+  uint16_t count = reader.u16();
+  for (uint16_t i = 0; i < count && reader.ok(); i++) {
+    uint16_t index = reader.u16();
+    if (index >= table.size()) return false;
+    types.insert(table[index]);
+  }
+  return reader.ok();
+}
+
+}  // namespace
+
+DiscoveryProtocol discoveryProtocolFromName(const std::string &name) {
+  if (name == "text") return DiscoveryProtocol::TEXT;
+  if (name == "binary") return DiscoveryProtocol::BINARY;
+  return DiscoveryProtocol::AUTO;
+}
+
+std::vector<std::string> encodeDiscovery(const std::string &guid,
+                                         const std::vector<DiscoveryRecord> &records,
+                                         size_t max_size) {
+  std::string header(BINARY_MAGIC, sizeof(BINARY_MAGIC));
+  putU8(header, DISCOVERY_VERSION);
+  putString(header, guid);
+
+  std::vector<std::string> datagrams;
+  size_t next = 0;
+  while (next < records.size()) {
+    TypeTable table;
+    std::string body;
+    size_t first = next;
+    for (; next < records.size(); next++) {
+      // Types are only kept in the table if the record fits.
+      TypeTable extended = table;
+      std::string record = encodeRecord(records[next], extended);
+      if (header.size() + extended.size + body.size() + record.size() > max_size) {
+        if (next == first) {
+          throw std::runtime_error("Discovery record for " + records[next].name +
+                                   " does not fit in a datagram");
+        }
+        break;
+      }
+      table = std::move(extended);
+      body += record;
+    }
+
+    std::string datagram = header;
+    putU16(datagram, table.types.size());
+    for (const auto &type : table.types) {
+      putString(datagram, type);
+    }
+    datagrams.push_back(datagram + body);
+  }
+  return datagrams;
+}
+
+bool isBinaryDiscovery(const char *data, size_t size) {
+  return size > sizeof(BINARY_MAGIC) && memcmp(data, BINARY_MAGIC, sizeof(BINARY_MAGIC)) == 0;
+}
+
+bool decodeDiscovery(const char *data, size_t size, std::string &guid,
+                     std::vector<DiscoveryRecord> &records) {
+  if (!isBinaryDiscovery(data, size)) return false;
+  Reader reader(data + sizeof(BINARY_MAGIC), size - sizeof(BINARY_MAGIC));
+  if (reader.u8() != DISCOVERY_VERSION) return false;
+  guid = reader.string();
+
+  std::vector<message_type> types(reader.u16());
+  for (auto &type : types) {
+    if (!reader.ok()) break;
+    type = reader.string();
+  }
+
+  while (reader.ok() && !reader.done()) {
+    char command = static_cast<char>(reader.u8());
+    std::string value = reader.string();
+    if (!reader.ok()) break;
+
+    DiscoveryRecord record;
+    record.command = command;
+    switch (command) {
+      case DISCOVERY_AVAILABLE: {
+        Reader fields(value.data(), value.size());
+        record.socketType = fields.u8();
+        record.name = fields.string();
+        record.address = fields.string();
+        if (!readTypes(fields, types, record.inputTypes) ||
+            !readTypes(fields, types, record.outputTypes)) {
+          return false;
+        }
+        break;
+      }
+      case DISCOVERY_SEARCH:
+      case DISCOVERY_REMOVE:
+      case DISCOVERY_EXIT:
+      case DISCOVERY_HEARTBEAT:
+        record.name = value;
+        break;
+      default:
+        // A command of a later version.
+        continue;
+    }
+    records.push_back(std::move(record));
+  }
+  return reader.ok() && !guid.empty();
+}
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "defs.h"
+
+namespace a17 {
+namespace dispatch {
+
+const char DISCOVERY_EXIT = 'X';
+const char DISCOVERY_AVAILABLE = 'A';
+const char DISCOVERY_REMOVE = 'R';
+const char DISCOVERY_SEARCH = 'S';
+const char DISCOVERY_HEARTBEAT = 'H';
+const size_t EVENT_BUFFER_SIZE = 1500;
+
+// Encoding of the datagrams that a Directory sends. Directories read both.
+//   TEXT: "DISPATCH <guid> <command> <args>", one topic per datagram, as read by every version of
+//     dispatch, including the Python one.
+//   BINARY: a versioned header followed by records, so that one datagram carries as many topics as
+//     fit in it, with the message types of its topics listed once (see encodeDiscovery()).
+//   AUTO: binary, and text as well once a text datagram has been received from another node.
+enum class DiscoveryProtocol {
+  TEXT,
+  BINARY,
+  AUTO,
+};
+
+// Version of the binary encoding. Datagrams of other versions are ignored.
+const uint8_t DISCOVERY_VERSION = 1;
+
+// "text", "binary" or "auto". Unknown names are AUTO.
+DiscoveryProtocol discoveryProtocolFromName(const std::string &name);
+
+// Set DISPATCH_DISCOVERY=text for networks with nodes that must not receive binary datagrams.
+const DiscoveryProtocol DEFAULT_DISCOVERY_PROTOCOL =
+    discoveryProtocolFromName(std::getenv("DISPATCH_DISCOVERY") ? std::getenv("DISPATCH_DISCOVERY")
+                                                                : "auto");
+
+// One command of a discovery datagram. Only DISCOVERY_AVAILABLE uses the fields after name;
+// DISCOVERY_SEARCH names a topic or "*", DISCOVERY_REMOVE a topic, DISCOVERY_HEARTBEAT the lease
+// of the sender in milliseconds, and DISCOVERY_EXIT nothing.
+struct DiscoveryRecord {
+  char command = 0;
+  std::string name;
+  int socketType = 0;
+  std::string address;
+  std::set<message_type> inputTypes;
+  std::set<message_type> outputTypes;
+};
+
+// Encodes records into as few binary datagrams of at most max_size bytes as they fit in, in order.
+// Throws std::runtime_error if a record doesn't fit in a datagram by itself.
+std::vector<std::string> encodeDiscovery(const std::string &guid,
+                                         const std::vector<DiscoveryRecord> &records,
+                                         size_t max_size = EVENT_BUFFER_SIZE);
+
+// Whether the datagram is binary, whatever its version.
+bool isBinaryDiscovery(const char *data, size_t size);
+
+// Decodes a binary datagram of this version. Records with commands this version doesn't know are
+// skipped. Returns false if the datagram is of another version or malformed.
+bool decodeDiscovery(const char *data, size_t size, std::string &guid,
+                     std::vector<DiscoveryRecord> &records);
+
+}  // namespace dispatch
+}  // namespace a17
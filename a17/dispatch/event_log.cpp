@@ -0,0 +1,117 @@
+#include "event_log.h"
+
+#include <cstring>
+#include <stdexcept>
+
+#include "message_helpers.h"
+
+namespace a17 {
+namespace dispatch {
+
+static_assert(sizeof(EventLog::Record) == 32, "EventLog records are written as 32 bytes");
+
+std::shared_ptr<EventLog> EventLog::global_;
+std::atomic<bool> EventLog::has_global_{false};
+
+EventLog::EventLog(const std::string &path, size_t capacity,
+                   std::chrono::milliseconds flush_period)
+    : file_(fopen(path.c_str(), "ab")), capacity_(capacity), flush_period_(flush_period) {
+  if (!file_) {
+    throw std::runtime_error("Unable to open event log " + path + ": " + strerror(errno));
+  }
+  pending_.reserve(capacity_);
+  thread_ = std::thread(&EventLog::run, this);
+}
+
+EventLog::~EventLog() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stop_ = true;
+  }
+  cv_.notify_one();
+  thread_.join();
+  fclose(file_);
+}
+
+void EventLog::setGlobal(std::shared_ptr<EventLog> log) {
+  has_global_.store(log != nullptr, std::memory_order_release);
+  std::atomic_store(&global_, std::move(log));
+}
+
+std::shared_ptr<EventLog> EventLog::global() {
+  if (!has_global_.load(std::memory_order_acquire)) return nullptr;
+  return std::atomic_load(&global_);
+}
+
+void EventLog::log(Event event, uint64_t socket, const azmq::message_vector &message) {
+  Record record{};
+  record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+  record.socket = socket;
+  record.event = event;
+  record.frames = static_cast<uint16_t>(message.size());
+  if (!message.empty() && message[0].size() >= sizeof(unsigned long long)) {
+    record.message_id = idFromSmartMessage(message);
+    record.flags = static_cast<uint8_t>(flagsFromSmartMessage(message));
+  }
+  size_t bytes = 0;
+  for (const auto &frame : message) bytes += frame.size();
+  record.bytes = static_cast<uint32_t>(bytes);
+  push(&record, 1);
+}
+
+void EventLog::name(uint64_t socket, const std::string &name) {
+  size_t name_records = (name.size() + sizeof(Record) - 1) / sizeof(Record);
+  std::vector<Record> records(1 + name_records);
+  records[0].time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                           std::chrono::steady_clock::now().time_since_epoch())
+                           .count();
+  records[0].socket = socket;
+  records[0].bytes = static_cast<uint32_t>(name.size());
+  records[0].event = NAME;
+  memcpy(&records[1], name.data(), name.size());
+  push(records.data(), records.size());
+}
+
+void EventLog::push(const Record *records, size_t count) {
+  bool notify;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (pending_.size() + count > capacity_) {
+      dropped_ += count;
+      return;
+    }
+    pending_.insert(pending_.end(), records, records + count);
+    notify = pending_.size() >= capacity_ / 2;
+  }
+  // Write early rather than wait out the period and drop events.
+  if (notify) cv_.notify_one();
+}
+
+void EventLog::run() {
+  std::vector<Record> writing;
+  writing.reserve(capacity_);
+  for (;;) {
+    bool stop;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait_for(lock, flush_period_,
+                   [this]() { return stop_ || pending_.size() >= capacity_ / 2; });
+      writing.swap(pending_);
+      stop = stop_;
+    }
+
+    if (!writing.empty()) {
+      size_t count = fwrite(writing.data(), sizeof(Record), writing.size(), file_);
+      fflush(file_);
+      written_ += count;
+      dropped_ += writing.size() - count;
+      writing.clear();
+    }
+    if (stop) return;
+  }
+}
+
+}  // namespace dispatch
+}  // namespace a17
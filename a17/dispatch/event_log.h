@@ -0,0 +1,98 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "defs.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Binary log of message metadata, for finding out after the fact what a node sent and received
+// and when, at a cost low enough to leave on in message-heavy nodes. Events are buffered in memory
+// and appended to the file by a background thread. If the buffer fills up faster than it is
+// written, further events are dropped and counted.
+//
+// The file is a sequence of 32-byte EventLog::Records. A NAME record gives the name of a socket
+// id; it is followed by ceil(bytes / 32) records that hold the name's characters.
+//
+// Sockets log to the global event log, if one is set:
+//   EventLog::setGlobal(std::make_shared<EventLog>("/tmp/node.events"));
+class EventLog {
+ public:
+  enum Event : uint8_t {
+    SEND = 1,
+    RECEIVE = 2,
+    SEND_ERROR = 3,
+    // Skipped by a keep-last socket.
+    DROP = 4,
+    NAME = 5,
+  };
+
+  struct Record {
+    // Steady clock time in nanoseconds.
+    int64_t time_ns;
+    // Capnp id of the smart message.
+    uint64_t message_id;
+    // Id of the socket, see NAME records.
+    uint64_t socket;
+    // Total size of the message's frames.
+    uint32_t bytes;
+    uint16_t frames;
+    uint8_t event;
+    // Low byte of the SmartMessageFlags.
+    uint8_t flags;
+  };
+
+  // @param path file that events are appended to
+  // @param capacity events buffered between writes
+  // @param flush_period time between writes
+  explicit EventLog(const std::string &path, size_t capacity = 64 * 1024,
+                    std::chrono::milliseconds flush_period = std::chrono::milliseconds(100));
+  // Writes the buffered events.
+  ~EventLog();
+
+  EventLog(const EventLog &) = delete;
+  EventLog &operator=(const EventLog &) = delete;
+
+  void log(Event event, uint64_t socket, const azmq::message_vector &message);
+  void name(uint64_t socket, const std::string &name);
+
+  inline uint64_t written() const { return written_.load(); }
+  inline uint64_t dropped() const { return dropped_.load(); }
+
+  // The log that sockets write to, or null. Sockets hold the log while they write to it, so it may be
+  // unset or replaced at any time, and is destroyed once the last of them is done with it.
+  static void setGlobal(std::shared_ptr<EventLog> log);
+  static std::shared_ptr<EventLog> global();
+
+ private:
+  void run();
+  void push(const Record *records, size_t count);
+
+  FILE *file_;
+  size_t capacity_;
+  std::chrono::milliseconds flush_period_;
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::vector<Record> pending_;
+  bool stop_ = false;
+  std::atomic<uint64_t> written_{0};
+  std::atomic<uint64_t> dropped_{0};
+  std::thread thread_;
+
+  // Only accessed with std::atomic_load() and std::atomic_store().
+  static std::shared_ptr<EventLog> global_;
+  // Whether global_ is set, so that sockets don't take the lock of its atomic load without a log.
+  static std::atomic<bool> has_global_;
+};
+
+}  // namespace dispatch
+}  // namespace a17
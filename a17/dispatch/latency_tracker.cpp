@@ -0,0 +1,99 @@
+#include "latency_tracker.h"
+
+namespace a17 {
+namespace dispatch {
+
+void LatencyHistogram::record(int64_t ns) {
+  if (ns < 0) ns = 0;
+  size_t bucket = 0;
+  for (int64_t us = ns / 1000; us > 0 && bucket < BUCKET_COUNT - 1; us >>= 1) {
+    bucket++;
+  }
+  buckets_[bucket]++;
+  count_++;
+  sum_ns_ += ns;
+  if (ns > max_ns_) max_ns_ = ns;
+}
+
+void LatencyHistogram::reset() { *this = LatencyHistogram(); }
+
+int64_t LatencyHistogram::percentileNs(double fraction) const {
+  if (!count_) return 0;
+  uint64_t target = static_cast<uint64_t>(fraction * count_);
+  uint64_t total = 0;
+  for (size_t bucket = 0; bucket < BUCKET_COUNT - 1; bucket++) {
+    total += buckets_[bucket];
+    if (total > target) return (int64_t(1) << bucket) * 1000;
+  }
+  return max_ns_;
+}
+
+bool LatencyTracker::record(const azmq::message_vector &message, int64_t monotonic_ns,
+                            int64_t realtime_ns) {
+  SmartMessageTrace trace;
+  if (!traceFromSmartMessage(message, trace)) return false;
+
+  std::lock_guard<std::mutex> lock(mutex_);
+  traced_++;
+  if (trace.host_id == traceHostId()) {
+    latency_.record(monotonic_ns - trace.monotonic_ns);
+  } else {
+    latency_.record(realtime_ns - trace.realtime_ns);
+  }
+
+  auto iter = next_sequence_.find(trace.publisher_id);
+  if (iter == next_sequence_.end()) {
+    next_sequence_[trace.publisher_id] = trace.sequence + 1;
+    return true;
+  }
+  // Older sequence numbers are duplicates or reordered, neither of which zmq does, so it is most
+  // likely a restarted publisher that happened to get the same id. Start over from it.
+  if (trace.sequence > iter->second) {
+    gaps_++;
+    lost_ += trace.sequence - iter->second;
+  }
+  iter->second = trace.sequence + 1;
+  return true;
+}
+
+void LatencyTracker::recordHandler(int64_t ns) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  handler_time_.record(ns);
+}
+
+void LatencyTracker::reset() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  latency_.reset();
+  handler_time_.reset();
+  traced_ = 0;
+  gaps_ = 0;
+  lost_ = 0;
+}
+
+LatencyHistogram LatencyTracker::latency() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return latency_;
+}
+
+LatencyHistogram LatencyTracker::handlerTime() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return handler_time_;
+}
+
+uint64_t LatencyTracker::traced() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return traced_;
+}
+
+uint64_t LatencyTracker::gaps() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return gaps_;
+}
+
+uint64_t LatencyTracker::lost() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lost_;
+}
+
+}  // namespace dispatch
+}  // namespace a17
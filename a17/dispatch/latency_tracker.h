@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <mutex>
+#include <unordered_map>
+
+#include "defs.h"
+#include "message_helpers.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Counts durations in power-of-two buckets of microseconds: bucket 0 holds durations under 1 μs,
+// and bucket i holds durations from 2^(i-1) to 2^i μs. The last bucket holds everything longer.
+class LatencyHistogram {
+ public:
+  static const size_t BUCKET_COUNT = 32;
+
+  void record(int64_t ns);
+  void reset();
+
+  inline uint64_t count() const { return count_; }
+  inline int64_t maxNs() const { return max_ns_; }
+  inline double meanNs() const { return count_ ? static_cast<double>(sum_ns_) / count_ : 0; }
+  inline const std::array<uint64_t, BUCKET_COUNT> &buckets() const { return buckets_; }
+  // Upper bound, in nanoseconds, of the bucket that holds the given fraction (0 to 1) of durations.
+  int64_t percentileNs(double fraction) const;
+
+ private:
+  std::array<uint64_t, BUCKET_COUNT> buckets_{};
+  uint64_t count_ = 0;
+  int64_t sum_ns_ = 0;
+  int64_t max_ns_ = 0;
+};
+
+// Tracks the traces of the messages received on one topic (see SmartMessageTrace): how long they
+// took from being sent to reaching the handler, how long the handler took, and how many messages
+// went missing, from the gaps in each publisher's sequence numbers.
+// Latency uses the steady clock when the publisher is on the same host, and the system clock,
+// which is only as accurate as the hosts' clock sync, otherwise.
+// Messages are recorded on the subscriber's strand, while the accessors may be called from any
+// thread.
+class LatencyTracker {
+ public:
+  // Records a message that reached the handler at the given steady and system clock times. Returns
+  // false if the message has no trace.
+  bool record(const azmq::message_vector &message, int64_t monotonic_ns, int64_t realtime_ns);
+  void recordHandler(int64_t ns);
+  void reset();
+
+  // Time from send to the handler being called.
+  LatencyHistogram latency();
+  // Time spent in the handler.
+  LatencyHistogram handlerTime();
+  // Number of traced messages received.
+  uint64_t traced();
+  // Number of times a publisher's sequence skipped ahead, and the number of messages skipped.
+  uint64_t gaps();
+  uint64_t lost();
+
+ private:
+  std::mutex mutex_;
+  LatencyHistogram latency_;
+  LatencyHistogram handler_time_;
+  // Next expected sequence number of each publisher.
+  std::unordered_map<uint64_t, uint64_t> next_sequence_;
+  uint64_t traced_ = 0;
+  uint64_t gaps_ = 0;
+  uint64_t lost_ = 0;
+};
+
+}  // namespace dispatch
+}  // namespace a17
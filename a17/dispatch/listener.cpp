@@ -3,6 +3,7 @@
 #include "handlers.h"
 #include "listener.h"
 #include "socket.h"
+#include "trace_log.h"
 
 namespace a17 {
 namespace dispatch {
@@ -11,16 +12,58 @@ Listener::Listener(Socket &socket, SmartMessageHandler handler, ErrorHandler err
     : socket_(socket),
       listener_handler_(bind1(&Listener::onMessage)),
       wrapped_handler_(std::move(handler)),
-      error_handler_(error) {
+      error_handler_(error),
+      self_(std::make_shared<Listener *>(this)) {
   socket_.receive(listener_handler_, error_handler_);
 }
 
 void Listener::onMessage(azmq::message_vector &message) {
-  if (socket_.logger_) socket_.logger_->trace("{0} listener onMessage", socket_.log_name_);
+  if (DISPATCH_SHOULD_TRACE(socket_.logger_)) {
+    socket_.logger_->trace("{0} listener onMessage", socket_.log_name_);
+  }
   wrapped_handler_(message);
   socket_.receive(listener_handler_, error_handler_);
 }
 
+void Listener::deliver(const azmq::message_vector &message) {
+  std::weak_ptr<Listener *> weak_self = self_;
+  if (socket_.keepLast()) {
+    {
+      std::lock_guard<std::mutex> lock(latest_mutex_);
+      if (latest_pending_) {
+        if (auto log = EventLog::global()) {
+          socket_.logEvent(*log, EventLog::DROP, latest_);
+        }
+        latest_ = message;
+        socket_.dropped_++;
+        return;
+      }
+      latest_ = message;
+      latest_pending_ = true;
+    }
+    socket_.strand_.post([weak_self]() {
+      auto self = weak_self.lock();
+      if (self) (*self)->deliverLatest();
+    });
+    return;
+  }
+
+  socket_.strand_.post([weak_self, message]() mutable {
+    auto self = weak_self.lock();
+    if (self) (*self)->socket_.handle((*self)->wrapped_handler_, message);
+  });
+}
+
+void Listener::deliverLatest() {
+  azmq::message_vector message;
+  {
+    std::lock_guard<std::mutex> lock(latest_mutex_);
+    message.swap(latest_);
+    latest_pending_ = false;
+  }
+  socket_.handle(wrapped_handler_, message);
+}
+
 SmartMessageHandler Listener::all(const std::vector<SmartMessageHandler> &handlers) {
   return [handlers](azmq::message_vector &message) {
     for (auto handler = handlers.cbegin(); handler != handlers.cend(); handler++) {
@@ -1,5 +1,8 @@
 #pragma once
 
+#include <memory>
+#include <mutex>
+
 #include "defs.h"
 
 namespace a17 {
@@ -14,6 +17,14 @@ class Listener {
   SmartMessageHandler listener_handler_;
   SmartMessageHandler wrapped_handler_;
   ErrorHandler error_handler_;
+  // Lets messages posted by deliver() detect that the listener was destroyed in the meantime.
+  std::shared_ptr<Listener *> self_;
+  // In keep-last mode, the newest message passed to deliver() that the handler hasn't seen yet.
+  std::mutex latest_mutex_;
+  azmq::message_vector latest_;
+  bool latest_pending_ = false;
+
+  void deliverLatest();
 
  public:
   Listener(Socket &socket, SmartMessageHandler handler, ErrorHandler error);
@@ -22,10 +33,16 @@ class Listener {
       : socket_(other.socket_),
         listener_handler_(std::move(other.listener_handler_)),
         wrapped_handler_(std::move(other.wrapped_handler_)),
-        error_handler_(std::move(other.error_handler_)) {};
+        error_handler_(std::move(other.error_handler_)),
+        self_(std::make_shared<Listener *>(this)) {};
 
   virtual void onMessage(azmq::message_vector &message);
 
+  // Hand a message to the handler without receiving it on the socket. The handler runs later on
+  // the socket's strand, in the same way as messages received through zmq. In keep-last mode, a
+  // message that is replaced by a newer one before the handler runs is dropped.
+  void deliver(const azmq::message_vector &message);
+
   // Return the previous handler and replace it with the new handler.
   void setMessageHandler(SmartMessageHandler handler);
 
@@ -0,0 +1,259 @@
+#include "message_codec.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <vector>
+
+#include <capnp/serialize-packed.h>
+#include <kj/io.h>
+#ifdef A17_DISPATCH_HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef A17_DISPATCH_HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#include "message_helpers.h"
+
+namespace a17 {
+namespace dispatch {
+
+namespace {
+
+// Encoded frames start with the size of the flat frame that they decode to.
+typedef uint64_t RawSize;
+
+// A fast level, since messages are encoded on the publisher's send path.
+const int ZSTD_COMPRESSION_LEVEL = 1;
+
+void FreeEncoded(void *data, void *) { free(data); }
+
+uint32_t codecFlag(MessageCodec codec) {
+  switch (codec) {
+    case MessageCodec::PACKED:
+      return SMART_MESSAGE_PACKED;
+    case MessageCodec::LZ4:
+      return SMART_MESSAGE_LZ4;
+    case MessageCodec::ZSTD:
+      return SMART_MESSAGE_ZSTD;
+    default:
+      return 0;
+  }
+}
+
+// Most bytes that encoding size bytes can take.
+size_t encodedBound(MessageCodec codec, size_t size) {
+  switch (codec) {
+    case MessageCodec::PACKED:
+      // A word of 8 non-zero bytes takes a tag and a run count besides its bytes.
+      return size + size / 4 + sizeof(capnp::word);
+#ifdef A17_DISPATCH_HAVE_LZ4
+    case MessageCodec::LZ4:
+      return LZ4_compressBound(static_cast<int>(size));
+#endif
+#ifdef A17_DISPATCH_HAVE_ZSTD
+    case MessageCodec::ZSTD:
+      return ZSTD_compressBound(size);
+#endif
+    default:
+      return 0;
+  }
+}
+
+// Most that a frame encoded with the codec flagged in flags can expand by, or 0 if there's no bound.
+size_t maxRatio(uint32_t flags) {
+  // A tag and a count stand for up to 256 words of zeros.
+  if (flags & SMART_MESSAGE_PACKED) return 256 * sizeof(capnp::word) / 2;
+  // A match takes at least a byte of length for every 255 bytes that it repeats.
+  if (flags & SMART_MESSAGE_LZ4) return 255;
+  return 0;
+}
+
+// Returns the encoded size, or 0 if encoding failed.
+size_t encode(MessageCodec codec, const uint8_t *src, size_t size, uint8_t *dst, size_t bound) {
+  switch (codec) {
+    case MessageCodec::PACKED: {
+      kj::ArrayOutputStream output(kj::arrayPtr(dst, bound));
+      {
+        capnp::_::PackedOutputStream packed(output);
+        packed.write(src, size);
+      }
+      return output.getArray().size();
+    }
+#ifdef A17_DISPATCH_HAVE_LZ4
+    case MessageCodec::LZ4: {
+      int encoded = LZ4_compress_default(reinterpret_cast<const char *>(src),
+                                         reinterpret_cast<char *>(dst), static_cast<int>(size),
+                                         static_cast<int>(bound));
+      return encoded > 0 ? static_cast<size_t>(encoded) : 0;
+    }
+#endif
+#ifdef A17_DISPATCH_HAVE_ZSTD
+    case MessageCodec::ZSTD: {
+      size_t encoded = ZSTD_compress(dst, bound, src, size, ZSTD_COMPRESSION_LEVEL);
+      return ZSTD_isError(encoded) ? 0 : encoded;
+    }
+#endif
+    default:
+      return 0;
+  }
+}
+
+}  // namespace
+
+CodecStats &CodecStats::operator+=(const CodecStats &other) {
+  messages += other.messages;
+  raw_bytes += other.raw_bytes;
+  encoded_bytes += other.encoded_bytes;
+  encode_ns += other.encode_ns;
+  return *this;
+}
+
+std::string codecName(MessageCodec codec) {
+  switch (codec) {
+    case MessageCodec::NONE:
+      return "none";
+    case MessageCodec::PACKED:
+      return "packed";
+    case MessageCodec::LZ4:
+      return "lz4";
+    case MessageCodec::ZSTD:
+      return "zstd";
+  }
+  return "unknown";
+}
+
+bool codecAvailable(MessageCodec codec) {
+  switch (codec) {
+    case MessageCodec::NONE:
+    case MessageCodec::PACKED:
+      return true;
+    case MessageCodec::LZ4:
+#ifdef A17_DISPATCH_HAVE_LZ4
+      return true;
+#else
+      return false;
+#endif
+    case MessageCodec::ZSTD:
+#ifdef A17_DISPATCH_HAVE_ZSTD
+      return true;
+#else
+      return false;
+#endif
+  }
+  return false;
+}
+
+bool encodeSmartMessage(azmq::message_vector &msg_vec, MessageCodec codec, CodecStats *stats) {
+  if (codec == MessageCodec::NONE || msg_vec.size() < 2) return false;
+  if (!codecAvailable(codec)) {
+    throw std::runtime_error("Codec " + codecName(codec) + " is not available in this build");
+  }
+  if (flagsFromSmartMessage(msg_vec) & (SMART_MESSAGE_SEGMENTED | SMART_MESSAGE_ENCODED)) {
+    return false;
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  const azmq::message &raw = msg_vec[1];
+  RawSize raw_size = raw.size();
+  size_t bound = encodedBound(codec, raw.size());
+  auto buffer = static_cast<uint8_t *>(malloc(sizeof(raw_size) + bound));
+  if (!buffer) {
+    throw std::runtime_error("malloc failed");
+  }
+  memcpy(buffer, &raw_size, sizeof(raw_size));
+  size_t encoded_size = encode(codec, static_cast<const uint8_t *>(raw.data()), raw.size(),
+                               buffer + sizeof(raw_size), bound);
+  // Incompressible messages are sent as they are.
+  if (encoded_size == 0 || encoded_size >= raw.size()) {
+    free(buffer);
+    return false;
+  }
+
+  azmq::nocopy_t nocopy;
+  msg_vec[1] = azmq::message(
+      nocopy, boost::asio::mutable_buffer(buffer, sizeof(raw_size) + encoded_size), nullptr,
+      FreeEncoded);
+
+  // Extend a plain id frame to a SmartMessageHeader, keeping any trace after it.
+  std::vector<uint8_t> id_frame(std::max(msg_vec[0].size(), sizeof(SmartMessageHeader)), 0);
+  memcpy(id_frame.data(), msg_vec[0].data(), msg_vec[0].size());
+  SmartMessageHeader header;
+  memcpy(&header, id_frame.data(), sizeof(header));
+  header.flags |= codecFlag(codec);
+  memcpy(id_frame.data(), &header, sizeof(header));
+  msg_vec[0] = azmq::message(boost::asio::buffer(id_frame));
+
+  if (stats) {
+    stats->messages++;
+    stats->raw_bytes += raw_size;
+    stats->encoded_bytes += sizeof(raw_size) + encoded_size;
+    stats->encode_ns += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+  }
+  return true;
+}
+
+kj::Array<capnp::word> decodeSmartMessageFrame(const azmq::message &frame, uint32_t flags,
+                                               size_t max_size) {
+  RawSize raw_size;
+  if (frame.size() < sizeof(raw_size)) {
+    throw std::runtime_error("Encoded frame is missing its size");
+  }
+  memcpy(&raw_size, frame.data(), sizeof(raw_size));
+  if (raw_size % sizeof(capnp::word) != 0) {
+    throw std::runtime_error("Encoded frame size " + std::to_string(raw_size) +
+                             " is not a whole number of words");
+  }
+
+  auto src = static_cast<const uint8_t *>(frame.data()) + sizeof(raw_size);
+  size_t src_size = frame.size() - sizeof(raw_size);
+  // Check the size before allocating for it, and keep it in range of LZ4's int sizes.
+  size_t ratio = maxRatio(flags);
+  if (raw_size > std::min<RawSize>(max_size, std::numeric_limits<int>::max()) ||
+      (ratio && raw_size > static_cast<RawSize>(src_size) * ratio + sizeof(capnp::word))) {
+    throw std::runtime_error("Encoded frame size " + std::to_string(raw_size) +
+                             " is too large for a frame of " + std::to_string(src_size) +
+                             " bytes");
+  }
+
+  auto words = kj::heapArray<capnp::word>(raw_size / sizeof(capnp::word));
+  uint8_t *dst = words.asBytes().begin();
+
+  if (flags & SMART_MESSAGE_PACKED) {
+    kj::ArrayInputStream input(kj::arrayPtr(src, src_size));
+    capnp::_::PackedInputStream packed(input);
+    packed.read(dst, raw_size);
+    return words;
+  }
+#ifdef A17_DISPATCH_HAVE_LZ4
+  if (flags & SMART_MESSAGE_LZ4) {
+    int decoded = LZ4_decompress_safe(reinterpret_cast<const char *>(src),
+                                      reinterpret_cast<char *>(dst), static_cast<int>(src_size),
+                                      static_cast<int>(raw_size));
+    if (decoded < 0 || static_cast<RawSize>(decoded) != raw_size) {
+      throw std::runtime_error("Corrupt LZ4 frame");
+    }
+    return words;
+  }
+#endif
+#ifdef A17_DISPATCH_HAVE_ZSTD
+  if (flags & SMART_MESSAGE_ZSTD) {
+    size_t decoded = ZSTD_decompress(dst, raw_size, src, src_size);
+    if (ZSTD_isError(decoded) || decoded != raw_size) {
+      throw std::runtime_error("Corrupt Zstd frame");
+    }
+    return words;
+  }
+#endif
+  throw std::runtime_error("Message codec (flags " + std::to_string(flags) +
+                           ") is not available in this build");
+}
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <string>
+
+#include <capnp/common.h>
+#include <kj/array.h>
+
+#include "defs.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Encoding of the capnp frame of a smart message. Large messages that are mostly zeros and small
+// ints (point clouds, occupancy maps) shrink several times over, at the cost of CPU on both ends.
+// The codec is flagged in the id frame (see SmartMessageFlags), and SmartCapnpReader decodes it.
+//   PACKED: capnp packed encoding. Fast, and always available.
+//   LZ4: much smaller than packed on repetitive data, and still fast.
+//   ZSTD: smallest, for slow links.
+// LZ4 and ZSTD are only available if dispatch was built with them (A17_DISPATCH_HAVE_LZ4,
+// A17_DISPATCH_HAVE_ZSTD). A node that receives a codec it wasn't built with fails to read the
+// message.
+enum class MessageCodec {
+  NONE,
+  PACKED,
+  LZ4,
+  ZSTD,
+};
+
+// Publishers don't encode messages smaller than this, which gain little and cost a copy.
+const size_t DEFAULT_CODEC_MIN_BYTES = 1024;
+
+// Receivers refuse to decode a frame to more than this, so that a corrupt or hostile size can't make
+// them allocate without bound. Set DISPATCH_MAX_DECODED_BYTES to change it.
+const size_t DEFAULT_MAX_DECODED_BYTES =
+    std::getenv("DISPATCH_MAX_DECODED_BYTES")
+        ? std::strtoull(std::getenv("DISPATCH_MAX_DECODED_BYTES"), nullptr, 10)
+        : 1024 * 1024 * 1024;
+
+// Size and time of encoding one or more messages.
+struct CodecStats {
+  uint64_t messages = 0;
+  uint64_t raw_bytes = 0;
+  uint64_t encoded_bytes = 0;
+  int64_t encode_ns = 0;
+
+  // Raw size over encoded size, or 1 if nothing was encoded.
+  inline double ratio() const {
+    return encoded_bytes ? static_cast<double>(raw_bytes) / encoded_bytes : 1.0;
+  }
+  CodecStats &operator+=(const CodecStats &other);
+};
+
+std::string codecName(MessageCodec codec);
+// Whether this build of dispatch can encode and decode the codec.
+bool codecAvailable(MessageCodec codec);
+
+// Encodes the flat capnp frame of a smart message in place and flags the codec in its id frame.
+// Segmented messages and messages that are already encoded are left as they are. Returns whether
+// the message was encoded, and adds its sizes and encode time to stats if given.
+// Throws std::runtime_error if the codec is not available.
+bool encodeSmartMessage(azmq::message_vector &msg_vec, MessageCodec codec,
+                        CodecStats *stats = nullptr);
+
+// Decodes a capnp frame encoded with the codec flagged in flags into word-aligned memory.
+// Throws std::runtime_error if the frame is corrupt or the codec is not available, or if its size is
+// more than max_size or more than the codec could have encoded into the frame.
+kj::Array<capnp::word> decodeSmartMessageFrame(const azmq::message &frame, uint32_t flags,
+                                               size_t max_size = DEFAULT_MAX_DECODED_BYTES);
+
+}  // namespace dispatch
+}  // namespace a17
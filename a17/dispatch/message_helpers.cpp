@@ -1,4 +1,9 @@
 #include "message_helpers.h"
+#include <unistd.h>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <random>
 #include <sstream>
 
 namespace a17 {
@@ -14,6 +19,56 @@ const unsigned long long idFromSmartMessage(const azmq::message_vector &msg_vec)
   return *boost::asio::buffer_cast<const unsigned long long *>(msg_vec[0].cbuffer());
 }
 
+uint32_t flagsFromSmartMessage(const azmq::message_vector &msg_vec) {
+  if (msg_vec.empty() || msg_vec[0].size() < sizeof(SmartMessageHeader)) return 0;
+  SmartMessageHeader header;
+  memcpy(&header, msg_vec[0].data(), sizeof(header));
+  return header.flags;
+}
+
+uint64_t newTracePublisherId() {
+  static std::random_device device;
+  static std::mutex mutex;
+  std::lock_guard<std::mutex> lock(mutex);
+  return (static_cast<uint64_t>(device()) << 32) | device();
+}
+
+uint64_t traceHostId() {
+  static const uint64_t host_id = []() {
+    char name[256] = {0};
+    gethostname(name, sizeof(name) - 1);
+    return static_cast<uint64_t>(std::hash<std::string>()(name));
+  }();
+  return host_id;
+}
+
+void traceSmartMessage(azmq::message_vector &msg_vec, const SmartMessageTrace &trace) {
+  if (msg_vec.empty()) return;
+  uint8_t frame[sizeof(SmartMessageHeader) + sizeof(SmartMessageTrace)];
+  SmartMessageHeader header{idFromSmartMessage(msg_vec), flagsFromSmartMessage(msg_vec), 0};
+  header.flags |= SMART_MESSAGE_TRACED;
+  memcpy(frame, &header, sizeof(header));
+  memcpy(frame + sizeof(header), &trace, sizeof(trace));
+  msg_vec[0] = azmq::message(boost::asio::const_buffer(frame, sizeof(frame)));
+}
+
+bool traceFromSmartMessage(const azmq::message_vector &msg_vec, SmartMessageTrace &trace) {
+  if (!(flagsFromSmartMessage(msg_vec) & SMART_MESSAGE_TRACED)) return false;
+  if (msg_vec[0].size() < sizeof(SmartMessageHeader) + sizeof(SmartMessageTrace)) return false;
+  memcpy(&trace, static_cast<const uint8_t *>(msg_vec[0].data()) + sizeof(SmartMessageHeader),
+         sizeof(trace));
+  return true;
+}
+
+size_t capnpFrameCount(const azmq::message_vector &msg_vec) {
+  if (!(flagsFromSmartMessage(msg_vec) & SMART_MESSAGE_SEGMENTED)) return 1;
+  if (msg_vec.size() < 2 || msg_vec[1].size() < sizeof(uint32_t)) return 1;
+  // The segment table starts with the segment count minus one.
+  uint32_t segment_count;
+  memcpy(&segment_count, msg_vec[1].data(), sizeof(segment_count));
+  return 2 + static_cast<size_t>(segment_count);
+}
+
 // dynamic output
 std::ostream &operator<<(std::ostream &os, capnp::DynamicValue::Reader value) {
   switch (value.getType()) {
@@ -25,9 +25,63 @@ unsigned long long idOf() {
   return schema.getProto().getId();
 }
 
+// The id frame of a smart message holds the capnp id, optionally followed by these flags. Messages
+// without flags have an id frame of just the id.
+enum SmartMessageFlags : uint32_t {
+  // The capnp message is a segment table frame followed by one frame per segment, instead of a
+  // single flat frame. See SmartCapnpBuilder::takeSegmentedMessage().
+  SMART_MESSAGE_SEGMENTED = 1 << 0,
+  // The id frame continues with a SmartMessageTrace. See Publisher::setTracing().
+  SMART_MESSAGE_TRACED = 1 << 1,
+  // The flat capnp frame is encoded with one of these codecs. See message_codec.h.
+  SMART_MESSAGE_PACKED = 1 << 2,
+  SMART_MESSAGE_LZ4 = 1 << 3,
+  SMART_MESSAGE_ZSTD = 1 << 4,
+  SMART_MESSAGE_ENCODED = SMART_MESSAGE_PACKED | SMART_MESSAGE_LZ4 | SMART_MESSAGE_ZSTD,
+  // The message is one chunk of a larger message. See chunked_message.h.
+  SMART_MESSAGE_CHUNK = 1 << 5,
+};
+
+struct SmartMessageHeader {
+  unsigned long long id;
+  uint32_t flags;
+  uint32_t reserved;
+};
+
+// Stamped on a message by its publisher as it is sent, so that subscribers can measure how long it
+// took to arrive and notice messages that never did (see LatencyTracker).
+struct SmartMessageTrace {
+  // Random id of the publishing socket. Sequence numbers count up separately for each.
+  uint64_t publisher_id;
+  // Hash of the publisher's host name. Monotonic times can only be compared on the same host.
+  uint64_t host_id;
+  uint64_t sequence;
+  // Send time on the steady clock, in nanoseconds.
+  int64_t monotonic_ns;
+  // Send time on the system clock, in nanoseconds since the epoch.
+  int64_t realtime_ns;
+};
+
+// Returns a random id for a publisher to stamp in its traces.
+uint64_t newTracePublisherId();
+// Returns the host_id that publishers on this host stamp in their traces.
+uint64_t traceHostId();
+
+// Adds a trace to a smart message, replacing its id frame and keeping its flags.
+void traceSmartMessage(azmq::message_vector &msg_vec, const SmartMessageTrace &trace);
+// Reads the trace of a smart message, returning false if it has none.
+bool traceFromSmartMessage(const azmq::message_vector &msg_vec, SmartMessageTrace &trace);
+
 // returns id from a zmq message
 const unsigned long long idFromSmartMessage(const azmq::message_vector &msg_vec);
 
+// returns the SmartMessageFlags from a zmq message, or 0 if it has none
+uint32_t flagsFromSmartMessage(const azmq::message_vector &msg_vec);
+
+// Returns the number of frames after the id frame that hold the capnp message. Raw data buffers
+// follow them.
+size_t capnpFrameCount(const azmq::message_vector &msg_vec);
+
 template <typename T>
 std::string typeOf() {
   return std::to_string(idOf<T>());
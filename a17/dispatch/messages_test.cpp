@@ -1,7 +1,14 @@
+#include <array>
+#include <cstring>
+#include <vector>
+
 #include "catch.hpp"
 
 #include "a17/capnp_msgs/test.capnp.h"
 
+#include "chunked_message.h"
+#include "latency_tracker.h"
+#include "message_codec.h"
 #include "message_helpers.h"
 #include "smart_capnp_builder.h"
 #include "smart_capnp_reader.h"
@@ -11,8 +18,14 @@ namespace a17 {
 namespace dispatch {
 namespace test {
 
+namespace {
+
+void NoopFree(void *, void *) {}
+
+}  // namespace
+
 TEST_CASE("Builder and reader", "[message]") {
-  a17::utils::BufferPool pool;
+  a17::utils::SizeClassPool pool;
   a17::dispatch::SmartCapnpBuilder builder(pool);
   auto test_msg = builder.initRoot<a17::capnp_msgs::test::DispatchTest>();
 
@@ -32,12 +45,176 @@ TEST_CASE("Builder and reader", "[message]") {
 }
 
 TEST_CASE("Builder with buffer pool", "[message]") {
-  a17::utils::BufferPool pool(64, 1);
-  REQUIRE(!pool.empty());
+  a17::utils::SizeClassPool pool(64, 1024, 1024);
+  REQUIRE(pool.hits() == 0);
 
   a17::dispatch::SmartCapnpBuilder builder(pool);
   builder.initRoot<a17::capnp_msgs::test::DispatchTest>();
-  REQUIRE(pool.empty());
+  REQUIRE(pool.hits() == 1);
+
+  azmq::message message = builder.build();
+  REQUIRE(pool.hits() == 2);
+  REQUIRE(pool.misses() == 0);
+  REQUIRE(pool.fallbacks() == 0);
+}
+
+TEST_CASE("Builder with single buffer pool", "[message]") {
+  a17::utils::BufferPool pool(1024, 4);
+
+  {
+    a17::dispatch::SmartCapnpBuilder builder(pool);
+    builder.initRoot<a17::capnp_msgs::test::DispatchTest>().setTopic("SINGLE");
+    REQUIRE(pool.remaining() == 3);
+
+    azmq::message_vector message = builder.getSmartMessage();
+    a17::dispatch::SmartCapnpReader reader(message);
+    REQUIRE(!strcmp(reader.getRoot<a17::capnp_msgs::test::DispatchTest>().getTopic().cStr(),
+                    "SINGLE"));
+  }
+  // the segment and the built frame go back once nothing refers to them
+  REQUIRE(pool.full());
+}
+
+TEST_CASE("Builder with large message", "[message]") {
+  a17::utils::SizeClassPool pool(64, 64 * 1024);
+  const uint count = 4096;
+
+  {
+    a17::dispatch::SmartCapnpBuilder builder(pool);
+    auto list = builder.initRoot<a17::capnp_msgs::test::TestType>().initAlist(count);
+    for (uint i = 0; i < count; i++) {
+      list.set(i, i);
+    }
+
+    // both the list segment and the built message come from the pool's larger size classes
+    azmq::message message = builder.build();
+    REQUIRE(message.size() > count * sizeof(int32_t));
+    REQUIRE(pool.misses() == 0);
+    REQUIRE(pool.fallbacks() == 0);
+
+    a17::dispatch::SmartCapnpReader reader(message,
+                                           a17::dispatch::idOf<a17::capnp_msgs::test::TestType>());
+    auto read = reader.getRoot<a17::capnp_msgs::test::TestType>().getAlist();
+    REQUIRE(read.size() == count);
+    REQUIRE(read[count - 1] == count - 1);
+  }
+
+  // larger than the largest size class
+  a17::dispatch::SmartCapnpBuilder builder(pool);
+  builder.initRoot<a17::capnp_msgs::test::TestType>().initAlist(32 * 1024);
+  REQUIRE(pool.fallbacks() == 1);
+  builder.build();
+  REQUIRE(pool.fallbacks() == 2);
+}
+
+TEST_CASE("Builder cache", "[message]") {
+  a17::utils::SizeClassPool pool(64, 64 * 1024);
+  a17::dispatch::SmartCapnpBuilderCache cache(pool);
+  const capnp::word *segment;
+
+  {
+    a17::dispatch::SmartCapnpBuilder builder(cache);
+    auto test_msg = builder.initRoot<a17::capnp_msgs::test::TestType>();
+    test_msg.setTimestamp(1);
+    auto list = test_msg.initAlist(1024);
+    list.set(1023, 1);
+    segment = builder.getSegmentsForOutput()[0].begin();
+  }
+  REQUIRE(cache.size() == 1);
+  auto hits = pool.hits();
+
+  // the next message starts in the same segment, which has been cleared
+  a17::dispatch::SmartCapnpBuilder builder(cache);
+  auto test_msg = builder.initRoot<a17::capnp_msgs::test::TestType>();
+  REQUIRE(builder.getSegmentsForOutput()[0].begin() == segment);
+  REQUIRE(cache.size() == 0);
+  REQUIRE(pool.hits() == hits);
+  REQUIRE(test_msg.getTimestamp() == 0);
+  REQUIRE(!test_msg.hasAlist());
+  auto list = test_msg.initAlist(1024);
+  REQUIRE(list[1023] == 0);
+}
+
+TEST_CASE("Segmented message", "[message]") {
+  a17::utils::SizeClassPool pool(64, 64 * 1024);
+  const uint count = 4096;
+
+  azmq::message_vector smart_msg;
+  {
+    a17::dispatch::SmartCapnpBuilder builder(pool);
+    auto test_msg = builder.initRoot<a17::capnp_msgs::test::TestType>();
+    test_msg.setTimestamp(42);
+    auto list = test_msg.initAlist(count);
+    for (uint i = 0; i < count; i++) {
+      list.set(i, i);
+    }
+    REQUIRE(builder.getSegmentsForOutput().size() == 2);
+    smart_msg = builder.takeSegmentedMessage();
+  }
+
+  // id, segment table, 2 segments
+  REQUIRE(smart_msg.size() == 4);
+  REQUIRE(a17::dispatch::idFromSmartMessage(smart_msg) ==
+          a17::dispatch::idOf<a17::capnp_msgs::test::TestType>());
+  REQUIRE(a17::dispatch::capnpFrameCount(smart_msg) == 3);
+
+  a17::dispatch::SmartCapnpReader reader(smart_msg);
+  REQUIRE(reader.segmented());
+  REQUIRE(!reader.copied());
+  auto test_reader = reader.getRoot<a17::capnp_msgs::test::TestType>();
+  REQUIRE(test_reader.getTimestamp() == 42);
+  REQUIRE(test_reader.getAlist().size() == count);
+  REQUIRE(test_reader.getAlist()[count - 1] == count - 1);
+
+  // raw buffers follow the segments
+  uint8_t raw[] = {1, 2, 3};
+  smart_msg.push_back(azmq::message(boost::asio::buffer(raw)));
+  a17::dispatch::SmartMessageReader message_reader(smart_msg);
+  REQUIRE(message_reader.size() == 2);
+  size_t size;
+  auto buffer = static_cast<uint8_t *>(message_reader.bufferAt(1, size));
+  REQUIRE(size == sizeof(raw));
+  REQUIRE(buffer[2] == 3);
+  REQUIRE(message_reader.getRoot<a17::capnp_msgs::test::TestType>().getTimestamp() == 42);
+}
+
+TEST_CASE("Reader aligned frame", "[message]") {
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::SmartCapnpBuilder builder(pool);
+  auto test_msg = builder.initRoot<a17::capnp_msgs::test::DispatchTest>();
+  test_msg.setTopic("QUEUE");
+
+  auto misaligned_count = a17::dispatch::SmartCapnpReader::misalignedCount();
+  azmq::message_vector smart_msg = builder.getSmartMessage();
+  a17::dispatch::SmartCapnpReader reader(smart_msg);
+  REQUIRE(!reader.copied());
+  REQUIRE(a17::dispatch::SmartCapnpReader::misalignedCount() == misaligned_count);
+  REQUIRE(!strcmp(reader.getRoot<a17::capnp_msgs::test::DispatchTest>().getTopic().cStr(),
+                  "QUEUE"));
+}
+
+TEST_CASE("Reader misaligned frame", "[message]") {
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::SmartCapnpBuilder builder(pool);
+  auto test_msg = builder.initRoot<a17::capnp_msgs::test::DispatchTest>();
+  test_msg.setTopic("QUEUE");
+  azmq::message aligned = builder.build();
+
+  // Shift the serialized message off of a word boundary.
+  std::vector<uint8_t> storage(aligned.size() + sizeof(capnp::word));
+  uint8_t *data = storage.data() + 4;
+  memcpy(data, aligned.data(), aligned.size());
+  azmq::nocopy_t nocopy;
+  azmq::message misaligned(nocopy, boost::asio::mutable_buffer(data, aligned.size()), nullptr,
+                           NoopFree);
+
+  auto misaligned_count = a17::dispatch::SmartCapnpReader::misalignedCount();
+  a17::dispatch::SmartCapnpReader reader(
+      misaligned, a17::dispatch::idOf<a17::capnp_msgs::test::DispatchTest>());
+  REQUIRE(reader.copied());
+  REQUIRE(a17::dispatch::SmartCapnpReader::misalignedCount() == misaligned_count + 1);
+  REQUIRE(!strcmp(reader.getRoot<a17::capnp_msgs::test::DispatchTest>().getTopic().cStr(),
+                  "QUEUE"));
 }
 
 TEST_CASE("idOf", "[message]") {
@@ -52,13 +229,224 @@ TEST_CASE("typeOf", "[message]") {
 }
 
 TEST_CASE("idFromSmartMessage", "[message]") {
-  a17::utils::BufferPool pool;
+  a17::utils::SizeClassPool pool;
   a17::dispatch::SmartCapnpBuilder builder(pool);
   builder.initRoot<a17::capnp_msgs::test::DispatchTest>();
   azmq::message_vector smart_msg = builder.getSmartMessage();
   REQUIRE(a17::dispatch::idFromSmartMessage(smart_msg) == 11643037877147589208uLL);
 }
 
+TEST_CASE("Traced message", "[message]") {
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::SmartCapnpBuilder builder(pool);
+  builder.initRoot<a17::capnp_msgs::test::DispatchTest>().setTopic("TRACE");
+  azmq::message_vector smart_msg = builder.getSmartMessage();
+
+  a17::dispatch::SmartMessageTrace trace;
+  REQUIRE(!a17::dispatch::traceFromSmartMessage(smart_msg, trace));
+
+  a17::dispatch::LatencyTracker tracker;
+  auto send = [&](uint64_t sequence, int64_t sent_ns, int64_t received_ns) {
+    azmq::message_vector traced = smart_msg;
+    a17::dispatch::traceSmartMessage(
+        traced, {7, a17::dispatch::traceHostId(), sequence, sent_ns, sent_ns});
+    REQUIRE(a17::dispatch::idFromSmartMessage(traced) ==
+            a17::dispatch::idOf<a17::capnp_msgs::test::DispatchTest>());
+    REQUIRE(tracker.record(traced, received_ns, received_ns));
+    return traced;
+  };
+
+  auto traced = send(0, 1000000, 1003000);
+  REQUIRE(a17::dispatch::traceFromSmartMessage(traced, trace));
+  REQUIRE(trace.publisher_id == 7);
+  REQUIRE(trace.monotonic_ns == 1000000);
+  // the trace is invisible to readers
+  a17::dispatch::SmartCapnpReader reader(traced);
+  REQUIRE(!strcmp(reader.getRoot<a17::capnp_msgs::test::DispatchTest>().getTopic().cStr(),
+                  "TRACE"));
+
+  send(1, 2000000, 2100000);
+  // 2 and 3 are lost
+  send(4, 3000000, 3001000);
+  REQUIRE(tracker.traced() == 3);
+  REQUIRE(tracker.gaps() == 1);
+  REQUIRE(tracker.lost() == 2);
+
+  auto latency = tracker.latency();
+  REQUIRE(latency.count() == 3);
+  REQUIRE(latency.maxNs() == 100000);
+  // 1, 3 and 100 μs fall in the buckets up to 2, 4 and 128 μs
+  REQUIRE(latency.buckets()[1] == 1);
+  REQUIRE(latency.buckets()[2] == 1);
+  REQUIRE(latency.buckets()[7] == 1);
+  REQUIRE(latency.percentileNs(0.5) == 4000);
+  REQUIRE(latency.percentileNs(0.99) == 128000);
+}
+
+TEST_CASE("Encoded message", "[message]") {
+  a17::utils::SizeClassPool pool(64, 64 * 1024);
+  const uint count = 4096;
+
+  a17::dispatch::SmartCapnpBuilder builder(pool);
+  auto test_msg = builder.initRoot<a17::capnp_msgs::test::TestType>();
+  test_msg.setTimestamp(42);
+  auto list = test_msg.initAlist(count);
+  for (uint i = 0; i < count; i++) {
+    list.set(i, i % 16);
+  }
+  azmq::message_vector raw = builder.getSmartMessage();
+
+  for (auto codec : {a17::dispatch::MessageCodec::PACKED, a17::dispatch::MessageCodec::LZ4,
+                     a17::dispatch::MessageCodec::ZSTD}) {
+    if (!a17::dispatch::codecAvailable(codec)) continue;
+    SECTION(a17::dispatch::codecName(codec)) {
+      a17::dispatch::CodecStats stats;
+      azmq::message_vector encoded = builder.getEncodedMessage(codec, &stats);
+      REQUIRE(stats.messages == 1);
+      REQUIRE(stats.raw_bytes == raw[1].size());
+      REQUIRE(stats.encoded_bytes == encoded[1].size());
+      REQUIRE(stats.ratio() > 2);
+      REQUIRE(a17::dispatch::idFromSmartMessage(encoded) ==
+              a17::dispatch::idOf<a17::capnp_msgs::test::TestType>());
+      REQUIRE((a17::dispatch::flagsFromSmartMessage(encoded) &
+               a17::dispatch::SMART_MESSAGE_ENCODED) != 0);
+
+      // encoded once only, and the codec survives tracing
+      REQUIRE(!a17::dispatch::encodeSmartMessage(encoded, codec));
+      a17::dispatch::traceSmartMessage(encoded, {7, a17::dispatch::traceHostId(), 0, 0, 0});
+
+      a17::dispatch::SmartCapnpReader reader(encoded);
+      REQUIRE(reader.encoded());
+      auto test_reader = reader.getRoot<a17::capnp_msgs::test::TestType>();
+      REQUIRE(test_reader.getTimestamp() == 42);
+      REQUIRE(test_reader.getAlist().size() == count);
+      REQUIRE(test_reader.getAlist()[count - 1] == (count - 1) % 16);
+
+      // sizes beyond the limit, or beyond what the frame could decode to, are refused
+      uint32_t flags = a17::dispatch::flagsFromSmartMessage(encoded);
+      REQUIRE_THROWS(a17::dispatch::decodeSmartMessageFrame(encoded[1], flags, 64));
+      std::vector<uint8_t> oversized(static_cast<const uint8_t *>(encoded[1].data()),
+                                     static_cast<const uint8_t *>(encoded[1].data()) +
+                                         encoded[1].size());
+      uint64_t raw_size = uint64_t(1) << 40;
+      memcpy(oversized.data(), &raw_size, sizeof(raw_size));
+      REQUIRE_THROWS(a17::dispatch::decodeSmartMessageFrame(
+          azmq::message(boost::asio::buffer(oversized)), flags));
+    }
+  }
+
+  REQUIRE(!a17::dispatch::encodeSmartMessage(raw, a17::dispatch::MessageCodec::NONE));
+  REQUIRE(!a17::dispatch::SmartCapnpReader(raw).encoded());
+}
+
+TEST_CASE("Chunked message", "[message]") {
+  a17::utils::SizeClassPool pool(64, 64 * 1024);
+  const uint count = 4096;
+
+  a17::dispatch::SmartCapnpBuilder builder(pool);
+  auto list = builder.initRoot<a17::capnp_msgs::test::TestType>().initAlist(count);
+  for (uint i = 0; i < count; i++) {
+    list.set(i, i);
+  }
+  azmq::message_vector smart_msg = builder.getSmartMessage();
+  uint8_t raw[] = {1, 2, 3};
+  smart_msg.push_back(azmq::message(boost::asio::buffer(raw)));
+
+  auto chunks = a17::dispatch::chunkSmartMessage(smart_msg, 1000, 7, 0);
+  // the id frame and the raw buffer fit in a chunk each
+  REQUIRE(chunks.size() == 2 + (smart_msg[1].size() + 999) / 1000);
+  for (const auto &chunk : chunks) {
+    REQUIRE(a17::dispatch::idFromSmartMessage(chunk) ==
+            a17::dispatch::idOf<a17::capnp_msgs::test::TestType>());
+    REQUIRE(chunk[1].size() <= 1000);
+  }
+
+  a17::dispatch::ChunkAssembler assembler;
+  size_t progress_bytes = 0;
+  assembler.setProgressHandler(
+      [&](const a17::dispatch::ChunkProgress &progress) { progress_bytes += progress.size; });
+
+  azmq::message_vector message;
+  for (size_t i = 0; i < chunks.size(); i++) {
+    azmq::message_vector chunk = chunks[i];
+    REQUIRE(assembler.add(chunk, message) == (i == chunks.size() - 1));
+  }
+  REQUIRE(progress_bytes == smart_msg[0].size() + smart_msg[1].size() + sizeof(raw));
+  REQUIRE(assembler.pending() == 0);
+
+  a17::dispatch::SmartMessageReader reader(message);
+  auto read = reader.getRoot<a17::capnp_msgs::test::TestType>().getAlist();
+  REQUIRE(read.size() == count);
+  REQUIRE(read[count - 1] == count - 1);
+  size_t size;
+  auto buffer = static_cast<uint8_t *>(reader.bufferAt(1, size));
+  REQUIRE(size == sizeof(raw));
+  REQUIRE(buffer[2] == 3);
+
+  // a lost chunk discards its message, and the next message is put back together
+  auto next = a17::dispatch::chunkSmartMessage(smart_msg, 1000, 7, 1);
+  for (size_t i = 0; i < chunks.size(); i++) {
+    if (i == 2) continue;
+    azmq::message_vector chunk = chunks[i];
+    REQUIRE(!assembler.add(chunk, message));
+  }
+  REQUIRE(assembler.incomplete() == 1);
+  REQUIRE(assembler.pending() == 0);
+  for (size_t i = 0; i < next.size(); i++) {
+    REQUIRE(assembler.add(next[i], message) == (i == next.size() - 1));
+    REQUIRE(assembler.pending() == (i == next.size() - 1 ? 0 : 1));
+  }
+  REQUIRE(assembler.incomplete() == 1);
+
+  // messages that aren't chunked pass through
+  azmq::message_vector whole = builder.getSmartMessage();
+  REQUIRE(assembler.add(whole, message));
+  REQUIRE(message.size() == 2);
+}
+
+TEST_CASE("Attached buffers", "[message]") {
+  a17::utils::SizeClassPool pool;
+  auto points = std::make_shared<std::vector<float>>(3000, 1.5f);
+  int deleted = 0;
+  std::vector<double> matrix(16, 2.0);
+
+  {
+    azmq::message_vector smart_msg;
+    {
+      a17::dispatch::SmartCapnpBuilder builder(pool);
+      builder.initRoot<a17::capnp_msgs::test::TestType>().setTimestamp(42);
+      builder.attach(boost::asio::buffer(*points), points);
+      builder.attach(boost::asio::buffer(matrix), [&](const void *data) {
+        CHECK(data == matrix.data());
+        deleted++;
+      });
+      REQUIRE(builder.attachments() == 2);
+      smart_msg = builder.getSmartMessage();
+    }
+    // the message still refers to both buffers
+    REQUIRE(smart_msg.size() == 4);
+    REQUIRE(deleted == 0);
+    REQUIRE(points.use_count() == 2);
+
+    a17::dispatch::SmartMessageReader reader(smart_msg);
+    REQUIRE(reader.size() == 3);
+    REQUIRE(reader.getRoot<a17::capnp_msgs::test::TestType>().getTimestamp() == 42);
+    auto read_points = reader.bufferAs<float>(1);
+    REQUIRE(read_points.begin() == points->data());
+    REQUIRE(read_points.size() == points->size());
+    REQUIRE(read_points[2999] == 1.5f);
+    auto read_matrix = reader.bufferAs<double>(2);
+    REQUIRE(read_matrix.begin() == matrix.data());
+    REQUIRE(read_matrix.size() == 16);
+    // 12000 bytes aren't a whole number of 7-byte elements
+    using Odd = std::array<uint8_t, 7>;
+    REQUIRE_THROWS_AS(reader.bufferAs<Odd>(1), std::runtime_error);
+  }
+
+  REQUIRE(deleted == 1);
+  REQUIRE(points.use_count() == 1);
+}
+
 }  // namespace test
 }  // namespace dispatch
 }  // namespace a17
@@ -1,13 +1,36 @@
 #include "node.h"
 
+#include "gflags/gflags.h"
+
+#include "a17/capnp_msgs/dispatch.capnp.h"
+
 #include "defs.h"
 
 namespace a17 {
 namespace dispatch {
 
-Node::Node(const std::string &name /* ="Node" */)
+DEFINE_int32(dispatch_stats_period_ms, 0,
+             "Period at which every node publishes its NodeStats, or 0 to only publish them from "
+             "nodes that call Node::publishStats()");
+DEFINE_bool(dispatch_multiplex, false,
+            "Publish all topics of a node on one socket, see Node::setMultiplexing()");
+DEFINE_bool(dispatch_shared_directory, DEFAULT_SHARED_DIRECTORY,
+            "Share one directory between the nodes of the process, see SharedDirectory");
+
+namespace {
+
+std::unique_ptr<Directory> MakeDirectory(boost::asio::io_service &ios, const std::string &name) {
+  if (FLAGS_dispatch_shared_directory) return std::make_unique<DirectoryView>(ios, name);
+  return std::make_unique<Directory>(ios, name);
+}
+
+}  // namespace
+
+Node::Node(const std::string &name /* ="Node" */, unsigned int thread_count /* = 1 */)
     : name_(!name.empty() ? name : "Node"),
-      directory_(ios_, name_),
+      thread_count_(thread_count > 0 ? thread_count : 1),
+      builder_cache_(pool_),
+      directory_(MakeDirectory(ios_, name_)),
       signals_(ios_, SIGINT, SIGTERM, SIGHUP) {
   if (name_.find_first_of(' ') != std::string::npos) {
     throw std::runtime_error("Process name must not contain spaces");
@@ -20,9 +43,14 @@ Node::Node(const std::string &name /* ="Node" */)
 
   if (logger_) {
     logger_->set_pattern("[%Y-%m-%d %T.%e] [%n](%l) %v");
-    logger_->info("Node {} starting up", name);
+    logger_->info("Node {} starting up with {} thread(s)", name, thread_count_);
   }
   signals_.async_wait(bind2(&Node::signal));
+  multiplexing_ = FLAGS_dispatch_multiplex;
+
+  if (FLAGS_dispatch_stats_period_ms > 0) {
+    publishStats(std::chrono::milliseconds(FLAGS_dispatch_stats_period_ms));
+  }
 }
 
 Node::~Node() {
@@ -36,10 +64,90 @@ Topic Node::topic(const std::string &topic) {
   return Topic{DeviceName(), name(), topic};
 }
 
+void Node::publishStats(std::chrono::steady_clock::duration period) {
+  if (!stats_publisher_) {
+    stats_publisher_ = registerCapnpPublisher<a17::capnp_msgs::dispatch::NodeStats>(
+        Topic{"", "", NODE_STATS_TOPIC});
+  }
+  if (stats_repeater_) {
+    stats_repeater_->setInterval(period);
+  } else {
+    stats_repeater_ = std::make_shared<a17::utils::Repeater>(ios_, period, bind0(&Node::sendStats));
+  }
+}
+
+std::shared_ptr<PublisherMux> Node::mux() {
+  std::lock_guard<std::mutex> lock(mux_mutex_);
+  if (!mux_) {
+    mux_ = track(std::make_shared<PublisherMux>(ios_));
+  }
+  return mux_;
+}
+
+std::vector<std::pair<std::string, SocketMetrics>> Node::socketMetrics() {
+  std::vector<std::pair<std::string, SocketMetrics>> metrics;
+  std::lock_guard<std::mutex> lock(sockets_mutex_);
+  for (auto iter = sockets_.begin(); iter != sockets_.end();) {
+    auto socket = iter->lock();
+    if (!socket) {
+      iter = sockets_.erase(iter);
+      continue;
+    }
+    metrics.emplace_back(socket->logName(), socket->metrics());
+    iter++;
+  }
+  return metrics;
+}
+
+bool Node::sendStats() {
+  auto metrics = socketMetrics();
+
+  auto builder = newCapnpMessageBuilder();
+  auto stats = builder.initRoot<a17::capnp_msgs::dispatch::NodeStats>();
+  stats.setTimestamp(getMicros());
+  stats.setNode(name_);
+  stats.setGuid(directory_->guid());
+  stats.setPoolHits(pool_.hits());
+  stats.setPoolMisses(pool_.misses());
+  stats.setPoolFallbacks(pool_.fallbacks());
+
+  auto sockets = stats.initSockets(metrics.size());
+  for (size_t i = 0; i < metrics.size(); i++) {
+    const SocketMetrics &socket_metrics = metrics[i].second;
+    auto socket = sockets[i];
+    socket.setName(metrics[i].first);
+    socket.setMessagesSent(socket_metrics.messages_sent);
+    socket.setBytesSent(socket_metrics.bytes_sent);
+    socket.setSendErrors(socket_metrics.send_errors);
+    socket.setMessagesReceived(socket_metrics.messages_received);
+    socket.setBytesReceived(socket_metrics.bytes_received);
+    socket.setDropped(socket_metrics.dropped);
+    socket.setHandlerNs(socket_metrics.handler_ns);
+    socket.setSendFrequency(socket_metrics.send_frequency);
+    socket.setSendJitterUs(socket_metrics.send_jitter);
+    socket.setReceiveFrequency(socket_metrics.receive_frequency);
+    socket.setReceiveJitterUs(socket_metrics.receive_jitter);
+  }
+
+  stats_publisher_->send(builder.getSmartMessage());
+  return true;
+}
+
 void Node::start() {
   future_ = std::async(std::launch::async, [this]() { this->run(); });
 }
 
+void Node::run() {
+  std::vector<std::thread> workers;
+  for (unsigned int i = 1; i < thread_count_; i++) {
+    workers.emplace_back([this]() { ios_.run(); });
+  }
+  ios_.run();
+  for (auto &worker : workers) {
+    worker.join();
+  }
+}
+
 void Node::stop() {
   signaled_shutdown_ = true;
   ios_.stop();
@@ -1,8 +1,11 @@
 #pragma once
 
 #include <future>
+#include <mutex>
 #include <set>
 #include <string>
+#include <thread>
+#include <vector>
 
 #include <spdlog/spdlog.h>
 #include <spdlog/common.h>
@@ -11,14 +14,19 @@
 #endif
 #include <boost/asio/signal_set.hpp>
 
-#include "a17/utils/buffer_pool.h"
 #include "a17/utils/repeater.h"
+#include "a17/utils/size_class_pool.h"
 
 #include "directory.h"
 #include "message_helpers.h"
 #include "publisher.h"
+#include "publisher_mux.h"
 #include "reply_server.h"
 #include "request_client.h"
+#include "service.h"
+#include "service_client.h"
+#include "shared_directory.h"
+#include "shm_publisher.h"
 #include "smart_capnp_builder.h"
 #include "smart_capnp_reader.h"
 #include "smart_message_reader.h"
@@ -28,6 +36,9 @@
 namespace a17 {
 namespace dispatch {
 
+/// Topic that nodes publish their NodeStats on. See Node::publishStats().
+const char NODE_STATS_TOPIC[] = "dispatch/stats";
+
 template <typename T>
 using CapnpMessageHandler = std::function<void(const T &)>;
 
@@ -44,17 +55,49 @@ using ReplyServerExceptionHandler =
 
 class Node {
  public:
-  explicit Node(const std::string &name = "Node");
+  /// @param name Name of the node, used for logging and in the directory guid.
+  /// @param thread_count Number of threads that run the node's io_service. With more than one
+  ///   thread, each socket handles its messages in order on its own strand, while handlers for
+  ///   different sockets, repeaters and directory events may run concurrently. Handlers that share
+  ///   state across sockets must then synchronize it.
+  explicit Node(const std::string &name = "Node", unsigned int thread_count = 1);
   ~Node();
 
   /// Creates a new Publisher.
   /// IMPORTANT: The Publisher object returned has a reference to the node instance, so the node
   /// MUST be kept alive as long as the returned object is alive.
   /// @param topic The topic that the publisher will publish to.
+  /// @param qos Queue depths and socket options, e.g. QosProfile::sensorBulk() for topics that
+  ///   send large messages in bursts. With multiplexing, only its codec and chunking apply.
   template <typename T>
-  std::shared_ptr<Publisher> registerCapnpPublisher(const Topic &topic) {
+  std::shared_ptr<Publisher> registerCapnpPublisher(const Topic &topic,
+                                                    const QosProfile &qos = QosProfile()) {
     // For some reason, std::make_shared() isn't able to deduce which constructor to use here.
-    return std::shared_ptr<Publisher>{new Publisher{ios_, directory_, topic.str(), {typeOf<T>()}}};
+    auto publisher =
+        multiplexing_
+            ? std::shared_ptr<Publisher>{new Publisher{ios_, *directory_, topic.str(),
+                                                       {typeOf<T>()}, mux(), qos}}
+            : std::shared_ptr<Publisher>{
+                  new Publisher{ios_, *directory_, topic.str(), {typeOf<T>()}, Address(), qos}};
+    publisher->setTracing(tracing_);
+    return track(publisher);
+  }
+
+  /// Creates a new Publisher that hands messages to subscribers on the same host through shared
+  /// memory. See ShmPublisher.
+  /// IMPORTANT: The Publisher object returned has a reference to the node instance, so the node
+  /// MUST be kept alive as long as the returned object is alive.
+  /// @param topic The topic that the publisher will publish to.
+  /// @param slot_size The largest message, in bytes, that is sent through shared memory.
+  /// @param slot_count The number of messages kept in shared memory before the oldest is reused.
+  template <typename T>
+  std::shared_ptr<Publisher> registerCapnpShmPublisher(
+      const Topic &topic, size_t slot_size = DEFAULT_SHM_SLOT_SIZE,
+      uint32_t slot_count = DEFAULT_SHM_SLOT_COUNT) {
+    auto publisher = std::shared_ptr<Publisher>{
+        new ShmPublisher{ios_, *directory_, topic.str(), {typeOf<T>()}, slot_size, slot_count}};
+    publisher->setTracing(tracing_);
+    return track(publisher);
   }
 
   /// Creates a new Subscriber.
@@ -64,10 +107,13 @@ class Node {
   /// @param handler A callback that is called whenever a message is received.
   /// @param error_handler A callback that is called whenever there is an error parsing a received
   ///   message, or some other application-level error occurs that triggers an exception.
+  /// @param qos Queue depths and socket options. With conflate set (e.g. QosProfile::control()), a
+  ///   handler that falls behind is only called with the newest message, and the skipped ones are
+  ///   counted by Subscriber::dropped().
   template <typename T>
   std::shared_ptr<Subscriber> registerCapnpSubscriber(
       const Topic &topic, CapnpMessageHandler<typename T::Reader> handler,
-      ExceptionHandler error_handler) {
+      ExceptionHandler error_handler, const QosProfile &qos) {
     auto zmq_handler = [handler, error_handler](azmq::message_vector &msg_vec) {
       try {
         auto reader = a17::dispatch::SmartCapnpReader(msg_vec);
@@ -77,7 +123,23 @@ class Node {
         error_handler(e);
       }
     };
-    return std::make_shared<Subscriber>(ios_, directory_, topic.str(), zmq_handler);
+    auto subscriber = std::make_shared<Subscriber>(
+        ios_, *directory_, topic.str(), zmq_handler, ErrorHandler(), ConnectionHandler(),
+        ConnectionHandler(), std::set<message_type>{""}, qos);
+    subscriber->setLatencyTracking(tracing_);
+    return track(subscriber);
+  }
+
+  /// Creates a new Subscriber with the default QoS profile.
+  /// @param queue With SubscriberQueue::KEEP_LAST, a handler that falls behind is only called with
+  ///   the newest message, and the skipped ones are counted by Subscriber::dropped().
+  template <typename T>
+  std::shared_ptr<Subscriber> registerCapnpSubscriber(
+      const Topic &topic, CapnpMessageHandler<typename T::Reader> handler,
+      ExceptionHandler error_handler, SubscriberQueue queue = SubscriberQueue::ALL) {
+    QosProfile qos;
+    qos.conflate = queue == SubscriberQueue::KEEP_LAST;
+    return registerCapnpSubscriber<T>(topic, handler, error_handler, qos);
   }
 
   /// Creates a new Subscriber with a default error_handler that simply logs the error.
@@ -85,19 +147,34 @@ class Node {
   /// MUST be kept alive as long as the returned object is alive.
   /// @param topic The topic that the subscriber will subscribe to.
   /// @param handler A callback that is called whenever a message is received.
+  /// @param queue See above.
+  template <typename T>
+  std::shared_ptr<Subscriber> registerCapnpSubscriber(
+      const Topic &topic, CapnpMessageHandler<typename T::Reader> handler,
+      SubscriberQueue queue = SubscriberQueue::ALL) {
+    QosProfile qos;
+    qos.conflate = queue == SubscriberQueue::KEEP_LAST;
+    return registerCapnpSubscriber<T>(topic, handler, qos);
+  }
+
+  /// Creates a new Subscriber with a default error_handler that simply logs the error.
+  /// @param qos See above.
   template <typename T>
   std::shared_ptr<Subscriber> registerCapnpSubscriber(
-      const Topic &topic, CapnpMessageHandler<typename T::Reader> handler) {
-    return registerCapnpSubscriber<T>(topic, handler, [this, topic](const std::exception &e) {
-      this->logger_->warn("Unhandled exception in subscriber {}: {}", topic.str(), e.what());
-    });
+      const Topic &topic, CapnpMessageHandler<typename T::Reader> handler, const QosProfile &qos) {
+    return registerCapnpSubscriber<T>(
+        topic, handler,
+        [this, topic](const std::exception &e) {
+          this->logger_->warn("Unhandled exception in subscriber {}: {}", topic.str(), e.what());
+        },
+        qos);
   }
 
-  // TODO(kgreenek): Deprecate this in favor of using a proper zmq Router (i.e. a service). The
-  // problem with using a zmq PubClient/ReplyServer is that it assumes only one client and one
-  // server. If two clients send a request to the same server at the same time, then the ReplyServer
-  // will get into a bad state, which is VERY BAD. It assumes there is 1 request, followed by 1
-  // reply.
+  // TODO(kgreenek): Deprecate this in favor of registerCapnpService(), which uses a proper zmq
+  // Router. The problem with using a zmq PubClient/ReplyServer is that it assumes only one client
+  // and one server. If two clients send a request to the same server at the same time, then the
+  // ReplyServer will get into a bad state, which is VERY BAD. It assumes there is 1 request,
+  // followed by 1 reply.
   /// Creates a new ReplyServer.
   /// Use the Node::newCapnpMessageBuilder() method to create a builder for the reply.
   /// IMPORTANT: The ReplyServer object returned has a reference to the node instance, so the node
@@ -111,10 +188,13 @@ class Node {
   ///   application-level error that triggers an exception. This MUST be implemented, and the caller
   ///   MUST call the given function with a reply (any reply) or the server will no longer be able
   ///   to receive requests.
+  /// @param workers If given, the handlers run on this pool instead of the node's thread, and
+  ///   replies are sent from the node's thread. See a17::utils::WorkerPool.
   template <typename RequestT, typename ReplyT>
   std::shared_ptr<ReplyServer> registerCapnpReplyServerAsync(
       const Topic &topic, ReplyServerCapnpRequestHandler<typename RequestT::Reader> request_handler,
-      ReplyServerExceptionHandler error_handler) {
+      ReplyServerExceptionHandler error_handler,
+      std::shared_ptr<a17::utils::WorkerPool> workers = nullptr) {
     auto zmq_request_handler = [request_handler, error_handler](azmq::message_vector &msg_vec,
                                                                 ReplySender send_reply_fn) {
       auto reply_handler = [send_reply_fn](const SmartCapnpBuilder &reply_builder) {
@@ -129,12 +209,14 @@ class Node {
       }
     };
     // For some reason, std::make_shared() isn't able to deduce which constructor to use here.
-    return std::shared_ptr<ReplyServer>{new ReplyServer{ios_,
-                                                        directory_,
-                                                        topic.str(),
-                                                        {typeOf<RequestT>()},
-                                                        {typeOf<ReplyT>()},
-                                                        zmq_request_handler}};
+    auto server = std::shared_ptr<ReplyServer>{new ReplyServer{ios_,
+                                                               *directory_,
+                                                               topic.str(),
+                                                               {typeOf<RequestT>()},
+                                                               {typeOf<ReplyT>()},
+                                                               zmq_request_handler}};
+    server->setWorkerPool(workers);
+    return track(server);
   }
 
   /// Creates a new RequestClient.
@@ -143,7 +225,58 @@ class Node {
   template <typename RequestT, typename ReplyT>
   std::shared_ptr<RequestClient> newRequestClient(const Topic &topic) {
     // For some reason, std::make_shared() isn't able to deduce which constructor to use here.
-    return std::shared_ptr<RequestClient>{new RequestClient{ios_, directory_, topic.str()}};
+    return std::shared_ptr<RequestClient>{new RequestClient{ios_, *directory_, topic.str()}};
+  }
+
+  /// Creates a new Service. Unlike a ReplyServer, a Service handles any number of requests from
+  /// any number of ServiceClients at once, and its replies may be sent in any order.
+  /// Use the Node::newCapnpMessageBuilder() method to create a builder for the reply.
+  /// IMPORTANT: The Service object returned has a reference to the node instance, so the node
+  /// MUST be kept alive as long as the returned object is alive.
+  /// @param topic The topic that the service will be advertised as.
+  /// @param handler A callback that is called for every request. Its first argument is the request,
+  ///   and the second argument is a callback that sends the reply. The reply callback may be called
+  ///   later, from any thread.
+  /// @param error_handler This is called whenever there is an error parsing the request, or other
+  ///   application-level error that triggers an exception. It may reply, or leave the client to
+  ///   time out.
+  /// @param workers If given, the handlers run on this pool instead of the node's thread, so that
+  ///   up to its thread count of requests are handled at once. See a17::utils::WorkerPool.
+  template <typename RequestT, typename ReplyT>
+  std::shared_ptr<Service> registerCapnpService(
+      const Topic &topic, ReplyServerCapnpRequestHandler<typename RequestT::Reader> request_handler,
+      ReplyServerExceptionHandler error_handler,
+      std::shared_ptr<a17::utils::WorkerPool> workers = nullptr) {
+    auto zmq_request_handler = [request_handler, error_handler](azmq::message_vector &msg_vec,
+                                                                ReplySender send_reply_fn) {
+      auto reply_handler = [send_reply_fn](const SmartCapnpBuilder &reply_builder) {
+        send_reply_fn(reply_builder.getSmartMessage());
+      };
+      try {
+        auto reader = a17::dispatch::SmartCapnpReader(msg_vec);
+        auto request = reader.getRoot<RequestT>();
+        request_handler(request, reply_handler);
+      } catch (const std::exception &e) {
+        error_handler(e, reply_handler);
+      }
+    };
+    // For some reason, std::make_shared() isn't able to deduce which constructor to use here.
+    auto service = std::shared_ptr<Service>{new Service{ios_,
+                                                        *directory_,
+                                                        topic.str(),
+                                                        {typeOf<RequestT>()},
+                                                        {typeOf<ReplyT>()},
+                                                        zmq_request_handler}};
+    service->setWorkerPool(workers);
+    return track(service);
+  }
+
+  /// Creates a new ServiceClient. Send requests with ServiceClient::request<ReplyT>().
+  /// Use the Node::newCapnpMessageBuilder() method to create a builder for the request.
+  /// The client isn't typed: the reply type is given to each request.
+  /// @param topic The topic of the service that requests will be sent to.
+  std::shared_ptr<ServiceClient> newServiceClient(const Topic &topic) {
+    return track(std::make_shared<ServiceClient>(ios_, *directory_, topic.str()));
   }
 
   /// Creates a new Repeater that runs on the same io_service as the node. The specified operation
@@ -158,8 +291,10 @@ class Node {
   }
 
   /// Returns a builder for creating capnp requests. It uses an internal memory allocation pool to
-  /// prevent heap thrashing and speed up requests -- especially if sending at a high rate.
-  SmartCapnpBuilder newCapnpMessageBuilder() { return SmartCapnpBuilder{pool_}; }
+  /// prevent heap thrashing and speed up requests -- especially if sending at a high rate. The pool
+  /// has size classes from 512 B to 16 MB, see pool() for its hit, miss and fallback counters.
+  /// Builders start in the segments of previously destroyed builders, see SmartCapnpBuilderCache.
+  SmartCapnpBuilder newCapnpMessageBuilder() { return SmartCapnpBuilder{builder_cache_}; }
 
   inline boost::asio::io_service &service() { return ios_; }
   inline std::shared_ptr<spdlog::logger> logger() { return logger_; }
@@ -170,29 +305,71 @@ class Node {
 
   // Starts the node on a background thread. Asynchronous.
   void start();
-  // The main run loop of the node. Blocking.
-  virtual void run() { ios_.run(); }
+  // The main run loop of the node. Blocking. Runs the io_service on thread_count threads,
+  // including the calling thread.
+  virtual void run();
   // Signals the thread to stop. (the thead may not stop immediately)
   virtual void stop();
   inline void post(std::function<void()> operation) { ios_.post(operation); }
 
   inline const std::string &name() { return name_; }
-  inline Directory &directory() { return directory_; }
-  inline a17::utils::BufferPool &pool() { return pool_; }
+  inline unsigned int threadCount() const { return thread_count_; }
+  inline Directory &directory() { return *directory_; }
+  inline a17::utils::SizeClassPool &pool() { return pool_; }
   inline bool signaledShutdown() const { return signaled_shutdown_; }
 
+  /// Periodically publishes a NodeStats message (see a17/capnp_msgs/dispatch.capnp) with the
+  /// metrics of every socket created by this node, on the NODE_STATS_TOPIC topic shared by all
+  /// nodes. Also enabled for every node by the --dispatch_stats_period_ms flag.
+  void publishStats(std::chrono::steady_clock::duration period = std::chrono::seconds(1));
+  /// The metrics of every live socket created by this node, by log name.
+  std::vector<std::pair<std::string, SocketMetrics>> socketMetrics();
+
+  /// Publishers created from now on stamp each message with its sequence number and send time, and
+  /// subscribers created from now on record latency histograms and lost messages from them. See
+  /// Subscriber::latency().
+  inline void setTracing(bool tracing) { tracing_ = tracing; }
+  inline bool tracing() const { return tracing_; }
+
+  /// Publishers created from now on by registerCapnpPublisher() share one PUB socket, rather than
+  /// binding a port each, and subscribers only receive the topics they subscribe to from it. See
+  /// PublisherMux. Also enabled for every node by the --dispatch_multiplex flag.
+  inline void setMultiplexing(bool multiplexing) { multiplexing_ = multiplexing; }
+  inline bool multiplexing() const { return multiplexing_; }
+  /// The PUB socket shared by multiplexed publishers, created on first use.
+  std::shared_ptr<PublisherMux> mux();
+
  protected:
   boost::asio::io_service ios_;
   std::string name_;
-  a17::utils::BufferPool pool_;
-  Directory directory_;
+  unsigned int thread_count_;
+  a17::utils::SizeClassPool pool_;
+  SmartCapnpBuilderCache builder_cache_;
+  // A DirectoryView when the node shares the directory of its process.
+  std::unique_ptr<Directory> directory_;
   bool signaled_shutdown_ = false;
+  bool tracing_ = false;
+  bool multiplexing_ = false;
   std::shared_ptr<spdlog::logger> logger_;
   boost::asio::signal_set signals_;
   virtual void signal(const boost::system::error_code &ec, int signalNumber);
 
  private:
+  template <typename S>
+  std::shared_ptr<S> track(std::shared_ptr<S> socket) {
+    std::lock_guard<std::mutex> lock(sockets_mutex_);
+    sockets_.push_back(socket);
+    return socket;
+  }
+  bool sendStats();
+
   std::future<void> future_;
+  std::mutex sockets_mutex_;
+  std::vector<std::weak_ptr<Socket>> sockets_;
+  std::mutex mux_mutex_;
+  std::shared_ptr<PublisherMux> mux_;
+  std::shared_ptr<Publisher> stats_publisher_;
+  std::shared_ptr<a17::utils::Repeater> stats_repeater_;
 };
 
 }  // namespace dispatch
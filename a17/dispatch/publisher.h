@@ -1,5 +1,15 @@
 #pragma once
 
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+
+#include "chunked_message.h"
+#include "directory.h"
+#include "message_codec.h"
+#include "message_helpers.h"
+#include "publisher_mux.h"
 #include "server.h"
 
 namespace a17 {
@@ -9,12 +19,147 @@ namespace dispatch {
 class Publisher : public Server {
  public:
   Publisher(boost::asio::io_service &ios, Directory &directory, const std::string &topic,
-            const std::set<message_type> &outputTypes, Address address = Address())
+            const std::set<message_type> &outputTypes, Address address = Address(),
+            const QosProfile &qos = QosProfile())
+      : Server(ios, ZMQ_PUB, "Publisher", directory, topic, std::set<message_type>{}, outputTypes,
+               address, "", qos) {
+    setCodec(qos.codec, qos.codec_min_bytes);
+    setChunking(qos.chunk_size);
+  }
+
+  Publisher(boost::asio::io_service &ios, const std::string &address = "",
+            const QosProfile &qos = QosProfile())
+      : Server(ios, ZMQ_PUB, "Publisher", address, qos) {
+    setCodec(qos.codec, qos.codec_min_bytes);
+    setChunking(qos.chunk_size);
+  }
+
+  // Publishes the topic through a PUB socket shared with other topics instead of creating one of
+  // its own. Only the codec and chunking of the profile apply, since the socket options are the
+  // mux's. The publisher's metrics count the messages sent through the mux for its topic.
+  Publisher(boost::asio::io_service &ios, Directory &directory, const std::string &topic,
+            const std::set<message_type> &outputTypes, std::shared_ptr<PublisherMux> mux,
+            const QosProfile &qos = QosProfile())
       : Server(ios, ZMQ_PUB, "Publisher", directory, topic, std::set<message_type>{}, outputTypes,
-               address) {}
+               mux->advertisedAddress()),
+        mux_(std::move(mux)),
+        mux_topic_frame_(muxTopicFrame(topic)) {
+    setCodec(qos.codec, qos.codec_min_bytes);
+    setChunking(qos.chunk_size);
+  }
+
+  using Server::send;
+
+  size_t send(const azmq::message_vector &message, boost::system::error_code &ec) override {
+    if (!tracing_ && codec_ == MessageCodec::NONE && chunk_size_ == 0) {
+      return publish(message, ec);
+    }
+    azmq::message_vector stamped = message;
+    encode(stamped);
+    if (tracing_) {
+      auto now = std::chrono::steady_clock::now().time_since_epoch();
+      auto realtime = std::chrono::system_clock::now().time_since_epoch();
+      traceSmartMessage(stamped,
+                        {publisher_id_, traceHostId(), sequence_++,
+                         std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(),
+                         std::chrono::duration_cast<std::chrono::nanoseconds>(realtime).count()});
+    }
+    if (chunk_size_ > 0) {
+      size_t size = 0;
+      for (const auto &frame : stamped) size += frame.size();
+      if (size > chunk_size_) return publishChunks(stamped, ec);
+    }
+    return publish(stamped, ec);
+  }
+
+  // Stamp every message with a SmartMessageTrace, which subscribers use to measure latency and
+  // detect lost messages (see Subscriber::setLatencyTracking()).
+  inline void setTracing(bool tracing) { tracing_ = tracing; }
+  inline bool tracing() const { return tracing_; }
+
+  // Encode the capnp frame of messages of at least min_bytes with codec, which subscribers decode
+  // transparently. Worth it for large, compressible messages on slow links. Throws
+  // std::runtime_error if this build doesn't have the codec.
+  void setCodec(MessageCodec codec, size_t min_bytes = DEFAULT_CODEC_MIN_BYTES) {
+    if (!codecAvailable(codec)) {
+      throw std::runtime_error("Codec " + codecName(codec) + " is not available in this build");
+    }
+    codec_ = codec;
+    codec_min_bytes_ = min_bytes;
+  }
+  inline MessageCodec codec() const { return codec_; }
+
+  // Send messages larger than chunk_size bytes as a stream of chunks of that size, which
+  // subscribers put back together (see chunked_message.h). 0 sends every message whole. Each chunk
+  // is a zmq message of its own, so the send high-water mark must leave room for all the chunks of
+  // a message, or a PUB socket drops the rest of it.
+  // The chunks of a message are queued back to back by send(), which may be called from any thread,
+  // so they are not interleaved with the publisher's other messages: a small message sent after a
+  // large one still waits for all of its chunks. Chunking lets subscribers process a message as it
+  // arrives, and bounds the size of each zmq message, but doesn't reorder the publisher's queue.
+  inline void setChunking(size_t chunk_size) { chunk_size_ = chunk_size; }
+  inline size_t chunkSize() const { return chunk_size_; }
+  // The shared socket the topic is published through, or null if it has its own.
+  inline const std::shared_ptr<PublisherMux> &mux() const { return mux_; }
+  // Sizes and encode time of the messages encoded so far, e.g. codecStats().ratio().
+  CodecStats codecStats() {
+    std::lock_guard<std::mutex> lock(codec_mutex_);
+    return codec_stats_;
+  }
+
+ protected:
+  Publisher(boost::asio::io_service &ios, Directory &directory, const std::string &topic,
+            const std::set<message_type> &outputTypes, Address address,
+            const std::string &advertisedProtocol)
+      : Server(ios, ZMQ_PUB, "Publisher", directory, topic, std::set<message_type>{}, outputTypes,
+               address, advertisedProtocol) {}
+
+  // Hands the message to subscribers in the same node, then publishes it to all others.
+  virtual size_t publish(const azmq::message_vector &message, boost::system::error_code &ec) {
+    if (directory_) directory_->deliverLocal(topic_name_, message);
+    if (mux_) {
+      size_t size = mux_->publish(mux_topic_frame_, message, ec);
+      countSend(size, ec);
+      return size;
+    }
+    return Server::send(message, ec);
+  }
+
+ private:
+  size_t publishChunks(const azmq::message_vector &message, boost::system::error_code &ec) {
+    size_t size = 0;
+    for (const auto &chunk :
+         chunkSmartMessage(message, chunk_size_, publisher_id_, chunk_sequence_++)) {
+      size += publish(chunk, ec);
+      if (ec) break;
+    }
+    return size;
+  }
+
+  void encode(azmq::message_vector &message) {
+    if (codec_ == MessageCodec::NONE || message.size() < 2) return;
+    if (message[1].size() < codec_min_bytes_) return;
+    CodecStats stats;
+    if (encodeSmartMessage(message, codec_, &stats)) {
+      std::lock_guard<std::mutex> lock(codec_mutex_);
+      codec_stats_ += stats;
+    }
+  }
+
+  bool tracing_ = false;
+  uint64_t publisher_id_ = newTracePublisherId();
+  std::atomic<uint64_t> sequence_{0};
+
+  MessageCodec codec_ = MessageCodec::NONE;
+  size_t codec_min_bytes_ = DEFAULT_CODEC_MIN_BYTES;
+  std::mutex codec_mutex_;
+  CodecStats codec_stats_;
+
+  size_t chunk_size_ = 0;
+  std::atomic<uint64_t> chunk_sequence_{0};
 
-  Publisher(boost::asio::io_service &ios, const std::string &address = "")
-      : Server(ios, ZMQ_PUB, "Publisher", address) {}
+  std::shared_ptr<PublisherMux> mux_;
+  azmq::message mux_topic_frame_;
 };
 
 }  // namespace dispatch
@@ -0,0 +1,67 @@
+#include "publisher_mux.h"
+
+#include <cstring>
+
+namespace a17 {
+namespace dispatch {
+
+namespace {
+
+// Topic frames are the magic followed by the topic hash. Their size differs from every id frame,
+// and capnp ids always have their top bit set, so the two can't be mistaken for each other.
+const char MUX_MAGIC[4] = {'M', 'U', 'X', 0};
+const size_t MUX_TOPIC_FRAME_SIZE = sizeof(MUX_MAGIC) + sizeof(uint64_t);
+
+const uint64_t FNV_OFFSET_BASIS = 14695981039346656037ull;
+const uint64_t FNV_PRIME = 1099511628211ull;
+
+}  // namespace
+
+PublisherMux::PublisherMux(boost::asio::io_service &ios, Address address, const QosProfile &qos)
+    : Server(ios, ZMQ_PUB, "PublisherMux", address.address(), qos) {}
+
+std::string PublisherMux::advertisedAddress() const {
+  Address bound = Address::parse(address_);
+  return Address(MUX_PROTOCOL, bound.ip(), bound.port()).address();
+}
+
+size_t PublisherMux::publish(const azmq::message &topic_frame, const azmq::message_vector &message,
+                             boost::system::error_code &ec) {
+  azmq::message_vector prefixed;
+  prefixed.reserve(message.size() + 1);
+  prefixed.push_back(topic_frame);
+  prefixed.insert(prefixed.end(), message.begin(), message.end());
+  std::lock_guard<std::mutex> lock(send_mutex_);
+  return send(prefixed, ec);
+}
+
+uint64_t muxTopicHash(const std::string &topic_name) {
+  // FNV-1a, since std::hash may differ between builds.
+  uint64_t hash = FNV_OFFSET_BASIS;
+  for (unsigned char c : topic_name) {
+    hash = (hash ^ c) * FNV_PRIME;
+  }
+  return hash;
+}
+
+azmq::message muxTopicFrame(const std::string &topic_name) {
+  char frame[MUX_TOPIC_FRAME_SIZE];
+  uint64_t hash = muxTopicHash(topic_name);
+  memcpy(frame, MUX_MAGIC, sizeof(MUX_MAGIC));
+  memcpy(frame + sizeof(MUX_MAGIC), &hash, sizeof(hash));
+  return azmq::message(boost::asio::buffer(frame, sizeof(frame)));
+}
+
+bool isMuxTopicFrame(const azmq::message &frame) {
+  return frame.size() == MUX_TOPIC_FRAME_SIZE &&
+         memcmp(frame.data(), MUX_MAGIC, sizeof(MUX_MAGIC)) == 0;
+}
+
+std::string MuxConnectEndpoint(const std::string &address) {
+  Address parts = Address::parse(address);
+  if (parts.protocol() != MUX_PROTOCOL) return address;
+  return Address("tcp", parts.ip(), parts.port()).address();
+}
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "server.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Protocol that multiplexed topics are advertised with, e.g. mux://ip:port.
+const std::string MUX_PROTOCOL = "mux";
+
+// A node with hundreds of topics binds a port and keeps a connection per subscriber for each of
+// them. A PublisherMux is one PUB socket that the publishers of a node share instead (see
+// Publisher's multiplexed constructor). Each message is sent with a topic frame in front of it,
+// which holds a hash of the topic name, and the topics are advertised as mux://ip:port.
+// Subscribers connect to the tcp port and subscribe to the topic frame of their topic, so that the
+// PUB socket only sends them the topics they want, and strip the topic frame before their handler
+// is called.
+class PublisherMux : public Server {
+ public:
+  PublisherMux(boost::asio::io_service &ios, Address address = Address(),
+               const QosProfile &qos = QosProfile());
+
+  // The address that topics published through the mux are advertised at.
+  std::string advertisedAddress() const;
+
+  // Sends a message after its topic frame (see muxTopicFrame()). May be called from any thread.
+  size_t publish(const azmq::message &topic_frame, const azmq::message_vector &message,
+                 boost::system::error_code &ec);
+
+ private:
+  std::mutex send_mutex_;
+};
+
+// Stable hash of a topic name, the same in every process.
+uint64_t muxTopicHash(const std::string &topic_name);
+// The frame that messages of a topic are sent after, which is also the subscribe prefix for it.
+azmq::message muxTopicFrame(const std::string &topic_name);
+// Whether the frame is a topic frame rather than the id frame of a smart message.
+bool isMuxTopicFrame(const azmq::message &frame);
+
+// Returns the address subscribers should connect to for an advertised address. For a mux://
+// address that is the tcp port of the mux; other addresses are returned as they are.
+std::string MuxConnectEndpoint(const std::string &address);
+
+}  // namespace dispatch
+}  // namespace a17
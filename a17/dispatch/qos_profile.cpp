@@ -0,0 +1,40 @@
+#include "qos_profile.h"
+
+namespace a17 {
+namespace dispatch {
+
+QosProfile QosProfile::sensorBulk() {
+  QosProfile qos;
+  qos.send_hwm = 1000;
+  qos.receive_hwm = 1000;
+  qos.send_buffer = 4 * 1024 * 1024;
+  qos.receive_buffer = 4 * 1024 * 1024;
+  qos.linger_ms = 0;
+  return qos;
+}
+
+QosProfile QosProfile::control() {
+  QosProfile qos;
+  qos.send_hwm = 1;
+  qos.receive_hwm = 1;
+  qos.tcp_keepalive_idle = 1;
+  qos.tcp_keepalive_interval = 1;
+  qos.tcp_keepalive_count = 3;
+  qos.linger_ms = 0;
+  qos.conflate = true;
+  return qos;
+}
+
+QosProfile QosProfile::reliable() {
+  QosProfile qos;
+  qos.send_hwm = 0;
+  qos.receive_hwm = 0;
+  qos.tcp_keepalive_idle = 5;
+  qos.tcp_keepalive_interval = 1;
+  qos.tcp_keepalive_count = 5;
+  qos.linger_ms = -1;
+  return qos;
+}
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,49 @@
+#pragma once
+
+#include <boost/optional.hpp>
+
+#include "message_codec.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Queueing and transport settings for a socket. Settings that are not set keep the zmq or kernel
+// default.
+// zmq reads most of these when a connection is made, so they only affect connections made after
+// they are applied. Publishers take their profile in the constructor, before binding; subscribers
+// connect once the directory finds their topic, after Node has applied theirs.
+struct QosProfile {
+  // Messages queued per peer before zmq drops (PUB) or blocks (other sockets). 0 means no limit.
+  boost::optional<int> send_hwm = 10;
+  boost::optional<int> receive_hwm;
+  // Kernel SO_SNDBUF and SO_RCVBUF, in bytes.
+  boost::optional<int> send_buffer;
+  boost::optional<int> receive_buffer;
+  // TCP keepalive, so that a dead peer on a quiet topic is noticed. Times are in seconds.
+  boost::optional<int> tcp_keepalive_idle;
+  boost::optional<int> tcp_keepalive_interval;
+  boost::optional<int> tcp_keepalive_count;
+  // How long unsent messages are kept when the socket is closed. -1 means until they are sent.
+  boost::optional<int> linger_ms;
+  // Only handle the newest received message (see Socket::setKeepLast). Ignored when sending.
+  bool conflate = false;
+  // Encoding of published messages of at least codec_min_bytes (see Publisher::setCodec). Ignored
+  // when receiving, since subscribers decode whatever they get.
+  MessageCodec codec = MessageCodec::NONE;
+  size_t codec_min_bytes = DEFAULT_CODEC_MIN_BYTES;
+  // Messages larger than this many bytes are published in chunks of this size (see
+  // Publisher::setChunking). 0 sends every message whole. Each chunk counts against send_hwm.
+  size_t chunk_size = 0;
+
+  // Large messages in bursts, e.g. point clouds and images: deep queues and kernel buffers, so that
+  // a burst isn't dropped, and no linger, so that a backlog doesn't hold up shutdown.
+  static QosProfile sensorBulk();
+  // Small messages where only the latest matters, e.g. commands and state: no queueing, and a dead
+  // peer is noticed within seconds.
+  static QosProfile control();
+  // Messages that should not be dropped: unlimited queues, and pending messages are sent on close.
+  static QosProfile reliable();
+};
+
+}  // namespace dispatch
+}  // namespace a17
@@ -1,10 +1,16 @@
 #include "reply_server.h"
 
+#include "trace_log.h"
+
 namespace a17 {
 namespace dispatch {
 
 void ReplyServer::onRequest(azmq::message_vector &message) {
-  if (logger_) logger_->trace("{0} onMessage", log_name_);
+  if (DISPATCH_SHOULD_TRACE(logger_)) logger_->trace("{0} onMessage", log_name_);
+  if (workers_) {
+    postRequest(message);
+    return;
+  }
   // to ensure that the entire reply server socket does not go down if we catch an exception in the
   // application layer, send a blank reply to free the request client and reset the reply server for
   // another message to be received
@@ -22,6 +28,37 @@ void ReplyServer::onRequest(azmq::message_vector &message) {
   }
 }
 
+void ReplyServer::postRequest(azmq::message_vector &message) {
+  std::weak_ptr<ReplyServer *> weak_self = self_;
+  // The strand is copied now, so that a reply from a worker thread doesn't touch a server that is
+  // being destroyed. The server is only checked on the strand.
+  boost::asio::io_service::strand strand = strand_;
+  ReplySender reply_sender = [weak_self, strand](const azmq::message_vector &reply) mutable {
+    strand.post([weak_self, reply]() {
+      auto self = weak_self.lock();
+      if (self) (*self)->sendReply(reply);
+    });
+  };
+
+  ReplySmartMessageHandler handler = reply_handler_;
+  auto logger = logger_;
+  std::string log_name = log_name_;
+  // The message is copied since the socket reuses its receive buffer. The frames are shared.
+  bool posted = workers_->post([handler, message, reply_sender, logger, log_name]() mutable {
+    try {
+      handler(message, reply_sender);
+    } catch (const std::exception &e) {
+      if (logger) logger->warn("Caught exception in {} onRequest()\n{}", log_name, e.what());
+      reply_sender(azmq::message_vector());
+    }
+  });
+
+  if (!posted) {
+    if (logger_) logger_->warn("{0} worker queue full, dropping request", log_name_);
+    sendReply(azmq::message_vector());
+  }
+}
+
 void ReplyServer::sendReply(const azmq::message_vector &reply) {
   boost::system::error_code ec;
   send(reply, ec);
@@ -1,8 +1,11 @@
 #pragma once
 
+#include <memory>
 #include <stack>
 #include <set>
 
+#include "a17/utils/worker_pool.h"
+
 #include "handlers.h"
 #include "server.h"
 
@@ -10,6 +13,11 @@ namespace a17 {
 namespace dispatch {
 
 // client sends messages, server replies with message
+//
+// By default the handler runs on the node's thread, blocking the node's other sockets until it
+// returns. With a worker pool (setWorkerPool()), each request is handed to the pool instead, and
+// the reply is marshalled back to the socket's strand to be sent. If the pool's queue is full, the
+// request gets an empty reply, as it does when the handler throws.
 
 class ReplyServer : public Server {
  public:
@@ -21,7 +29,8 @@ class ReplyServer : public Server {
         request_handler_(bind1(&ReplyServer::onRequest)),
         reply_sender_(bind1(&ReplyServer::sendReply)),
         reply_handler_(handler),
-        error_handler_(error) {
+        error_handler_(error),
+        self_(std::make_shared<ReplyServer *>(this)) {
     receive(request_handler_, error_handler_);
   }
 
@@ -31,22 +40,33 @@ class ReplyServer : public Server {
         request_handler_(bind1(&ReplyServer::onRequest)),
         reply_sender_(bind1(&ReplyServer::sendReply)),
         reply_handler_(handler),
-        error_handler_(error) {
+        error_handler_(error),
+        self_(std::make_shared<ReplyServer *>(this)) {
     receive(request_handler_, error_handler_);
   }
 
   //! Return the current handler and replace it with the new handler.
   inline void setReplyHandler(ReplySmartMessageHandler handler) { reply_handler_ = handler; }
 
+  //! Run the handler on the given pool, or on the node's thread if null.
+  inline void setWorkerPool(std::shared_ptr<a17::utils::WorkerPool> workers) {
+    workers_ = workers;
+  }
+  inline const std::shared_ptr<a17::utils::WorkerPool> &workerPool() const { return workers_; }
+
  protected:
   void onRequest(azmq::message_vector &message);
   void sendReply(const azmq::message_vector &reply);
+  void postRequest(azmq::message_vector &message);
 
  private:
   SmartMessageHandler request_handler_;
   ReplySender reply_sender_;
   ReplySmartMessageHandler reply_handler_;
   ErrorHandler error_handler_;
+  std::shared_ptr<a17::utils::WorkerPool> workers_;
+  // Lets replies from worker threads detect that the server was destroyed in the meantime.
+  std::shared_ptr<ReplyServer *> self_;
 };
 
 }  // namespace dispatch
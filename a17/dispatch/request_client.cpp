@@ -58,6 +58,7 @@ boost::system::error_code RequestClient::request(const azmq::message_vector &mes
     logger_->error("Error sending request: {}", ec.message());
     return ec;
   }
+  error_handler_ = error_handler;
   socket_->receive(bind1(&RequestClient::sendReplyToHandler), error_handler);
   waiting_for_receive_ = true;
   if (timeout > 0) {
@@ -89,6 +90,20 @@ void RequestClient::cleanupRequest() {
   waiting_for_receive_ = false;
 }
 
+void RequestClient::abortRequest() {
+  if (!waiting_for_receive_) {
+    return;
+  }
+  cleanupRequest();
+  // After the client has connected to the next server, so that the handler can retry.
+  auto error_handler = error_handler_;
+  if (error_handler) {
+    ios_->post([error_handler]() {
+      error_handler(boost::system::errc::make_error_code(boost::system::errc::connection_aborted));
+    });
+  }
+}
+
 void RequestClient::onDirectoryTopicsChanged(const std::string &topic_name,
                                              const GuidTopicMap &guid_topic_map) {
   if (guid_topic_map.empty()) {
@@ -116,6 +131,8 @@ void RequestClient::disconnect() {
     return;
   }
   logger_->info("RequestClient [{0}] !@ {1}", connected_topic_.name, connected_topic_.address);
+  // The reply to a pending request would arrive on this socket.
+  abortRequest();
   socket_->socket().disconnect(connected_topic_.address);
   socket_ = nullptr;
 }
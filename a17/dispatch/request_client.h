@@ -17,6 +17,9 @@
 namespace a17 {
 namespace dispatch {
 
+// Sends requests to the newest server of a topic. When that server goes, e.g. because its node
+// exited or its lease expired (see Directory), the client fails over to the next newest one, and a
+// request still waiting for its reply fails with connection_aborted.
 class RequestClient {
  public:
   RequestClient(boost::asio::io_service &ios, Directory &directory, const std::string &topic_name,
@@ -40,6 +43,7 @@ class RequestClient {
   void sendReplyToHandler(azmq::message_vector &message);
   void onDirectoryTopicsChanged(const std::string &topic_name, const GuidTopicMap &guid_topic_map);
   void cleanupRequest();
+  void abortRequest();
 
  #if SPDLOG_VERSION >= 10000
   std::shared_ptr<spdlog::logger> logger_ = std::make_shared<spdlog::logger>(
@@ -58,6 +62,7 @@ class RequestClient {
 
   std::unique_ptr<Socket> socket_ = nullptr;
   SmartMessageHandler reply_handler_ = nullptr;
+  ErrorHandler error_handler_ = nullptr;
   bool waiting_for_receive_ = false;
   DirectoryTopic connected_topic_;
   std::string topic_observer_ref_;
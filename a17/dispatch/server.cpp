@@ -8,8 +8,8 @@ namespace dispatch {
 Server::Server(boost::asio::io_service &ios, int socketType, const std::string &className,
                Directory &directory, const std::string &topicName,
                const std::set<message_type> &inputTypes, const std::set<message_type> &outputTypes,
-               Address address)
-    : Socket(ios, socketType, className), topic_name_(topicName) {
+               Address address, const std::string &advertisedProtocol, const QosProfile &qos)
+    : Socket(ios, socketType, className, qos), topic_name_(topicName), directory_(&directory) {
   log_name_ += " [" + topicName + "]";
 
   uint16_t port = directory.nextServerPort();
@@ -27,14 +27,31 @@ Server::Server(boost::asio::io_service &ios, int socketType, const std::string &
     }
   }
 
-  directory.add(topicName, socketType, address_, inputTypes, outputTypes, directory.guid());
+  std::string advertised = address_;
+  if (!advertisedProtocol.empty()) {
+    Address bound = Address::parse(address_);
+    advertised = Address(advertisedProtocol, bound.ip(), bound.port()).address();
+  }
+
+  directory.add(topicName, socketType, advertised, inputTypes, outputTypes, directory.guid());
+
+  on_destroy_ = [&]() { directory.remove(topic_name_); };
+}
 
+Server::Server(boost::asio::io_service &ios, int socketType, const std::string &className,
+               Directory &directory, const std::string &topicName,
+               const std::set<message_type> &inputTypes, const std::set<message_type> &outputTypes,
+               const std::string &advertisedAddress)
+    : Socket(ios, className), topic_name_(topicName), directory_(&directory) {
+  log_name_ += " [" + topicName + "]";
+  directory.add(topicName, socketType, advertisedAddress, inputTypes, outputTypes,
+                directory.guid());
   on_destroy_ = [&]() { directory.remove(topic_name_); };
 }
 
 Server::Server(boost::asio::io_service &ios, int socketType, const std::string &className,
-               const std::string &address)
-    : Socket(ios, socketType, className) {
+               const std::string &address, const QosProfile &qos)
+    : Socket(ios, socketType, className, qos) {
   bind(address);
   log_name_ += "(" + address_ + ")";
 }
@@ -47,13 +64,13 @@ void Server::bind(const std::string &address) {
   auto logger = spdlog::get("Socket");
   if (logger) logger->debug("{0} binding to {1}", log_name_, address);
 
-  azmqsocket_.bind(address);
+  azmqsocket_->bind(address);
   address_ = address;
 
   char addr[256];
   azmq::socket::last_endpoint endpoint(addr, sizeof(addr));
   boost::system::error_code ec;
-  azmqsocket_.get_option(endpoint, ec);
+  azmqsocket_->get_option(endpoint, ec);
 
   if (addr != address) {
     address_.assign(addr);
@@ -63,7 +80,7 @@ void Server::bind(const std::string &address) {
 
 void Server::unbind() {
   if (!address_.empty()) {
-    azmqsocket_.unbind(address_);
+    azmqsocket_->unbind(address_);
     auto logger = spdlog::get("Socket");
     if (logger) logger->info("{0} !@ {1}", log_name_, address_);
   }
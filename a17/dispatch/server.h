@@ -15,16 +15,26 @@ class Directory;
 // If address is not specified, socket binds to the preferred interface on a random free port. The
 // selected port is updated in the address field after the bind succeeds. If directory is specified,
 // the socket is advertised on the directory multicast channel with its address and capabilities.
+// If advertisedProtocol is given, the bound address is advertised with that protocol instead (e.g.
+// shm:// for a ShmPublisher). The QoS profile is applied before binding.
 class Server : public Socket {
  public:
   Server(boost::asio::io_service &ios, int socketType, const std::string &className,
          Directory &directory, const std::string &topicName,
          const std::set<message_type> &inputTypes, const std::set<message_type> &outputTypes,
-         Address address = Address());
+         Address address = Address(), const std::string &advertisedProtocol = "",
+         const QosProfile &qos = QosProfile());
+
+  // Advertises the topic at an address bound by another socket, such as a PublisherMux, which it
+  // is sent through. This server has no zmq socket of its own.
+  Server(boost::asio::io_service &ios, int socketType, const std::string &className,
+         Directory &directory, const std::string &topicName,
+         const std::set<message_type> &inputTypes, const std::set<message_type> &outputTypes,
+         const std::string &advertisedAddress);
 
   // allows for bind to be called later
   Server(boost::asio::io_service &ios, int socketType, const std::string &className,
-         const std::string &address);
+         const std::string &address, const QosProfile &qos = QosProfile());
 
   Server(Server &&other) : Socket(std::move(other)), address_(std::move(other.address_)) {}
 
@@ -40,6 +50,7 @@ class Server : public Socket {
   std::string topic_name_;
   std::string address_;
   std::function<void()> on_destroy_;
+  Directory *directory_ = nullptr;
 
  private:
   a17::utils::BufferPool pool_;
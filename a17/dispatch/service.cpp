@@ -0,0 +1,93 @@
+#include "service.h"
+
+#include <cstring>
+
+#include "trace_log.h"
+
+namespace a17 {
+namespace dispatch {
+
+// A request is [client identity][ServiceHeader][smart message...], where the identity frame is
+// added by the ROUTER socket.
+void Service::onRequest(azmq::message_vector &message) {
+  if (message.size() < 2 || message[1].size() != sizeof(ServiceHeader)) {
+    if (logger_) logger_->warn("{0} dropping malformed request", log_name_);
+    return;
+  }
+
+  azmq::message identity = message[0];
+  ServiceHeader header;
+  memcpy(&header, message[1].data(), sizeof(header));
+  if (DISPATCH_SHOULD_TRACE(logger_)) {
+    logger_->trace("{0} onRequest {1}", log_name_, header.request_id);
+  }
+
+  azmq::message_vector request(message.begin() + 2, message.end());
+  if (!workers_) {
+    handleRequest(self_, strand_, request_handler_, identity, header, request);
+    return;
+  }
+
+  std::weak_ptr<Service *> weak_self = self_;
+  boost::asio::io_service::strand strand = strand_;
+  ReplySmartMessageHandler handler = request_handler_;
+  bool posted = workers_->post([weak_self, strand, handler, identity, header, request]() mutable {
+    handleRequest(weak_self, strand, handler, identity, header, request);
+  });
+  if (!posted) {
+    if (logger_) logger_->warn("{0} worker queue full, rejecting request", log_name_);
+    ServiceHeader busy_header = header;
+    busy_header.status = SERVICE_BUSY;
+    sendReply(identity, busy_header, azmq::message_vector());
+  }
+}
+
+void Service::handleRequest(std::weak_ptr<Service *> weak_self,
+                            boost::asio::io_service::strand strand,
+                            ReplySmartMessageHandler handler, const azmq::message &identity,
+                            const ServiceHeader &header, azmq::message_vector &request) {
+  ReplySender reply_sender = [weak_self, strand, identity,
+                              header](const azmq::message_vector &reply) {
+    postReply(weak_self, strand, identity, header, reply);
+  };
+
+  try {
+    handler(request, reply_sender);
+  } catch (const std::exception &e) {
+    auto logger = spdlog::get("Socket");
+    if (logger) logger->warn("Caught exception in Service onRequest()\n{}", e.what());
+    // let the client fail the request now rather than when it times out
+    ServiceHeader error_header = header;
+    error_header.status = SERVICE_ERROR;
+    postReply(weak_self, strand, identity, error_header, azmq::message_vector());
+  }
+}
+
+void Service::postReply(std::weak_ptr<Service *> weak_self, boost::asio::io_service::strand strand,
+                        const azmq::message &identity, const ServiceHeader &header,
+                        const azmq::message_vector &reply) {
+  // The reply may come from another thread, while the socket is only used on its strand. The
+  // service is only checked on the strand, where it can't be destroyed at the same time.
+  strand.dispatch([weak_self, identity, header, reply]() {
+    auto self = weak_self.lock();
+    if (self) (*self)->sendReply(identity, header, reply);
+  });
+}
+
+void Service::sendReply(const azmq::message &identity, const ServiceHeader &header,
+                        const azmq::message_vector &reply) {
+  azmq::message_vector message;
+  message.reserve(reply.size() + 2);
+  message.push_back(identity);
+  message.push_back(azmq::message(boost::asio::const_buffer(&header, sizeof(header))));
+  message.insert(message.end(), reply.begin(), reply.end());
+
+  boost::system::error_code ec;
+  send(message, ec);
+  if (ec) {
+    if (logger_) logger_->error("{0} reply error: {1}", log_name_, ec.message());
+  }
+}
+
+}  // namespace dispatch
+}  // namespace a17
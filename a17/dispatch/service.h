@@ -0,0 +1,89 @@
+#pragma once
+
+#include <memory>
+#include <set>
+
+#include "a17/utils/worker_pool.h"
+
+#include "handlers.h"
+#include "listener.h"
+#include "server.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Status of a reply, sent in its ServiceHeader.
+enum ServiceStatus : uint32_t {
+  SERVICE_OK = 0,
+  // The request handler threw. The reply has no message.
+  SERVICE_ERROR = 1,
+  // The service's worker pool was full, so the request was not handled. The reply has no message.
+  SERVICE_BUSY = 2,
+};
+
+// First frame of every request to and reply from a Service, ahead of the smart message. Replies
+// carry the id of their request, which lets a client have many requests in flight at once and
+// match replies that arrive in any order.
+struct ServiceHeader {
+  uint64_t request_id;
+  uint32_t status;
+  uint32_t reserved;
+};
+
+// Server side of an asynchronous request/reply service, on a zmq ROUTER socket.
+// Unlike ReplyServer, any number of ServiceClients may send any number of requests at once. The
+// handler is called for each request as it arrives, and may call its ReplySender at any later time
+// and from any thread. The reply is sent on the service's strand, to the client that sent the
+// request. Replies sent after the service is destroyed are dropped.
+// With a worker pool (setWorkerPool()), handlers run on the pool's threads, so that as many
+// requests as the pool has threads are handled at once without blocking the node.
+class Service : public Server, public Listener {
+ public:
+  Service(boost::asio::io_service &ios, Directory &directory, const std::string &topic,
+          const std::set<message_type> &inputTypes, const std::set<message_type> &outputTypes,
+          ReplySmartMessageHandler handler, ErrorHandler error = ErrorHandler(),
+          Address address = Address())
+      : Server(ios, ZMQ_ROUTER, "Service", directory, topic, inputTypes, outputTypes, address),
+        Listener(*this, bind1(&Service::onRequest), error),
+        request_handler_(handler),
+        self_(std::make_shared<Service *>(this)) {}
+
+  Service(boost::asio::io_service &ios, const std::string &address,
+          ReplySmartMessageHandler handler, ErrorHandler error = ErrorHandler())
+      : Server(ios, ZMQ_ROUTER, "Service", address),
+        Listener(*this, bind1(&Service::onRequest), error),
+        request_handler_(handler),
+        self_(std::make_shared<Service *>(this)) {}
+
+  inline void setRequestHandler(ReplySmartMessageHandler handler) { request_handler_ = handler; }
+
+  // Run the handler on the given pool, or on the node's thread if null.
+  inline void setWorkerPool(std::shared_ptr<a17::utils::WorkerPool> workers) {
+    workers_ = workers;
+  }
+  inline const std::shared_ptr<a17::utils::WorkerPool> &workerPool() const { return workers_; }
+
+ protected:
+  void onRequest(azmq::message_vector &message);
+  void sendReply(const azmq::message &identity, const ServiceHeader &header,
+                 const azmq::message_vector &reply);
+  // Calls the handler, replying with SERVICE_ERROR if it throws. The strand is the service's,
+  // copied while it was alive, so that replies never touch a service that is being destroyed.
+  static void handleRequest(std::weak_ptr<Service *> weak_self,
+                            boost::asio::io_service::strand strand,
+                            ReplySmartMessageHandler handler, const azmq::message &identity,
+                            const ServiceHeader &header, azmq::message_vector &request);
+  // Sends a reply from any thread.
+  static void postReply(std::weak_ptr<Service *> weak_self, boost::asio::io_service::strand strand,
+                        const azmq::message &identity, const ServiceHeader &header,
+                        const azmq::message_vector &reply);
+
+ private:
+  ReplySmartMessageHandler request_handler_;
+  std::shared_ptr<a17::utils::WorkerPool> workers_;
+  // Lets ReplySenders detect that the service was destroyed before they were called.
+  std::shared_ptr<Service *> self_;
+};
+
+}  // namespace dispatch
+}  // namespace a17
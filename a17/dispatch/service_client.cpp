@@ -0,0 +1,139 @@
+#include "service_client.h"
+
+#include <cstring>
+
+namespace a17 {
+namespace dispatch {
+
+ServiceClient::~ServiceClient() {
+  // Timeout handlers that are already queued see that the client is gone.
+  self_.reset();
+  std::lock_guard<std::mutex> lock(mutex_);
+  pending_.clear();
+}
+
+boost::system::error_code ServiceClient::request(const azmq::message_vector &message,
+                                                 SmartMessageHandler reply_handler,
+                                                 ErrorHandler error_handler, int timeout_ms) {
+  if (!isConnected()) {
+    if (logger_) logger_->error("{0} not connected", log_name_);
+    return boost::system::errc::make_error_code(boost::system::errc::not_connected);
+  }
+
+  ServiceHeader header{next_request_id_++, SERVICE_OK, 0};
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    PendingRequest &pending = pending_[header.request_id];
+    pending.reply_handler = reply_handler;
+    pending.error_handler = error_handler;
+    if (timeout_ms >= 0) {
+      pending.timer.reset(new boost::asio::steady_timer(ios_));
+      pending.timer->expires_from_now(std::chrono::milliseconds(timeout_ms));
+      std::weak_ptr<Client *> weak_self = self_;
+      uint64_t request_id = header.request_id;
+      pending.timer->async_wait(
+          strand().wrap([weak_self, request_id](const boost::system::error_code &ec) {
+            auto self = weak_self.lock();
+            if (self) static_cast<ServiceClient *>(*self)->onTimeout(request_id, ec);
+          }));
+    }
+  }
+
+  azmq::message_vector request;
+  request.reserve(message.size() + 1);
+  request.push_back(azmq::message(boost::asio::const_buffer(&header, sizeof(header))));
+  request.insert(request.end(), message.begin(), message.end());
+
+  // The socket is only safe to use from the strand, where replies are received.
+  std::weak_ptr<Client *> weak_self = self_;
+  uint64_t request_id = header.request_id;
+  strand().dispatch([weak_self, request_id, request]() {
+    auto self = weak_self.lock();
+    if (self) static_cast<ServiceClient *>(*self)->sendRequest(request_id, request);
+  });
+  return boost::system::error_code();
+}
+
+void ServiceClient::sendRequest(uint64_t request_id, const azmq::message_vector &request) {
+  boost::system::error_code ec;
+  send(request, ec);
+  if (!ec) return;
+
+  if (logger_) logger_->error("{0} unable to send request {1}: {2}", log_name_, request_id,
+                              ec.message());
+  PendingRequest pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = pending_.find(request_id);
+    if (iter == pending_.end()) return;
+    pending = std::move(iter->second);
+    pending_.erase(iter);
+  }
+  if (pending.timer) pending.timer->cancel();
+  if (pending.error_handler) pending.error_handler(ec);
+}
+
+size_t ServiceClient::pending() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return pending_.size();
+}
+
+// A reply is [ServiceHeader][smart message...].
+void ServiceClient::onReply(azmq::message_vector &message) {
+  if (message.empty() || message[0].size() != sizeof(ServiceHeader)) {
+    if (logger_) logger_->warn("{0} dropping malformed reply", log_name_);
+    return;
+  }
+
+  ServiceHeader header;
+  memcpy(&header, message[0].data(), sizeof(header));
+
+  PendingRequest pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = pending_.find(header.request_id);
+    if (iter == pending_.end()) {
+      // Most likely the request already timed out.
+      if (logger_) logger_->debug("{0} dropping reply {1}", log_name_, header.request_id);
+      return;
+    }
+    pending = std::move(iter->second);
+    pending_.erase(iter);
+  }
+  if (pending.timer) pending.timer->cancel();
+
+  if (header.status != SERVICE_OK) {
+    auto error = header.status == SERVICE_BUSY
+                     ? boost::system::errc::resource_unavailable_try_again
+                     : boost::system::errc::io_error;
+    if (pending.error_handler) pending.error_handler(boost::system::errc::make_error_code(error));
+    return;
+  }
+
+  azmq::message_vector reply(message.begin() + 1, message.end());
+  pending.reply_handler(reply);
+}
+
+void ServiceClient::onTimeout(uint64_t request_id, const boost::system::error_code &ec) {
+  if (ec == boost::asio::error::operation_aborted) {
+    return;
+  }
+
+  PendingRequest pending;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto iter = pending_.find(request_id);
+    if (iter == pending_.end()) return;
+    pending = std::move(iter->second);
+    pending_.erase(iter);
+  }
+
+  if (logger_) logger_->warn("{0} request {1} timed out", log_name_, request_id);
+  if (pending.error_handler) {
+    pending.error_handler(boost::system::errc::make_error_code(boost::system::errc::timed_out));
+  }
+}
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+#include <boost/asio/steady_timer.hpp>
+
+#include "client.h"
+#include "listener.h"
+#include "service.h"
+#include "smart_capnp_reader.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Client side of a Service, on a zmq DEALER socket.
+// Any number of requests may be in flight at once. Each is tagged with a request id, and its reply
+// handler is called when the reply with that id arrives, in whatever order replies arrive. If
+// several servers advertise the topic, requests are spread across them.
+// The error handler of a request is called instead of its reply handler if the request times out
+// (timed_out), if the server's handler threw (io_error), or if the server's worker pool was full
+// (resource_unavailable_try_again).
+// Handlers run on the client's strand. request() may be called from any thread: the request is
+// sent from the strand, and if sending fails the error handler is called there with the error.
+class ServiceClient : public Client, public Listener {
+ public:
+  ServiceClient(boost::asio::io_service &ios, Directory &directory, const std::string &topic,
+                ConnectionHandler connectHandler = ConnectionHandler(),
+                ConnectionHandler disconnectHandler = ConnectionHandler())
+      : Client(ios, ZMQ_DEALER, "ServiceClient", directory, topic, connectHandler,
+               disconnectHandler),
+        Listener(*this, bind1(&ServiceClient::onReply), ErrorHandler()),
+        ios_(ios) {}
+
+  ServiceClient(boost::asio::io_service &ios, const std::string &address)
+      : Client(ios, ZMQ_DEALER, "ServiceClient", address),
+        Listener(*this, bind1(&ServiceClient::onReply), ErrorHandler()),
+        ios_(ios) {}
+
+  ~ServiceClient();
+
+  // Sends a request. The reply handler is called with the reply's smart message.
+  // Returns not_connected if the client isn't connected. Other send errors go to the error handler.
+  // @param timeout_ms time to wait for the reply, or no limit if negative
+  boost::system::error_code request(const azmq::message_vector &message,
+                                    SmartMessageHandler reply_handler,
+                                    ErrorHandler error_handler = ErrorHandler(),
+                                    int timeout_ms = -1);
+
+  // Sends a capnp request, and reads the reply as ReplyT. If the reply can't be read as ReplyT, the
+  // error handler is called with bad_message.
+  template <typename ReplyT>
+  boost::system::error_code request(const SmartCapnpBuilder &builder,
+                                    CapnpMessageHandler<typename ReplyT::Reader> reply_handler,
+                                    ErrorHandler error_handler = ErrorHandler(),
+                                    int timeout_ms = -1) {
+    auto logger = logger_;
+    auto zmq_reply_handler = [reply_handler, error_handler, logger](azmq::message_vector &reply) {
+      try {
+        auto reader = a17::dispatch::SmartCapnpReader(reply);
+        reply_handler(reader.getRoot<ReplyT>());
+      } catch (const std::exception &e) {
+        if (logger) logger->warn("Unable to read service reply: {}", e.what());
+        if (error_handler) {
+          error_handler(boost::system::errc::make_error_code(boost::system::errc::bad_message));
+        }
+      }
+    };
+    return request(builder.getSmartMessage(), zmq_reply_handler, error_handler, timeout_ms);
+  }
+
+  // Number of requests waiting for a reply.
+  size_t pending();
+
+ private:
+  struct PendingRequest {
+    SmartMessageHandler reply_handler;
+    ErrorHandler error_handler;
+    std::unique_ptr<boost::asio::steady_timer> timer;
+  };
+
+  void sendRequest(uint64_t request_id, const azmq::message_vector &request);
+  void onReply(azmq::message_vector &message);
+  void onTimeout(uint64_t request_id, const boost::system::error_code &ec);
+
+  boost::asio::io_service &ios_;
+  std::atomic<uint64_t> next_request_id_{1};
+  std::mutex mutex_;
+  std::unordered_map<uint64_t, PendingRequest> pending_;
+};
+
+}  // namespace dispatch
+}  // namespace a17
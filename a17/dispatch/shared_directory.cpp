@@ -0,0 +1,149 @@
+#include "shared_directory.h"
+
+#include <stdexcept>
+
+namespace a17 {
+namespace dispatch {
+
+namespace {
+
+std::mutex instance_mutex;
+std::weak_ptr<SharedDirectory> shared_instance;
+
+}  // namespace
+
+std::shared_ptr<SharedDirectory> SharedDirectory::instance(uint16_t port,
+                                                           const std::string &multicastAddress) {
+  std::lock_guard<std::mutex> lock(instance_mutex);
+  auto shared = shared_instance.lock();
+  if (!shared) {
+    shared.reset(new SharedDirectory(port, multicastAddress));
+    shared_instance = shared;
+  }
+  return shared;
+}
+
+SharedDirectory::SharedDirectory(uint16_t port, const std::string &multicastAddress)
+    : work_(new boost::asio::io_service::work(ios_)),
+      directory_(new Directory(ios_, "SharedDirectory", port, multicastAddress)),
+      thread_([this]() { ios_.run(); }) {}
+
+SharedDirectory::~SharedDirectory() {
+  work_.reset();
+  ios_.stop();
+  thread_.join();
+  // Sends the directory's exit. The handlers it leaves on the io_service are never called.
+  directory_.reset();
+}
+
+DirectoryView::DirectoryView(boost::asio::io_service &ios, const std::string &name,
+                             std::shared_ptr<SharedDirectory> shared)
+    : Directory(ios, name, NoSocket()), node_ios_(ios), shared_(std::move(shared)) {
+  if (!shared_) {
+    throw std::invalid_argument("DirectoryView needs a shared directory");
+  }
+  host(guid());
+}
+
+DirectoryView::~DirectoryView() {
+  std::unordered_map<std::string, Observation> observations;
+  {
+    std::lock_guard<std::mutex> lock(view_mutex_);
+    observations.swap(observations_);
+  }
+  std::string my_guid = guid();
+  call([&](Directory &directory) {
+    for (const auto &observation : observations) {
+      *observation.second.active = false;
+      directory.unobserve(observation.second.topic_name, observation.first);
+    }
+    // Removes the topics of the view, and tells other nodes that it exited.
+    directory.unhost(my_guid);
+  });
+}
+
+DirectoryTopicStore DirectoryView::topics() const {
+  return call([](Directory &directory) { return directory.topics(); });
+}
+
+bool DirectoryView::add(const std::string &topic_name, int socketType, const std::string &address,
+                        const std::set<message_type> &inputTypes,
+                        const std::set<message_type> &outputTypes, const std::string &guid) {
+  return call([&](Directory &directory) {
+    return directory.add(topic_name, socketType, address, inputTypes, outputTypes, guid);
+  });
+}
+
+void DirectoryView::remove(const std::string &topic_name) { remove(topic_name, guid()); }
+
+void DirectoryView::remove(const std::string &topic_name, const std::string &guid) {
+  call([&](Directory &directory) { directory.remove(topic_name, guid); });
+}
+
+std::string DirectoryView::observe(const std::string &topic_name,
+                                   DirectoryTopicEventHandler handler) {
+  auto active = std::make_shared<std::atomic<bool>>(true);
+  boost::asio::io_service *ios = &node_ios_;
+  // The shared directory calls observers on its own thread, with its lock held.
+  auto observer = [ios, active, handler](const std::string &topic_name,
+                                         const GuidTopicMap &guid_topic_map) {
+    if (!*active) return;
+    ios->post([active, handler, topic_name, guid_topic_map]() {
+      if (*active) handler(topic_name, guid_topic_map);
+    });
+  };
+  std::string ref =
+      call([&](Directory &directory) { return directory.observe(topic_name, observer); });
+
+  std::lock_guard<std::mutex> lock(view_mutex_);
+  observations_[ref] = Observation{topic_name, active};
+  return ref;
+}
+
+void DirectoryView::unobserve(const std::string &topic_name, const std::string &ref) {
+  {
+    std::lock_guard<std::mutex> lock(view_mutex_);
+    auto iter = observations_.find(ref);
+    if (iter != observations_.end()) {
+      *iter->second.active = false;
+      observations_.erase(iter);
+    }
+  }
+  call([&](Directory &directory) { directory.unobserve(topic_name, ref); });
+}
+
+void DirectoryView::host(const std::string &guid) {
+  call([&](Directory &directory) { directory.host(guid); });
+}
+
+void DirectoryView::unhost(const std::string &guid) {
+  call([&](Directory &directory) { directory.unhost(guid); });
+}
+
+DiscoveryProtocol DirectoryView::discoveryProtocol() const {
+  return call([](Directory &directory) { return directory.discoveryProtocol(); });
+}
+
+void DirectoryView::setDiscoveryProtocol(DiscoveryProtocol protocol) {
+  call([&](Directory &directory) { directory.setDiscoveryProtocol(protocol); });
+}
+
+std::chrono::milliseconds DirectoryView::heartbeatInterval() const {
+  return call([](Directory &directory) { return directory.heartbeatInterval(); });
+}
+
+std::chrono::milliseconds DirectoryView::lease() const {
+  return call([](Directory &directory) { return directory.lease(); });
+}
+
+void DirectoryView::setHeartbeat(std::chrono::milliseconds interval,
+                                 std::chrono::milliseconds lease) {
+  call([&](Directory &directory) { directory.setHeartbeat(interval, lease); });
+}
+
+size_t DirectoryView::loadManifest(std::istream &manifest, std::chrono::milliseconds lease) {
+  return call([&](Directory &directory) { return directory.loadManifest(manifest, lease); });
+}
+
+}  // namespace dispatch
+}  // namespace a17
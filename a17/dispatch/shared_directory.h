@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+
+#include "directory.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Set DISPATCH_SHARED_DIRECTORY=1 for the Nodes of a process to share one directory.
+const bool DEFAULT_SHARED_DIRECTORY = std::getenv("DISPATCH_SHARED_DIRECTORY") &&
+                                      std::string(std::getenv("DISPATCH_SHARED_DIRECTORY")) != "0";
+
+// The directory of a process, which its Nodes share through DirectoryViews. It runs on a thread of
+// its own, so that one multicast socket and one topic store serve every Node, whichever
+// io_service they run on. The directory is only used from that thread: views post their calls to
+// ios().
+class SharedDirectory {
+ public:
+  // Returns the shared directory, which is created by the first caller, with its port and
+  // multicast address, and destroyed once no one holds it any more.
+  static std::shared_ptr<SharedDirectory> instance(
+      uint16_t port = DEFAULT_DIRECTORY_PORT,
+      const std::string &multicastAddress = DEFAULT_DIRECTORY_MULTICAST);
+
+  ~SharedDirectory();
+  SharedDirectory(const SharedDirectory &) = delete;
+  SharedDirectory(SharedDirectory &&) = delete;
+
+  inline Directory &directory() { return *directory_; }
+  inline boost::asio::io_service &ios() { return ios_; }
+
+ private:
+  SharedDirectory(uint16_t port, const std::string &multicastAddress);
+
+  boost::asio::io_service ios_;
+  std::unique_ptr<boost::asio::io_service::work> work_;
+  std::unique_ptr<Directory> directory_;
+  std::thread thread_;
+};
+
+// A Node's view of the shared directory. It has a guid of its own, which the shared directory
+// hosts, so that the Node appears on the network as it would with a directory of its own. Topics
+// and observers go to the shared directory, and observers are called on the view's io_service.
+// The view holds the shared directory, and removes its topics and observers when it's destroyed.
+//
+// Every call that the view forwards runs on the shared directory's thread, and the caller waits
+// for it. That includes the settings of the shared directory, such as its discovery protocol and
+// heartbeat, which are those of every view. Intra-process delivery stays within the view, between
+// the sockets of its own Node.
+class DirectoryView : public Directory {
+ public:
+  DirectoryView(boost::asio::io_service &ios, const std::string &name,
+                std::shared_ptr<SharedDirectory> shared = SharedDirectory::instance());
+  ~DirectoryView() override;
+
+  // A copy of the shared store, taken on the shared directory's thread.
+  DirectoryTopicStore topics() const override;
+  bool add(const std::string &topic_name, int socketType, const std::string &address,
+           const std::set<message_type> &inputTypes, const std::set<message_type> &outputTypes,
+           const std::string &guid) override;
+  void remove(const std::string &topic_name) override;
+  std::string observe(const std::string &topic_name, DirectoryTopicEventHandler handler) override;
+  void unobserve(const std::string &topic_name, const std::string &ref) override;
+
+  void host(const std::string &guid) override;
+  void unhost(const std::string &guid) override;
+  void remove(const std::string &topic_name, const std::string &guid) override;
+  DiscoveryProtocol discoveryProtocol() const override;
+  void setDiscoveryProtocol(DiscoveryProtocol protocol) override;
+  std::chrono::milliseconds heartbeatInterval() const override;
+  std::chrono::milliseconds lease() const override;
+  void setHeartbeat(std::chrono::milliseconds interval, std::chrono::milliseconds lease) override;
+  size_t loadManifest(std::istream &manifest,
+                      std::chrono::milliseconds lease =
+                          std::chrono::milliseconds(DEFAULT_MANIFEST_LEASE_MS)) override;
+
+ private:
+  struct Observation {
+    std::string topic_name;
+    // Cleared on unobserve, since calls to the observer may already be posted.
+    std::shared_ptr<std::atomic<bool>> active;
+  };
+
+  // Runs fn on the shared directory's thread and returns its result, or throws what it threw.
+  template <typename Fn>
+  auto call(Fn fn) const -> decltype(fn(std::declval<Directory &>())) {
+    Directory &directory = shared_->directory();
+    std::packaged_task<decltype(fn(directory))()> task([&]() { return fn(directory); });
+    auto result = task.get_future();
+    // Runs at once if this is the shared directory's thread.
+    shared_->ios().dispatch([&task]() { task(); });
+    return result.get();
+  }
+
+  boost::asio::io_service &node_ios_;
+  std::shared_ptr<SharedDirectory> shared_;
+  std::mutex view_mutex_;
+  // Observers by ref, to remove when the view goes.
+  std::unordered_map<std::string, Observation> observations_;
+};
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,47 @@
+#include "shm_publisher.h"
+
+#include "message_helpers.h"
+
+namespace a17 {
+namespace dispatch {
+
+ShmPublisher::ShmPublisher(boost::asio::io_service &ios, Directory &directory,
+                           const std::string &topic, const std::set<message_type> &outputTypes,
+                           size_t slotSize, uint32_t slotCount, Address address)
+    : Publisher(ios, directory, topic, outputTypes, address, SHM_PROTOCOL),
+      ring_(ShmRing::create(ShmSegmentName(Address::parse(address_).port()), slotSize,
+                            slotCount)),
+      notifier_(ios, ZMQ_PUB, "ShmNotifier", ShmNotifyEndpoint(Address::parse(address_).port())) {
+  log_name_ = "ShmPublisher [" + topic + "]";
+}
+
+size_t ShmPublisher::publish(const azmq::message_vector &message,
+                             boost::system::error_code &ec) {
+  boost::system::error_code notify_ec;
+  // Segmented messages don't fit in a single slot, so they go through the notifier socket whole.
+  bool segmented = flagsFromSmartMessage(message) & SMART_MESSAGE_SEGMENTED;
+  if (message.size() >= 2 && !segmented && message[1].size() <= ring_->slotSize()) {
+    ShmDescriptor descriptor = ring_->write(message[1].data(), message[1].size());
+
+    azmq::message_vector notification;
+    notification.reserve(message.size());
+    notification.push_back(message[0]);
+    notification.push_back(
+        azmq::message(boost::asio::const_buffer(&descriptor, sizeof(descriptor))));
+    for (size_t i = 2; i < message.size(); i++) {
+      notification.push_back(message[i]);
+    }
+    notifier_.send(notification, notify_ec);
+  } else {
+    notifier_.send(message, notify_ec);
+  }
+
+  if (notify_ec && logger_) {
+    logger_->debug("{0} notification error: {1}", log_name_, notify_ec.message());
+  }
+
+  return Publisher::publish(message, ec);
+}
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "publisher.h"
+#include "shm_ring.h"
+
+namespace a17 {
+namespace dispatch {
+
+// Publisher that hands message payloads to subscribers on the same host through a shared memory
+// ring instead of tcp loopback.
+//
+// The publisher binds a tcp socket like any other and advertises it as shm://ip:port. Subscribers
+// on another host connect to tcp://ip:port and receive full messages. Subscribers on the same host
+// connect to an ipc notification socket instead, and receive a small ShmDescriptor in place of the
+// capnp frame, which Subscriber replaces with a copy of the payload (see ShmResolvingHandler).
+// Messages larger than the slot size are sent whole over the notification socket.
+class ShmPublisher : public Publisher {
+ public:
+  ShmPublisher(boost::asio::io_service &ios, Directory &directory, const std::string &topic,
+               const std::set<message_type> &outputTypes,
+               size_t slotSize = DEFAULT_SHM_SLOT_SIZE,
+               uint32_t slotCount = DEFAULT_SHM_SLOT_COUNT, Address address = Address());
+
+  inline const ShmRing &ring() const { return *ring_; }
+
+ protected:
+  size_t publish(const azmq::message_vector &message, boost::system::error_code &ec) override;
+
+ private:
+  std::unique_ptr<ShmRing> ring_;
+  Server notifier_;
+};
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,256 @@
+#include "shm_ring.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <random>
+#include <stdexcept>
+
+#include "address.h"
+
+namespace a17 {
+namespace dispatch {
+
+namespace {
+
+const uint64_t SHM_MAGIC = 0xd15a7c4005e6ffffULL;
+const size_t SHM_ALIGNMENT = 64;
+
+std::atomic<uint64_t> shm_overrun_count{0};
+
+size_t AlignUp(size_t size, size_t alignment) {
+  return (size + alignment - 1) / alignment * alignment;
+}
+
+uint64_t RandomInstance() {
+  std::random_device random;
+  return (static_cast<uint64_t>(random()) << 32) | random();
+}
+
+void FreePayload(void *data, void *) { free(data); }
+
+}  // namespace
+
+ShmRing::ShmRing(const std::string &name, void *memory, size_t size, bool owner)
+    : name_(name),
+      memory_(memory),
+      size_(size),
+      owner_(owner),
+      header_(static_cast<Header *>(memory)) {}
+
+ShmRing::~ShmRing() {
+  munmap(memory_, size_);
+  if (owner_) shm_unlink(name_.c_str());
+}
+
+std::unique_ptr<ShmRing> ShmRing::create(const std::string &name, size_t slot_size,
+                                         uint32_t slot_count) {
+  if (name.size() >= sizeof(ShmDescriptor::segment)) {
+    throw std::runtime_error("Shared memory segment name too long: " + name);
+  }
+
+  // Unlink any segment left behind by a crashed publisher rather than truncating it, since
+  // subscribers may still have it mapped.
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+  if (fd < 0) {
+    throw std::runtime_error("Could not create shared memory segment " + name + ": " +
+                             strerror(errno));
+  }
+
+  size_t size = headerSize() + slotStride(slot_size) * slot_count;
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    shm_unlink(name.c_str());
+    throw std::runtime_error("Could not size shared memory segment " + name + ": " +
+                             strerror(errno));
+  }
+
+  void *memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    shm_unlink(name.c_str());
+    throw std::runtime_error("Could not map shared memory segment " + name + ": " +
+                             strerror(errno));
+  }
+
+  // ftruncate zero-fills the segment, so every slot starts with an invalid sequence of 0.
+  auto ring = std::unique_ptr<ShmRing>(new ShmRing(name, memory, size, true));
+  ring->header_->instance = RandomInstance();
+  ring->header_->slot_size = slot_size;
+  ring->header_->slot_count = slot_count;
+  ring->header_->next_sequence.store(1);
+  std::atomic_thread_fence(std::memory_order_release);
+  ring->header_->magic = SHM_MAGIC;
+  return ring;
+}
+
+std::unique_ptr<ShmRing> ShmRing::open(const std::string &name) {
+  int fd = shm_open(name.c_str(), O_RDONLY, 0);
+  if (fd < 0) {
+    throw std::runtime_error("Could not open shared memory segment " + name + ": " +
+                             strerror(errno));
+  }
+
+  struct stat info;
+  if (fstat(fd, &info) < 0 || static_cast<size_t>(info.st_size) < headerSize()) {
+    close(fd);
+    throw std::runtime_error("Invalid shared memory segment " + name);
+  }
+
+  size_t size = info.st_size;
+  void *memory = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (memory == MAP_FAILED) {
+    throw std::runtime_error("Could not map shared memory segment " + name + ": " +
+                             strerror(errno));
+  }
+
+  auto ring = std::unique_ptr<ShmRing>(new ShmRing(name, memory, size, false));
+  if (ring->header_->magic != SHM_MAGIC ||
+      headerSize() + slotStride(ring->slotSize()) * ring->slotCount() > size) {
+    throw std::runtime_error("Invalid shared memory segment " + name);
+  }
+  return ring;
+}
+
+ShmDescriptor ShmRing::write(const void *data, size_t size) {
+  if (size > slotSize()) {
+    throw std::runtime_error("Message of " + std::to_string(size) +
+                             " bytes doesn't fit in shared memory slot of " +
+                             std::to_string(slotSize()) + " bytes");
+  }
+
+  uint64_t sequence = header_->next_sequence.fetch_add(1);
+  uint32_t index = sequence % slotCount();
+  SlotHeader *slot_header = slot(index);
+
+  // Invalidate the slot while it is being written, so that readers of the previous message in this
+  // slot see that it is gone.
+  slot_header->sequence.store(0, std::memory_order_release);
+  std::atomic_thread_fence(std::memory_order_release);
+  memcpy(slot_header + 1, data, size);
+  slot_header->size = size;
+  slot_header->sequence.store(sequence, std::memory_order_release);
+
+  ShmDescriptor descriptor;
+  memset(&descriptor, 0, sizeof(descriptor));
+  descriptor.magic = SHM_MAGIC;
+  descriptor.instance = instance();
+  descriptor.sequence = sequence;
+  descriptor.size = size;
+  descriptor.slot = index;
+  strncpy(descriptor.segment, name_.c_str(), sizeof(descriptor.segment) - 1);
+  return descriptor;
+}
+
+const void *ShmRing::read(const ShmDescriptor &descriptor) const {
+  if (descriptor.instance != instance() || descriptor.slot >= slotCount() ||
+      descriptor.size > slotSize()) {
+    return nullptr;
+  }
+  SlotHeader *slot_header = slot(descriptor.slot);
+  if (slot_header->sequence.load(std::memory_order_acquire) != descriptor.sequence) {
+    return nullptr;
+  }
+  return slot_header + 1;
+}
+
+bool ShmRing::validate(const ShmDescriptor &descriptor) const {
+  // Orders the reads of the payload before the sequence is loaded again.
+  std::atomic_thread_fence(std::memory_order_acquire);
+  return slot(descriptor.slot)->sequence.load(std::memory_order_relaxed) == descriptor.sequence;
+}
+
+bool ShmRing::copy(const ShmDescriptor &descriptor, void *data) const {
+  const void *payload = read(descriptor);
+  if (!payload) return false;
+  memcpy(data, payload, descriptor.size);
+  return validate(descriptor);
+}
+
+bool ShmRing::isDescriptor(const azmq::message &message) {
+  if (message.size() != sizeof(ShmDescriptor)) return false;
+  uint64_t magic;
+  memcpy(&magic, message.data(), sizeof(magic));
+  return magic == SHM_MAGIC;
+}
+
+ShmRing::SlotHeader *ShmRing::slot(uint32_t index) const {
+  auto base = static_cast<uint8_t *>(memory_) + headerSize();
+  return reinterpret_cast<SlotHeader *>(base + slotStride(slotSize()) * index);
+}
+
+size_t ShmRing::slotStride(size_t slot_size) {
+  return AlignUp(sizeof(SlotHeader) + slot_size, SHM_ALIGNMENT);
+}
+
+size_t ShmRing::headerSize() { return AlignUp(sizeof(Header), SHM_ALIGNMENT); }
+
+std::string ShmConnectEndpoint(const std::string &address) {
+  Address parts = Address::parse(address);
+  if (parts.protocol() != SHM_PROTOCOL) return address;
+  if (parts.ip() == OwnAddress::instance().address()) return ShmNotifyEndpoint(parts.port());
+  return Address("tcp", parts.ip(), parts.port()).address();
+}
+
+std::string ShmSegmentName(uint16_t port) { return "/dispatch_shm_" + std::to_string(port); }
+
+std::string ShmNotifyEndpoint(uint16_t port) {
+  return "ipc:///tmp/dispatch_shm_" + std::to_string(port);
+}
+
+SmartMessageHandler ShmResolvingHandler(SmartMessageHandler handler) {
+  auto rings = std::make_shared<std::map<std::string, std::unique_ptr<ShmRing>>>();
+  return [handler, rings](azmq::message_vector &message) {
+    if (message.size() < 2 || !ShmRing::isDescriptor(message[1])) {
+      handler(message);
+      return;
+    }
+
+    ShmDescriptor descriptor;
+    memcpy(&descriptor, message[1].data(), sizeof(descriptor));
+    std::string segment(descriptor.segment,
+                        strnlen(descriptor.segment, sizeof(descriptor.segment)));
+
+    // Re-open the segment if the publisher restarted and replaced it.
+    auto &ring = (*rings)[segment];
+    if (!ring || ring->instance() != descriptor.instance) {
+      ring.reset();
+      try {
+        ring = ShmRing::open(segment);
+      } catch (const std::exception &e) {
+        auto logger = spdlog::get("Socket");
+        if (logger) logger->warn("Dropping shared memory message: {}", e.what());
+        rings->erase(segment);
+        return;
+      }
+    }
+
+    // malloc() aligns the copy for capnp to read it in place.
+    void *data = malloc(std::max<size_t>(descriptor.size, 1));
+    if (!data) {
+      throw std::runtime_error("malloc failed");
+    }
+    if (!ring->copy(descriptor, data)) {
+      free(data);
+      shm_overrun_count++;
+      return;
+    }
+
+    azmq::nocopy_t nocopy;
+    message[1] = azmq::message(nocopy, boost::asio::mutable_buffer(data, descriptor.size), nullptr,
+                               FreePayload);
+    handler(message);
+  };
+}
+
+uint64_t ShmOverrunCount() { return shm_overrun_count.load(); }
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <string>
+
+#include "defs.h"
+#include "handlers.h"
+
+namespace a17 {
+namespace dispatch {
+
+const size_t DEFAULT_SHM_SLOT_SIZE = 4 * 1024 * 1024;
+const uint32_t DEFAULT_SHM_SLOT_COUNT = 8;
+const std::string SHM_PROTOCOL = "shm";
+
+/// Points a subscriber at a message payload written into a ShmRing. Sent over zmq in place of the
+/// capnp frame of a smart message.
+struct ShmDescriptor {
+  uint64_t magic;
+  uint64_t instance;
+  uint64_t sequence;
+  uint64_t size;
+  uint32_t slot;
+  char segment[44];
+};
+
+/**
+ * Single-producer ring of fixed-size slots in a named POSIX shared memory segment.
+ *
+ * The publisher writes each message payload once into the next slot, and subscribers on the same
+ * host map the segment read-only. Every slot carries the sequence number of the message it holds,
+ * which the writer clears while it writes the slot, so a reader can detect when the writer has
+ * lapped it. Like a seqlock, a reader checks the sequence before and after reading a payload, and
+ * drops what it read if the sequence changed in between (see copy()).
+ */
+class ShmRing {
+ public:
+  /// Creates (or replaces) the segment. The segment is unlinked when the ring is destroyed.
+  /// @throws std::runtime_error if the segment can't be created.
+  static std::unique_ptr<ShmRing> create(const std::string &name, size_t slot_size,
+                                         uint32_t slot_count);
+  /// Maps an existing segment read-only.
+  /// @throws std::runtime_error if the segment can't be opened.
+  static std::unique_ptr<ShmRing> open(const std::string &name);
+
+  ~ShmRing();
+  ShmRing(const ShmRing &) = delete;
+  ShmRing &operator=(const ShmRing &) = delete;
+
+  inline const std::string &name() const { return name_; }
+  inline uint64_t instance() const { return header_->instance; }
+  inline size_t slotSize() const { return header_->slot_size; }
+  inline uint32_t slotCount() const { return header_->slot_count; }
+
+  /// Copies the payload into the next slot. size must not exceed slotSize().
+  ShmDescriptor write(const void *data, size_t size);
+  /// Returns the payload for a descriptor, or nullptr if its slot has since been overwritten. The
+  /// writer may overwrite the payload while it is read, so check validate() after reading it.
+  const void *read(const ShmDescriptor &descriptor) const;
+  /// Whether the slot of a descriptor still holds its message.
+  bool validate(const ShmDescriptor &descriptor) const;
+  /// Copies the payload for a descriptor into data, which must hold descriptor.size bytes. Returns
+  /// false if the slot was overwritten before or while it was copied, leaving data undefined.
+  bool copy(const ShmDescriptor &descriptor, void *data) const;
+
+  /// Whether a zmq frame holds a ShmDescriptor.
+  static bool isDescriptor(const azmq::message &message);
+
+ private:
+  struct Header {
+    uint64_t magic;
+    uint64_t instance;
+    uint64_t slot_size;
+    uint32_t slot_count;
+    std::atomic<uint64_t> next_sequence;
+  };
+
+  struct SlotHeader {
+    std::atomic<uint64_t> sequence;
+    uint64_t size;
+  };
+
+  ShmRing(const std::string &name, void *memory, size_t size, bool owner);
+
+  SlotHeader *slot(uint32_t index) const;
+  static size_t slotStride(size_t slot_size);
+  static size_t headerSize();
+
+  std::string name_;
+  void *memory_;
+  size_t size_;
+  bool owner_;
+  Header *header_;
+};
+
+/// Returns the address subscribers should connect to for an advertised address. For a shm://
+/// address, that is the notification endpoint if the publisher is on this host, and its tcp socket
+/// otherwise. Other addresses are returned unchanged.
+std::string ShmConnectEndpoint(const std::string &address);
+
+/// Name of the segment and notification endpoint of a shm publisher bound to the given tcp port.
+std::string ShmSegmentName(uint16_t port);
+std::string ShmNotifyEndpoint(uint16_t port);
+
+/// Wraps a subscriber handler so that messages carrying a ShmDescriptor are passed on with the
+/// payload copied out of the shared memory segment, so that the writer can't change it while the
+/// handler runs. Messages whose slot was overwritten before they were copied are dropped and
+/// counted in ShmOverrunCount().
+SmartMessageHandler ShmResolvingHandler(SmartMessageHandler handler);
+uint64_t ShmOverrunCount();
+
+}  // namespace dispatch
+}  // namespace a17
@@ -0,0 +1,107 @@
+#include "catch.hpp"
+
+#include "a17/capnp_msgs/test.capnp.h"
+
+#include "address.h"
+#include "shm_ring.h"
+#include "smart_capnp_builder.h"
+#include "smart_capnp_reader.h"
+
+namespace a17 {
+namespace dispatch {
+namespace test {
+
+const std::string TEST_SEGMENT = "/dispatch_shm_ring_test";
+
+TEST_CASE("Write and read", "[shm]") {
+  auto writer = a17::dispatch::ShmRing::create(TEST_SEGMENT, 64, 2);
+  auto reader = a17::dispatch::ShmRing::open(TEST_SEGMENT);
+  REQUIRE(reader->instance() == writer->instance());
+  REQUIRE(reader->slotSize() == 64);
+  REQUIRE(reader->slotCount() == 2);
+
+  uint64_t value = 17;
+  auto descriptor = writer->write(&value, sizeof(value));
+  REQUIRE(descriptor.size == sizeof(value));
+  const void *data = reader->read(descriptor);
+  REQUIRE(data != nullptr);
+  REQUIRE(*static_cast<const uint64_t *>(data) == 17);
+  // Payloads are read in place, so they must be word-aligned for capnp.
+  REQUIRE(reinterpret_cast<uintptr_t>(data) % sizeof(uint64_t) == 0);
+
+  SECTION("Overrun") {
+    writer->write(&value, sizeof(value));
+    REQUIRE(reader->read(descriptor) != nullptr);
+    writer->write(&value, sizeof(value));
+    REQUIRE(reader->read(descriptor) == nullptr);
+  }
+
+  SECTION("Overwritten while read") {
+    uint64_t copy = 0;
+    REQUIRE(reader->copy(descriptor, &copy));
+    REQUIRE(copy == 17);
+    const void *payload = reader->read(descriptor);
+    REQUIRE(payload != nullptr);
+    REQUIRE(reader->validate(descriptor));
+    writer->write(&value, sizeof(value));
+    writer->write(&value, sizeof(value));
+    REQUIRE(!reader->validate(descriptor));
+    REQUIRE(!reader->copy(descriptor, &copy));
+  }
+
+  SECTION("Too large") {
+    uint8_t large[65] = {0};
+    REQUIRE_THROWS(writer->write(large, sizeof(large)));
+  }
+}
+
+TEST_CASE("Connect endpoint", "[shm]") {
+  auto own_ip = a17::dispatch::OwnAddress::instance().address();
+  REQUIRE(a17::dispatch::ShmConnectEndpoint("tcp://" + own_ip + ":4000") ==
+          "tcp://" + own_ip + ":4000");
+  REQUIRE(a17::dispatch::ShmConnectEndpoint("shm://" + own_ip + ":4000") ==
+          a17::dispatch::ShmNotifyEndpoint(4000));
+  REQUIRE(a17::dispatch::ShmConnectEndpoint("shm://10.255.255.1:4000") ==
+          "tcp://10.255.255.1:4000");
+}
+
+TEST_CASE("Resolving handler", "[shm]") {
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::SmartCapnpBuilder builder(pool);
+  builder.initRoot<a17::capnp_msgs::test::DispatchTest>().setTopic("QUEUE");
+  azmq::message_vector message = builder.getSmartMessage();
+
+  auto ring = a17::dispatch::ShmRing::create(TEST_SEGMENT, 1024, 2);
+  auto descriptor = ring->write(message[1].data(), message[1].size());
+  azmq::message_vector notification{
+      message[0], azmq::message(boost::asio::const_buffer(&descriptor, sizeof(descriptor)))};
+  REQUIRE(a17::dispatch::ShmRing::isDescriptor(notification[1]));
+  REQUIRE(!a17::dispatch::ShmRing::isDescriptor(message[1]));
+
+  int received = 0;
+  auto handler = a17::dispatch::ShmResolvingHandler([&](azmq::message_vector &msg_vec) {
+    received++;
+    a17::dispatch::SmartCapnpReader reader(msg_vec);
+    REQUIRE(!reader.copied());
+    REQUIRE(!strcmp(reader.getRoot<a17::capnp_msgs::test::DispatchTest>().getTopic().cStr(),
+                    "QUEUE"));
+  });
+
+  handler(message);
+  handler(notification);
+  REQUIRE(received == 2);
+
+  // Once the slot is reused, the notification is dropped.
+  auto overruns = a17::dispatch::ShmOverrunCount();
+  ring->write(message[1].data(), message[1].size());
+  ring->write(message[1].data(), message[1].size());
+  azmq::message_vector stale{
+      message[0], azmq::message(boost::asio::const_buffer(&descriptor, sizeof(descriptor)))};
+  handler(stale);
+  REQUIRE(received == 2);
+  REQUIRE(a17::dispatch::ShmOverrunCount() == overruns + 1);
+}
+
+}  // namespace test
+}  // namespace dispatch
+}  // namespace a17
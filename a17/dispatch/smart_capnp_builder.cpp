@@ -1,38 +1,135 @@
 #include "smart_capnp_builder.h"
 
+#include <map>
+#include <utility>
+
 namespace a17 {
 namespace dispatch {
 
-SmartCapnpBuilder::SmartCapnpBuilder(a17::utils::BufferPool &pool)
-    : next_size_(pool.bufferSize() / sizeof(capnp::word)),
+namespace {
+
+void FreeAttachment(void *data, void *hint) {
+  auto deleter = static_cast<SmartCapnpBuilder::BufferDeleter *>(hint);
+  if (*deleter) (*deleter)(data);
+  delete deleter;
+}
+
+// The single-class pool over a BufferPool, which is kept for the life of the process since zmq may
+// free the frames of a message long after its builder is gone.
+a17::utils::SizeClassPool &SingleClassPool(a17::utils::BufferPool &buffers) {
+  static std::mutex mutex;
+  static std::map<std::pair<a17::utils::BufferPool *, size_t>,
+                  std::unique_ptr<a17::utils::SizeClassPool>>
+      pools;
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &pool = pools[std::make_pair(&buffers, buffers.bufferSize())];
+  if (!pool) pool.reset(new a17::utils::SizeClassPool(buffers));
+  return *pool;
+}
+
+}  // namespace
+
+SmartCapnpBuilderCache::SmartCapnpBuilderCache(a17::utils::SizeClassPool &pool,
+                                               size_t max_segments)
+    : pool_(&pool), max_segments_(max_segments) {}
+
+SmartCapnpBuilderCache::~SmartCapnpBuilderCache() {
+  for (auto &segment : segments_) {
+    pool_->free(segment.words);
+  }
+}
+
+size_t SmartCapnpBuilderCache::size() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return segments_.size();
+}
+
+capnp::word *SmartCapnpBuilderCache::take(uint min_size, uint &size) {
+  std::lock_guard<std::mutex> lock(mutex_);
+
+  // the smallest segment that fits, leaving the larger ones for larger messages
+  auto best = segments_.end();
+  for (auto it = segments_.begin(); it != segments_.end(); ++it) {
+    if (it->size >= min_size && (best == segments_.end() || it->size < best->size)) {
+      best = it;
+    }
+  }
+  if (best == segments_.end()) {
+    return nullptr;
+  }
+
+  capnp::word *words = best->words;
+  size = best->size;
+  *best = segments_.back();
+  segments_.pop_back();
+  return words;
+}
+
+void SmartCapnpBuilderCache::give(capnp::word *segment, uint size, uint used) {
+  // the rest of the segment was never written, so it is still clear
+  memset(segment, 0, used * sizeof(capnp::word));
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (segments_.size() < max_segments_) {
+      segments_.push_back(Segment{segment, size});
+      return;
+    }
+  }
+  pool_->free(segment);
+}
+
+SmartCapnpBuilder::SmartCapnpBuilder(a17::utils::SizeClassPool &pool)
+    : next_size_(pool.minBufferSize() / sizeof(capnp::word)),
       pool(&pool),
       own_first_segment_(true),
       returned_first_segment_(false),
       first_segment_(nullptr) {}
 
+SmartCapnpBuilder::SmartCapnpBuilder(a17::utils::BufferPool &pool)
+    : SmartCapnpBuilder(SingleClassPool(pool)) {}
+
+SmartCapnpBuilder::SmartCapnpBuilder(SmartCapnpBuilderCache &cache)
+    : SmartCapnpBuilder(cache.pool()) {
+  cache_ = &cache;
+}
+
 SmartCapnpBuilder::~SmartCapnpBuilder() noexcept(false) {
   if (!invalidated_ && returned_first_segment_) {
+    // the cache only needs to clear the part of each segment that the message used
+    auto used = cache_ ? getSegmentsForOutput() : nullptr;
+
     if (own_first_segment_) {
-      if (is_first_segment_pooled_) {
-        pool->free(first_segment_);
-      } else {
-        free(first_segment_);
-      }
+      releaseSegment(first_segment_, first_segment_size_, used);
     }
 
     KJ_IF_MAYBE(s, more_segments_) {
       MoreSegments *more = s->get();
-      for (int i = 0; i < static_cast<int>(more->segments.size()); i++) {
-        if (more->is_segment_pooled[i]) {
-          pool->free(more->segments[i]);
-        } else {
-          free(more->segments[i]);
-        }
+      for (size_t i = 0; i < more->segments.size(); i++) {
+        releaseSegment(more->segments[i], more->sizes[i], used);
       }
     }
   }
 }
 
+void SmartCapnpBuilder::releaseSegment(void *segment, uint size,
+                                       kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> used) {
+  if (!cache_) {
+    pool->free(segment);
+    return;
+  }
+
+  // clear the whole segment if the message doesn't list it
+  uint used_size = size;
+  for (auto &output : used) {
+    if (output.begin() == segment) {
+      used_size = output.size();
+      break;
+    }
+  }
+  cache_->give(static_cast<capnp::word *>(segment), size, used_size);
+}
+
 kj::ArrayPtr<capnp::word> SmartCapnpBuilder::allocateSegment(uint minimumSize) {
   if (!returned_first_segment_ && !own_first_segment_) {
     kj::ArrayPtr<capnp::word> result =
@@ -44,31 +141,32 @@ kj::ArrayPtr<capnp::word> SmartCapnpBuilder::allocateSegment(uint minimumSize) {
     own_first_segment_ = true;
   }
 
-  // use the buffer pool if requested segment size matches buffer size
-  uint size = kj::max(minimumSize, next_size_);
-  bool usePool = pool && size * sizeof(capnp::word) <= pool->bufferSize();
-  void *result = nullptr;
-
-  if (usePool) {
-    result = pool->calloc();
-    if (!result) {
-      if (spdlog::get("Socket")) {
-        spdlog::get("Socket")->warn("allocateSegment(): buffer pool failed using calloc");
-      }
-    }
-  }
+  uint min_size = kj::max(minimumSize, next_size_);
+  uint size = 0;
+  capnp::word *result = cache_ ? cache_->take(min_size, size) : nullptr;
 
   if (!result) {
-    result = calloc(size, sizeof(capnp::word));
+    // the pool rounds the segment up to its size class, and capnp may use all of it, so all of it
+    // is cleared
+    size_t bytes = pool->bufferSize(min_size * sizeof(capnp::word));
+    result = static_cast<capnp::word *>(pool->calloc(bytes));
     if (!result) {
       throw std::runtime_error("calloc failed");
     }
+    size = bytes / sizeof(capnp::word);
+  }
+
+  // grow like capnp::MallocMessageBuilder so large messages need few segments, but stay within the
+  // pool's largest size class
+  uint max_size = pool->maxBufferSize() / sizeof(capnp::word);
+  if (next_size_ < max_size) {
+    next_size_ = kj::min(next_size_ + size, max_size);
   }
 
   if (!returned_first_segment_) {
     first_segment_ = result;
+    first_segment_size_ = size;
     returned_first_segment_ = true;
-    is_first_segment_pooled_ = usePool;
   } else {
     MoreSegments *segments;
     KJ_IF_MAYBE(s, more_segments_) { segments = *s; }
@@ -79,43 +177,75 @@ kj::ArrayPtr<capnp::word> SmartCapnpBuilder::allocateSegment(uint minimumSize) {
     }
 
     segments->segments.push_back(result);
-    segments->is_segment_pooled.push_back(usePool);
+    segments->sizes.push_back(size);
   }
 
-  return kj::arrayPtr(reinterpret_cast<capnp::word *>(result), size);
+  return kj::arrayPtr(result, size);
 }
 
 azmq::message SmartCapnpBuilder::build() const {
   auto segments = ((SmartCapnpBuilder *)this)->getSegmentsForOutput();
   size_t messageSize = capnp::computeSerializedSizeInWords(segments) * sizeof(capnp::word);
 
-  // use buffer pool for the final message, otherwise malloc
-  if (pool && messageSize <= pool->bufferSize()) {
-    void *buf = pool->malloc();
-    if (buf) {
-      azmq::nocopy_t nocopy;
-      azmq::message message(nocopy, boost::asio::mutable_buffer(buf, messageSize), pool,
-                            a17::utils::BufferPool::zmqFree);
-      buildSmartMessage(message, segments);
-      return message;
-    } else {
-      if (spdlog::get("Socket")) {
-        spdlog::get("Socket")->warn("build(): buffer pool failed using malloc");
-      }
-    }
+  // the pool falls back to OS malloc for messages larger than its largest size class
+  void *buf = pool->malloc(messageSize);
+  if (!buf) {
+    throw std::runtime_error("malloc failed");
   }
 
-  azmq::message message(messageSize);
+  azmq::nocopy_t nocopy;
+  azmq::message message(nocopy, boost::asio::mutable_buffer(buf, messageSize), pool,
+                        a17::utils::SizeClassPool::zmqFree);
   buildSmartMessage(message, segments);
   return message;
 }
 
-// Copy directly into an azmq message
-void SmartCapnpBuilder::buildSmartMessage(
-    azmq::message &message, kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> &segments) const {
-  boost::asio::mutable_buffer buf = message.buffer();
-  uint32_t *table = boost::asio::buffer_cast<uint32_t *>(buf);
+void SmartCapnpBuilder::attach(const boost::asio::const_buffer &buffer, BufferDeleter deleter) {
+  void *data = const_cast<void *>(boost::asio::buffer_cast<const void *>(buffer));
+  azmq::nocopy_t nocopy;
+  attachments_.push_back(azmq::message(
+      nocopy, boost::asio::mutable_buffer(data, boost::asio::buffer_size(buffer)),
+      new BufferDeleter(std::move(deleter)), FreeAttachment));
+}
+
+azmq::message_vector SmartCapnpBuilder::getEncodedMessage(MessageCodec codec,
+                                                          CodecStats *stats) const {
+  azmq::message_vector message = getSmartMessage();
+  encodeSmartMessage(message, codec, stats);
+  return message;
+}
 
+azmq::message_vector SmartCapnpBuilder::takeSegmentedMessage() {
+  auto segments = getSegmentsForOutput();
+
+  azmq::message_vector message;
+  message.reserve(segments.size() + 2 + attachments_.size());
+
+  SmartMessageHeader header{id_, SMART_MESSAGE_SEGMENTED, 0};
+  message.push_back(azmq::message(boost::asio::const_buffer(&header, sizeof(header))));
+
+  azmq::message table((segments.size() / 2 + 1) * sizeof(capnp::word));
+  writeSegmentTable(boost::asio::buffer_cast<uint32_t *>(table.buffer()), segments);
+  message.push_back(std::move(table));
+
+  // Every segment comes from the pool, which zmq gives it back to.
+  azmq::nocopy_t nocopy;
+  for (auto &segment : segments) {
+    void *data = const_cast<capnp::word *>(segment.begin());
+    size_t size = segment.size() * sizeof(capnp::word);
+    message.push_back(azmq::message(nocopy, boost::asio::mutable_buffer(data, size), pool,
+                                    a17::utils::SizeClassPool::zmqFree));
+  }
+
+  message.insert(message.end(), attachments_.begin(), attachments_.end());
+
+  // zmq owns the segments now
+  invalidated_ = true;
+  return message;
+}
+
+size_t SmartCapnpBuilder::writeSegmentTable(
+    uint32_t *table, kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments) {
   table[0] = segments.size() - 1;
 
   for (uint i = 0; i < segments.size(); i++) {
@@ -127,7 +257,16 @@ void SmartCapnpBuilder::buildSmartMessage(
     table[segments.size() + 1] = 0;
   }
 
-  capnp::word *dst = boost::asio::buffer_cast<capnp::word *>(buf) + segments.size() / 2 + 1;
+  return segments.size() / 2 + 1;
+}
+
+// Copy directly into an azmq message
+void SmartCapnpBuilder::buildSmartMessage(
+    azmq::message &message, kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> &segments) const {
+  boost::asio::mutable_buffer buf = message.buffer();
+  size_t table_size = writeSegmentTable(boost::asio::buffer_cast<uint32_t *>(buf), segments);
+
+  capnp::word *dst = boost::asio::buffer_cast<capnp::word *>(buf) + table_size;
 
   for (auto &segment : segments) {
     memcpy(dst, segment.begin(), segment.size() * sizeof(capnp::word));
@@ -1,6 +1,9 @@
 #pragma once
 
+#include <functional>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <assert.h>
 #include <spdlog/spdlog.h>
@@ -9,7 +12,8 @@
 #include <capnp/schema.h>
 #include <capnp/dynamic.h>
 #include "defs.h"
-#include "a17/utils/buffer_pool.h"
+#include "a17/utils/size_class_pool.h"
+#include "message_codec.h"
 #include "message_helpers.h"
 
 namespace a17 {
@@ -44,10 +48,63 @@ assumed to be raw data buffers (non capnp structures).
  * msg.setOtherStuff(...);
  * socket.send(msg, ec);
  */
+/**
+ * Keeps the segments of finished SmartCapnpBuilders so that the next builder can start its message
+ * in them. When a builder is destroyed, only the bytes its message used are cleared, instead of the
+ * next builder getting a fresh calloc'd segment from the pool. Publishers that send messages of a
+ * steady size at a high rate then skip nearly all allocation and memset.
+ * SmartCapnpBuilderCache cache(pool);
+ * while (...) {
+ *   SmartCapnpBuilder msg(cache);
+ *   ...
+ *   publisher->send(msg);
+ * }
+ *
+ * Builders may use the same cache from several threads. The cache must outlive its builders.
+ */
+class SmartCapnpBuilderCache {
+ public:
+  // @param pool memory pool that new segments come from and extra segments go back to
+  // @param max_segments most segments kept by the cache
+  explicit SmartCapnpBuilderCache(a17::utils::SizeClassPool &pool, size_t max_segments = 16);
+  ~SmartCapnpBuilderCache();
+
+  SmartCapnpBuilderCache(const SmartCapnpBuilderCache &) = delete;
+  SmartCapnpBuilderCache &operator=(const SmartCapnpBuilderCache &) = delete;
+
+  inline a17::utils::SizeClassPool &pool() { return *pool_; }
+  size_t size();
+
+  // Returns a cleared segment of at least min_size words and sets size to its actual size. Returns
+  // nullptr if the cache has no segment that large.
+  capnp::word *take(uint min_size, uint &size);
+  // Keeps a segment of size words, of which the first used words are cleared here.
+  void give(capnp::word *segment, uint size, uint used);
+
+ private:
+  struct Segment {
+    capnp::word *words;
+    uint size;
+  };
+
+  a17::utils::SizeClassPool *pool_;
+  size_t max_segments_;
+  std::mutex mutex_;
+  std::vector<Segment> segments_;
+};
+
 class SmartCapnpBuilder : public capnp::MessageBuilder {
  public:
-  // Builder that uses the given memory pool to allocate segments.
+  // Called with the data of an attached buffer once nothing refers to it anymore.
+  using BufferDeleter = std::function<void(const void *data)>;
+
+  // Builder that uses the given memory pool to allocate segments and the built message.
+  explicit SmartCapnpBuilder(a17::utils::SizeClassPool &pool);
+  // Builder that takes segments of the pool's buffer size from it, and larger ones from OS
+  // malloc(). The pool must outlive the messages built with it.
   explicit SmartCapnpBuilder(a17::utils::BufferPool &pool);
+  // Builder that starts in segments kept by the cache, and gives them back to it when destroyed.
+  explicit SmartCapnpBuilder(SmartCapnpBuilderCache &cache);
 
   SmartCapnpBuilder(SmartCapnpBuilder &other) = delete;
 
@@ -55,12 +112,14 @@ class SmartCapnpBuilder : public capnp::MessageBuilder {
       : id_(other.id_),
         next_size_(other.next_size_),
         pool(other.pool),
+        cache_(other.cache_),
         own_first_segment_(other.own_first_segment_),
         returned_first_segment_(other.returned_first_segment_),
         first_segment_(other.first_segment_),
-        is_first_segment_pooled_(other.is_first_segment_pooled_),
-        more_segments_(std::move(other.more_segments_)) {
-    invalidated_ = true;
+        first_segment_size_(other.first_segment_size_),
+        more_segments_(std::move(other.more_segments_)),
+        attachments_(std::move(other.attachments_)) {
+    other.invalidated_ = true;
   }
 
   virtual ~SmartCapnpBuilder() noexcept(false);
@@ -72,14 +131,39 @@ class SmartCapnpBuilder : public capnp::MessageBuilder {
 
   // Builds a complete zmq multipart message where the first message is the id and the second
   // message is populated from the builder We call this message since we hide the fact that we are
-  // appending an id message at the front of the message vector
+  // appending an id message at the front of the message vector. Attached buffers follow.
   inline azmq::message_vector getSmartMessage() const {
-    return azmq::message_vector{azmq::message(boost::asio::const_buffer(&id_, sizeof(id_))),
-                                build()};
+    azmq::message_vector message{azmq::message(boost::asio::const_buffer(&id_, sizeof(id_))),
+                                 build()};
+    message.insert(message.end(), attachments_.begin(), attachments_.end());
+    return message;
   }
+  // Builds a smart message whose capnp frame is encoded with codec, adding its sizes and encode
+  // time to stats if given. Messages that don't shrink are left as they are. Publishers can also
+  // encode everything they send, see Publisher::setCodec().
+  azmq::message_vector getEncodedMessage(MessageCodec codec, CodecStats *stats = nullptr) const;
   // Helper operator to allow passing the builder directly to socket.send()
   inline operator azmq::message_vector() const { return getSmartMessage(); }
 
+  // Builds a multipart message without copying the builder data: after the id frame, a segment
+  // table frame is followed by one frame per builder segment. zmq takes ownership of the segments
+  // and returns them to the pool once they are sent, so the builder must not be used afterwards.
+  // This saves a full copy of multi-megabyte messages. For small messages, the extra frames cost
+  // more than the copy does. SmartCapnpReader reads both kinds of messages.
+  azmq::message_vector takeSegmentedMessage();
+
+  // Attaches a raw buffer, e.g. an image or the data of an Eigen matrix, that is sent as a frame of
+  // its own after the capnp message instead of being copied into a capnp list. zmq sends the
+  // buffer in place, so it must not change until deleter is called, once the builder and every
+  // message built from it are gone. Subscribers read it with SmartMessageReader::bufferAs().
+  void attach(const boost::asio::const_buffer &buffer, BufferDeleter deleter);
+  // Attaches a buffer that owner keeps alive, e.g. attach(boost::asio::buffer(*points), points).
+  template <typename T>
+  void attach(const boost::asio::const_buffer &buffer, std::shared_ptr<T> owner) {
+    attach(buffer, [owner](const void *) {});
+  }
+  inline size_t attachments() const { return attachments_.size(); }
+
   virtual kj::ArrayPtr<capnp::word> allocateSegment(uint minimumSize) override;
 
   // Hide the base class method in order to force extraction of the capnproto class id
@@ -99,27 +183,37 @@ class SmartCapnpBuilder : public capnp::MessageBuilder {
  private:
   void buildSmartMessage(azmq::message &message,
                          kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> &segments) const;
+  // Writes the capnp segment table into table, returning the number of words written.
+  static size_t writeSegmentTable(uint32_t *table,
+                                  kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> segments);
+  // Returns a segment to the cache, or to the pool if there isn't a cache.
+  void releaseSegment(void *segment, uint size,
+                      kj::ArrayPtr<const kj::ArrayPtr<const capnp::word>> used);
 
   unsigned long long id_ = 0;
   uint next_size_;
-  a17::utils::BufferPool *pool;
+  a17::utils::SizeClassPool *pool;
+  SmartCapnpBuilderCache *cache_ = nullptr;
 
   bool own_first_segment_;
   bool returned_first_segment_;
   void *first_segment_;
-  bool is_first_segment_pooled_;
+  uint first_segment_size_ = 0;
 
   bool invalidated_ = false;
 
   struct MoreSegments {
     std::vector<void *> segments;
-    std::vector<bool> is_segment_pooled;
+    std::vector<uint> sizes;
     MoreSegments() {}
     MoreSegments(MoreSegments &&other)
-        : segments(std::move(other.segments)), is_segment_pooled(std::move(other.is_segment_pooled)) {}
+        : segments(std::move(other.segments)), sizes(std::move(other.sizes)) {}
   };
 
   kj::Maybe<kj::Own<MoreSegments>> more_segments_;
+
+  // Raw buffer frames that follow the capnp message.
+  std::vector<azmq::message> attachments_;
 };
 
 }  // namespace dispatch
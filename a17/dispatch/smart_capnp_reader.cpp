@@ -1,25 +1,79 @@
 #include "smart_capnp_reader.h"
 
 #include <assert.h>
+#include <cstring>
 
 namespace a17 {
 namespace dispatch {
 
+std::atomic<uint64_t> SmartCapnpReader::misaligned_count_{0};
+
 SmartCapnpReader::SmartCapnpReader(azmq::message &message, unsigned long long id)
-    : id_(id),
-      buffer_(CapnpBufferFromAzmqMessage(message)),
-      reader_(buffer_) {}
+    : id_(id), frame_(message) {
+  flat_reader_.emplace(WordsFromAzmqMessage(frame_, buffer_));
+  reader_ = flat_reader_.get_ptr();
+}
 
 // It's possible that you could send a message_vector with size < 2, which would assert
 SmartCapnpReader::SmartCapnpReader(azmq::message_vector &message_vector)
-    : id_(idFromSmartMessage(message_vector)),
-      buffer_(CapnpBufferFromAzmqMessage(message_vector[1])),
-      reader_(buffer_) {}
-
-kj::Array<capnp::word> SmartCapnpReader::CapnpBufferFromAzmqMessage(const azmq::message &message) {
-  auto word_aligned_buffer = kj::heapArray<capnp::word>(message.size() / sizeof(capnp::word));
-  memcpy(word_aligned_buffer.begin(), message.data(), word_aligned_buffer.asBytes().size());
-  return word_aligned_buffer;
+    : id_(idFromSmartMessage(message_vector)), frame_(message_vector[1]) {
+  uint32_t flags = flagsFromSmartMessage(message_vector);
+  if (flags & SMART_MESSAGE_SEGMENTED) {
+    readSegments(message_vector);
+    segment_reader_.emplace(segments_);
+    reader_ = segment_reader_.get_ptr();
+  } else if (flags & SMART_MESSAGE_ENCODED) {
+    decoded_ = decodeSmartMessageFrame(frame_, flags);
+    flat_reader_.emplace(decoded_.asPtr());
+    reader_ = flat_reader_.get_ptr();
+  } else {
+    flat_reader_.emplace(WordsFromAzmqMessage(frame_, buffer_));
+    reader_ = flat_reader_.get_ptr();
+  }
+}
+
+void SmartCapnpReader::readSegments(azmq::message_vector &message_vector) {
+  size_t table_size = frame_.size() / sizeof(uint32_t);
+  if (table_size < 1) {
+    throw std::runtime_error("Segmented message is missing its segment table");
+  }
+  std::vector<uint32_t> table(table_size);
+  memcpy(table.data(), frame_.data(), table_size * sizeof(uint32_t));
+
+  size_t segment_count = static_cast<size_t>(table[0]) + 1;
+  if (table_size < segment_count + 1 || message_vector.size() < segment_count + 2) {
+    throw std::runtime_error("Segmented message has " + std::to_string(message_vector.size()) +
+                             " frames for " + std::to_string(segment_count) + " segments");
+  }
+
+  segment_frames_.reserve(segment_count);
+  segments_ = kj::heapArray<kj::ArrayPtr<const capnp::word>>(segment_count);
+  for (size_t i = 0; i < segment_count; i++) {
+    segment_frames_.push_back(message_vector[i + 2]);
+    if (segment_frames_[i].size() != table[i + 1] * sizeof(capnp::word)) {
+      throw std::runtime_error("Segment " + std::to_string(i) + " doesn't match its size in the " +
+                               "segment table");
+    }
+
+    kj::Array<capnp::word> buffer;
+    segments_[i] = WordsFromAzmqMessage(segment_frames_[i], buffer);
+    if (buffer.size() > 0) {
+      segment_buffers_.push_back(kj::mv(buffer));
+    }
+  }
+}
+
+kj::ArrayPtr<const capnp::word> SmartCapnpReader::WordsFromAzmqMessage(
+    const azmq::message &message, kj::Array<capnp::word> &buffer) {
+  size_t word_count = message.size() / sizeof(capnp::word);
+  if (reinterpret_cast<uintptr_t>(message.data()) % alignof(capnp::word) == 0) {
+    return kj::arrayPtr(reinterpret_cast<const capnp::word *>(message.data()), word_count);
+  }
+
+  misaligned_count_++;
+  buffer = kj::heapArray<capnp::word>(word_count);
+  memcpy(buffer.begin(), message.data(), buffer.asBytes().size());
+  return buffer.asPtr();
 }
 
 }  // namespace dispatch
@@ -1,15 +1,18 @@
 #pragma once
 
+#include <atomic>
 #include <iostream>
 #include <stdexcept>
 #include <vector>
 
+#include <boost/optional.hpp>
 #include <capnp/message.h>
 #include <capnp/schema.h>
 #include <capnp/serialize.h>
 #include <spdlog/spdlog.h>
 
 #include "defs.h"
+#include "message_codec.h"
 #include "message_helpers.h"
 
 namespace a17 {
@@ -18,13 +21,30 @@ namespace dispatch {
 /// Wraps capnproto reader with convenience constructors for dealing with azmq messages.
 /// This reader knows the capnproto id of the underlying capnproto class, and verifies in
 /// getRoot() that the correct class is passed in the template.
+///
+/// The reader holds a reference to the zmq frame for its whole lifetime. If the frame data is
+/// word-aligned, capnproto reads it in place. Otherwise the frame is copied into a word-aligned
+/// buffer and misalignedCount() is incremented.
+///
+/// Segmented messages (SMART_MESSAGE_SEGMENTED) are read the same way, one frame per segment.
+/// Encoded messages (see MessageCodec) are decoded into a buffer held by the reader.
 class SmartCapnpReader {
  public:
   SmartCapnpReader(azmq::message &message, unsigned long long id);
   SmartCapnpReader(azmq::message_vector &message_vector);
 
+  SmartCapnpReader(const SmartCapnpReader &) = delete;
+  SmartCapnpReader &operator=(const SmartCapnpReader &) = delete;
+
   inline unsigned long long id() const { return id_; }
 
+  /// Whether this reader had to copy a frame because it was not word-aligned.
+  inline bool copied() const { return buffer_.size() > 0 || !segment_buffers_.empty(); }
+  /// Whether the message was sent as one frame per segment.
+  inline bool segmented() const { return segment_reader_.is_initialized(); }
+  /// Whether the message was encoded with a MessageCodec.
+  inline bool encoded() const { return decoded_.size() > 0; }
+
   template <typename RootType>
   typename RootType::Reader getRoot() {
     unsigned long long requestedId = idOf<RootType>();
@@ -32,20 +52,40 @@ class SmartCapnpReader {
       throw std::runtime_error("Type in getRoot<> (" + std::to_string(requestedId) +
                                ") doesn't match id in message (" + std::to_string(id_) + ")");
     }
-    return reader_.getRoot<RootType>();
+    return reader_->getRoot<RootType>();
   }
 
+  /// Number of frames, process-wide, that were copied because they were not word-aligned.
+  static inline uint64_t misalignedCount() { return misaligned_count_.load(); }
+
  private:
-  /// Returns a word-aligned buffer from the azmq message. This function makes a copy of the
-  /// data in message, because zmq does not guarantee the data is malloced on a word-boundary
-  /// on all platforms (particularly on 64-bit systems).
-  static kj::Array<capnp::word> CapnpBufferFromAzmqMessage(const azmq::message &message);
+  /// Returns the frame data as capnp words. zmq does not guarantee the data is malloced on a
+  /// word-boundary on all platforms (particularly on 64-bit systems), so a misaligned frame is
+  /// copied into buffer, which must then be kept alive as long as the returned words are used.
+  static kj::ArrayPtr<const capnp::word> WordsFromAzmqMessage(const azmq::message &message,
+                                                              kj::Array<capnp::word> &buffer);
+  /// Reads the segment table in frame_ and the segment frames that follow it in message_vector.
+  void readSegments(azmq::message_vector &message_vector);
 
   const unsigned long long id_;
-  /// Need to keep a reference to the buffer so that it stays alive in memory while the reader
-  /// is being used.
+  /// Shares the underlying zmq data, so that it stays alive in memory while the reader is used.
+  /// For segmented messages, this is the segment table.
+  azmq::message frame_;
+  /// Word-aligned copy of the frame. Only allocated if the frame is misaligned.
   kj::Array<capnp::word> buffer_;
-  capnp::FlatArrayMessageReader reader_;
+  /// Encoded messages only.
+  kj::Array<capnp::word> decoded_;
+
+  /// Segmented messages only.
+  std::vector<azmq::message> segment_frames_;
+  std::vector<kj::Array<capnp::word>> segment_buffers_;
+  kj::Array<kj::ArrayPtr<const capnp::word>> segments_;
+
+  boost::optional<capnp::FlatArrayMessageReader> flat_reader_;
+  boost::optional<capnp::SegmentArrayMessageReader> segment_reader_;
+  capnp::MessageReader *reader_;
+
+  static std::atomic<uint64_t> misaligned_count_;
 };
 
 }  // namespace dispatch
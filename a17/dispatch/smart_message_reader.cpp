@@ -4,15 +4,17 @@ namespace a17 {
 namespace dispatch {
 
 // The first element will always be the capnp id, and the second element will always be a capnp
-// struct. Any additional elements, if available will be raw buffers
+// struct (or its segment table and segments, if segmented). Any additional elements, if available
+// will be raw buffers
 SmartMessageReader::SmartMessageReader(azmq::message_vector &message_vector)
     : message_vector_(message_vector),
       reader_(new SmartCapnpReader(message_vector)),
-      id_(idFromSmartMessage(message_vector)) {}
+      id_(idFromSmartMessage(message_vector)),
+      capnp_frame_count_(capnpFrameCount(message_vector)) {}
 
 // pos = 1 will always be the capnp struct, additional buffers will be available starting at pos=2
 void *SmartMessageReader::bufferAt(size_t pos, size_t &size) {
-  auto buf = message_vector_[pos + 1].buffer();
+  auto buf = message_vector_[frameIndex(pos)].buffer();
   size = boost::asio::buffer_size(buf);
   return boost::asio::buffer_cast<void *>(buf);
 }
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <iostream>
+#include <type_traits>
 #include <vector>
 #include <assert.h>
 #include <spdlog/spdlog.h>
@@ -16,7 +17,7 @@ namespace dispatch {
 class SmartMessageReader {
  public:
   SmartMessageReader(azmq::message_vector &message_vector);
-  inline size_t size() { return message_vector_.size() - 1; }
+  inline size_t size() { return message_vector_.size() - capnp_frame_count_; }
   inline unsigned long long id() { return id_; }
 
   // Hide the base class method in order to assert that the passed-in template argument
@@ -39,10 +40,37 @@ class SmartMessageReader {
   // Return the raw buffer pointer and size for the message part at the given position.
   void *bufferAt(size_t pos, size_t &size);
 
+  // Returns the raw buffer at the given position (see bufferAt) as an array of T, without copying
+  // it. The array is valid as long as the message is. Throws std::runtime_error if the buffer size
+  // isn't a multiple of sizeof(T), or the buffer isn't aligned for T.
+  template <typename T>
+  kj::ArrayPtr<const T> bufferAs(size_t pos) {
+    static_assert(std::is_trivially_copyable<T>::value,
+                  "Raw buffers hold trivially copyable types");
+    // cbuffer() reads the frame in place, where buffer() would copy a frame that is shared.
+    auto buf = message_vector_[frameIndex(pos)].cbuffer();
+    const void *data = boost::asio::buffer_cast<const void *>(buf);
+    size_t size = boost::asio::buffer_size(buf);
+    if (size % sizeof(T) != 0) {
+      throw std::runtime_error("Buffer " + std::to_string(pos) + " of " + std::to_string(size) +
+                               " bytes doesn't hold a whole number of " +
+                               std::to_string(sizeof(T)) + "-byte elements");
+    }
+    if (reinterpret_cast<uintptr_t>(data) % alignof(T) != 0) {
+      throw std::runtime_error("Buffer " + std::to_string(pos) + " isn't aligned to " +
+                               std::to_string(alignof(T)) + " bytes");
+    }
+    return kj::arrayPtr(static_cast<const T *>(data), size / sizeof(T));
+  }
+
  private:
+  inline size_t frameIndex(size_t pos) const { return pos == 0 ? 1 : pos + capnp_frame_count_; }
+
   azmq::message_vector &message_vector_;
   std::unique_ptr<SmartCapnpReader> reader_;
   unsigned long long id_;
+  // Frames after the id frame that hold the capnp message, more than one if it is segmented.
+  size_t capnp_frame_count_;
 };
 
 }  // namespace dispatch
@@ -10,14 +10,21 @@
 #include "smart_capnp_builder.h"
 #include "smart_capnp_reader.h"
 #include "smart_message_reader.h"
+#include "trace_log.h"
 
 namespace a17 {
 namespace dispatch {
 
-Socket::Socket(boost::asio::io_service &ios, int type, const std::string &class_name)
-    : azmqsocket_(ios, type, true),
-      receive_handler_(bind3(&Socket::onReceive)),
-      log_name_(class_name) {
+Socket::Socket(boost::asio::io_service &ios, int type, const std::string &class_name,
+               const QosProfile &qos)
+    : Socket(ios, class_name) {
+  azmqsocket_.reset(new azmq::socket(ios, type, true));
+  received_message_.reserve(32);
+  setQos(qos);
+}
+
+Socket::Socket(boost::asio::io_service &ios, const std::string &class_name)
+    : strand_(ios), receive_handler_(bind3(&Socket::onReceive)), log_name_(class_name) {
   logger_ = spdlog::get("Socket");
   if (!logger_) {
     try {
@@ -30,22 +37,43 @@ Socket::Socket(boost::asio::io_service &ios, int type, const std::string &class_
     }
   }
 
-  received_message_.reserve(32);
-  sendHighWaterMark(10);
   if(logger_) logger_->set_pattern("[%Y-%m-%d %T.%e] [%n](%l) %v");
 }
 
+void Socket::setQos(const QosProfile &qos) {
+  setKeepLast(qos.conflate);
+  if (!azmqsocket_) return;
+  if (qos.send_hwm) azmqsocket_->set_option(azmq::socket::snd_hwm(*qos.send_hwm));
+  if (qos.receive_hwm) azmqsocket_->set_option(azmq::socket::rcv_hwm(*qos.receive_hwm));
+  if (qos.send_buffer) azmqsocket_->set_option(azmq::socket::snd_buf(*qos.send_buffer));
+  if (qos.receive_buffer) azmqsocket_->set_option(azmq::socket::rcv_buf(*qos.receive_buffer));
+  if (qos.tcp_keepalive_idle || qos.tcp_keepalive_interval || qos.tcp_keepalive_count) {
+    azmqsocket_->set_option(azmq::socket::tcp_keepalive(1));
+  }
+  if (qos.tcp_keepalive_idle) {
+    azmqsocket_->set_option(azmq::socket::tcp_keepalive_idle(*qos.tcp_keepalive_idle));
+  }
+  if (qos.tcp_keepalive_interval) {
+    azmqsocket_->set_option(azmq::socket::tcp_keepalive_intvl(*qos.tcp_keepalive_interval));
+  }
+  if (qos.tcp_keepalive_count) {
+    azmqsocket_->set_option(azmq::socket::tcp_keepalive_cnt(*qos.tcp_keepalive_count));
+  }
+  if (qos.linger_ms) azmqsocket_->set_option(azmq::socket::linger(*qos.linger_ms));
+}
+
 // Start the process of receiving a multipart message.
 void Socket::receive(SmartMessageHandler handler, ErrorHandler error_handler) {
   smart_message_handler_ = std::move(handler);
   error_handler_ = std::move(error_handler);
   // TODO(pickledgator): handle timeout logic here
-  azmqsocket_.async_receive(receive_handler_);
+  azmqsocket_->async_receive(strand_.wrap(receive_handler_));
 }
 
 // Accumulates a complete multipart message over possibly several events. When the message is
 // complete, calls the handler with the message.
-void Socket::onReceive(boost::system::error_code &ec, azmq::message &msg, size_t bytes) {
+void Socket::onReceive(const boost::system::error_code &ec, const azmq::message &msg,
+                       size_t bytes) {
   if (ec) {
     if (logger_) logger_->error("{0} receive error: {1}", log_name_, strerror(ec.value()));
     if (error_handler_) error_handler_(ec);
@@ -54,27 +82,102 @@ void Socket::onReceive(boost::system::error_code &ec, azmq::message &msg, size_t
 
   bool more = msg.more();
   if (msg.size() > 0) {
-    received_message_.push_back(std::move(msg));
+    // Copying shares the underlying zmq data rather than duplicating it.
+    received_message_.push_back(msg);
   }
 
   if (more) {
-    azmqsocket_.async_receive(receive_handler_);
+    azmqsocket_->async_receive(strand_.wrap(receive_handler_));
   } else {
-    if (logger_) {
+    if (keep_last_) receiveNewest();
+
+    if (DISPATCH_SHOULD_TRACE(logger_)) {
       std::ostringstream message_ostream;
       message_ostream << received_message_;
       logger_->trace("{} received {}", log_name_, message_ostream.str());
     }
 
-    smart_message_handler_(received_message_);
+    handle(smart_message_handler_, received_message_);
 
     // TODO(pickledgator): this may be dangerous if the handler doesn't make a copy!
     received_message_.clear();
   }
 }
 
+// Called between messages, while no asynchronous receive is pending, so reading synchronously
+// can't split a multipart message. zmq queues all parts of a message together, so a message that
+// has started is always complete.
+void Socket::receiveNewest() {
+  azmq::message_vector newest;
+  boost::system::error_code ec;
+  for (;;) {
+    azmq::message msg;
+    azmqsocket_->receive(msg, ZMQ_DONTWAIT, ec);
+    if (ec) break;
+
+    bool more = msg.more();
+    if (msg.size() > 0) newest.push_back(msg);
+    if (!more) {
+      // A message that the handler would ignore doesn't replace one that it wants.
+      if (accepts(newest)) {
+        if (accepts(received_message_)) {
+          if (auto log = EventLog::global()) logEvent(*log, EventLog::DROP, received_message_);
+          dropped_++;
+        }
+        received_message_.swap(newest);
+      }
+      newest.clear();
+    }
+  }
+}
+
+void Socket::handle(SmartMessageHandler &handler, azmq::message_vector &message) {
+  size_t size = 0;
+  for (const auto &part : message) size += part.size();
+  messages_received_++;
+  bytes_received_ += size;
+  if (auto log = EventLog::global()) logEvent(*log, EventLog::RECEIVE, message);
+
+  auto start = std::chrono::steady_clock::now();
+  {
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+    receive_rate_.markSize(size, start);
+  }
+  handler(message);
+  handler_ns_ += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count();
+}
+
+// Each log gets the socket's name once, and then only its id with every event.
+void Socket::logEvent(EventLog &log, EventLog::Event event, const azmq::message_vector &message) {
+  if (named_in_.exchange(&log) != &log) {
+    event_socket_id_ = std::hash<std::string>()(log_name_);
+    log.name(event_socket_id_, log_name_);
+  }
+  log.log(event, event_socket_id_, message);
+}
+
+SocketMetrics Socket::metrics() {
+  SocketMetrics metrics;
+  metrics.messages_sent = messages_sent_.load();
+  metrics.bytes_sent = bytes_sent_.load();
+  metrics.send_errors = send_errors_.load();
+  metrics.messages_received = messages_received_.load();
+  metrics.bytes_received = bytes_received_.load();
+  metrics.dropped = dropped_.load();
+  metrics.handler_ns = handler_ns_.load();
+
+  std::lock_guard<std::mutex> lock(rate_mutex_);
+  metrics.send_frequency = send_rate_.frequency();
+  metrics.send_jitter = send_rate_.jitter();
+  metrics.receive_frequency = receive_rate_.frequency();
+  metrics.receive_jitter = receive_rate_.jitter();
+  return metrics;
+}
+
 size_t Socket::send(const azmq::message_vector &message_vector, boost::system::error_code &ec) {
-  if (logger_) {
+  if (DISPATCH_SHOULD_TRACE(logger_)) {
     std::ostringstream message_ostream;
     message_ostream << message_vector;
     logger_->trace("{} sending {}", log_name_, message_ostream.str());
@@ -83,22 +186,37 @@ size_t Socket::send(const azmq::message_vector &message_vector, boost::system::e
   size_t size = 0;
 
   if (message_vector.empty()) {
-    size = azmqsocket_.send(azmq::message(), ZMQ_DONTWAIT, ec);
+    size = azmqsocket_->send(azmq::message(), ZMQ_DONTWAIT, ec);
   } else {
     for (unsigned long i = 0; i < message_vector.size() - 1 && !ec; i++) {
-      size += azmqsocket_.send(message_vector[i], ZMQ_SNDMORE | ZMQ_DONTWAIT, ec);
+      size += azmqsocket_->send(message_vector[i], ZMQ_SNDMORE | ZMQ_DONTWAIT, ec);
     }
 
-    if (!ec) size += azmqsocket_.send(message_vector[message_vector.size() - 1], ZMQ_DONTWAIT, ec);
+    if (!ec) {
+      size += azmqsocket_->send(message_vector[message_vector.size() - 1], ZMQ_DONTWAIT, ec);
+    }
   }
 
-  if (ec) {
-    if (logger_) logger_->error("{0} send error: {1}", log_name_, strerror(ec.value()));
+  if (auto log = EventLog::global()) {
+    logEvent(*log, ec ? EventLog::SEND_ERROR : EventLog::SEND, message_vector);
   }
 
+  countSend(size, ec);
   return size;
 }
 
+void Socket::countSend(size_t size, const boost::system::error_code &ec) {
+  if (ec) {
+    send_errors_++;
+    if (logger_) logger_->error("{0} send error: {1}", log_name_, strerror(ec.value()));
+  } else {
+    messages_sent_++;
+    bytes_sent_ += size;
+    std::lock_guard<std::mutex> lock(rate_mutex_);
+    send_rate_.markSize(size);
+  }
+}
+
 boost::system::error_code Socket::send(const azmq::message_vector &message_vector) {
   boost::system::error_code ec;
   send(message_vector, ec);
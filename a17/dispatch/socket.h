@@ -1,25 +1,74 @@
 #pragma once
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+
+#include "a17/utils/rate_measure.h"
 #include "azmq/socket.hpp"
+#include "boost/asio/io_service.hpp"
+#include "boost/asio/strand.hpp"
 #include "spdlog/logger.h"
 
 #include "defs.h"
+#include "event_log.h"
 #include "handlers.h"
+#include "qos_profile.h"
 
 namespace a17 {
 namespace dispatch {
 
+// Counters of a socket since it was created. Frequencies are in Hz and jitters in μs, averaged
+// over the last two seconds (see a17::utils::RateMeasure).
+struct SocketMetrics {
+  uint64_t messages_sent = 0;
+  uint64_t bytes_sent = 0;
+  // Failed sends, which are nearly always EAGAIN from reaching the high-water mark.
+  uint64_t send_errors = 0;
+  // Messages handed to the handler, whether received through zmq or in-process.
+  uint64_t messages_received = 0;
+  uint64_t bytes_received = 0;
+  uint64_t dropped = 0;
+  uint64_t handler_ns = 0;
+  double send_frequency = 0;
+  double send_jitter = 0;
+  double receive_frequency = 0;
+  double receive_jitter = 0;
+};
+
+// Every socket owns a strand that its receive chain runs on. When the io_service is run by several
+// threads, messages on one socket are still handled in order, while different sockets are handled
+// in parallel.
+//
+// In keep-last mode, a socket that falls behind skips to the newest message waiting for it, and
+// counts the ones it skipped as dropped. Use it for high-rate state topics, where the handler
+// should act on the freshest sample rather than work through a backlog.
 class Socket {
   friend class Listener;
 
  public:
-  Socket(boost::asio::io_service &ios, int type, const std::string &class_name);
+  Socket(boost::asio::io_service &ios, int type, const std::string &class_name,
+         const QosProfile &qos = QosProfile());
+
+  // A socket without a zmq socket of its own, for sockets that send through another one (see
+  // Publisher's multiplexed constructor). It only counts what is sent on its behalf; socket(),
+  // receive() and the QoS socket options aren't available.
+  Socket(boost::asio::io_service &ios, const std::string &class_name);
 
   Socket(Socket &&other)
       : azmqsocket_(std::move(other.azmqsocket_)),
+        strand_(other.strand_),
         received_message_(std::move(other.received_message_)),
         smart_message_handler_(other.smart_message_handler_),
         receive_handler_(bind3(&Socket::onReceive)),
+        keep_last_(other.keep_last_),
+        dropped_(other.dropped_.load()),
+        messages_sent_(other.messages_sent_.load()),
+        bytes_sent_(other.bytes_sent_.load()),
+        send_errors_(other.send_errors_.load()),
+        messages_received_(other.messages_received_.load()),
+        bytes_received_(other.bytes_received_.load()),
+        handler_ns_(other.handler_ns_.load()),
         log_name_(std::move(other.log_name_)),
         logger_(std::move(other.logger_)) {}
 
@@ -27,7 +76,8 @@ class Socket {
     if (logger_) logger_->info("{0} destroyed", log_name_);
   }
 
-  inline azmq::socket &socket() { return azmqsocket_; }
+  inline azmq::socket &socket() { return *azmqsocket_; }
+  inline boost::asio::io_service::strand &strand() { return strand_; }
   inline const std::string &logName() const { return log_name_; }
 
   void receive(SmartMessageHandler handler, ErrorHandler errorHandler = ErrorHandler());
@@ -36,18 +86,57 @@ class Socket {
   boost::system::error_code send(const azmq::message_vector &message);
 
   inline void sendHighWaterMark(uint32_t hwm) {
-    azmqsocket_.set_option(azmq::socket::snd_hwm(hwm));
+    azmqsocket_->set_option(azmq::socket::snd_hwm(hwm));
   }
 
+  // Applies the profile's socket options, which only affect connections made from now on, and its
+  // conflate setting.
+  void setQos(const QosProfile &qos);
+
+  inline void setKeepLast(bool keep_last) { keep_last_ = keep_last; }
+  inline bool keepLast() const { return keep_last_; }
+  // Number of messages skipped in keep-last mode.
+  inline uint64_t dropped() const { return dropped_.load(); }
+
+  // May be called from any thread.
+  SocketMetrics metrics();
+
  protected:
-  void onReceive(boost::system::error_code &ec, azmq::message &msg, size_t bytes);
+  void onReceive(const boost::system::error_code &ec, const azmq::message &msg, size_t bytes);
+  // Replaces received_message_ with the newest complete message already waiting on the socket
+  // that accepts() returns true for.
+  void receiveNewest();
+  // Whether a received message is meant for this socket, for sockets that receive messages they
+  // then ignore.
+  virtual bool accepts(const azmq::message_vector &) const { return true; }
+  // Calls the handler with a complete message, counting it and the time the handler takes.
+  void handle(SmartMessageHandler &handler, azmq::message_vector &message);
+  // Counts a message sent by this socket, or on its behalf by another one.
+  void countSend(size_t size, const boost::system::error_code &ec);
+  void logEvent(EventLog &log, EventLog::Event event, const azmq::message_vector &message);
 
-  azmq::socket azmqsocket_;
+  std::unique_ptr<azmq::socket> azmqsocket_;
+  boost::asio::io_service::strand strand_;
   azmq::message_vector received_message_;
   SmartMessageHandler smart_message_handler_;
   ErrorHandler error_handler_;
-  const std::function<void(boost::system::error_code &ec, azmq::message &, size_t)>
+  const std::function<void(const boost::system::error_code &ec, const azmq::message &, size_t)>
       receive_handler_;
+  bool keep_last_ = false;
+  std::atomic<uint64_t> dropped_{0};
+  std::atomic<uint64_t> messages_sent_{0};
+  std::atomic<uint64_t> bytes_sent_{0};
+  std::atomic<uint64_t> send_errors_{0};
+  std::atomic<uint64_t> messages_received_{0};
+  std::atomic<uint64_t> bytes_received_{0};
+  std::atomic<uint64_t> handler_ns_{0};
+  // Sends may come from any thread, so the rates are locked.
+  std::mutex rate_mutex_;
+  a17::utils::RateMeasure send_rate_;
+  a17::utils::RateMeasure receive_rate_;
+  // The event log that this socket's name was last written to, and its id there.
+  std::atomic<EventLog *> named_in_{nullptr};
+  std::atomic<uint64_t> event_socket_id_{0};
 
   // logging
   std::string log_name_;
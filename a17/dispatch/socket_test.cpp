@@ -1,10 +1,17 @@
+#include <unistd.h>
+
 #include "catch.hpp"
 
 #include "a17/capnp_msgs/test.capnp.h"
 
 #include "directory.h"
+#include "event_log.h"
 #include "message_helpers.h"
+#include "node.h"
 #include "publisher.h"
+#include "publisher_mux.h"
+#include "service.h"
+#include "service_client.h"
 #include "smart_capnp_builder.h"
 #include "smart_capnp_reader.h"
 #include "smart_message_reader.h"
@@ -20,7 +27,7 @@ const std::string TEST_MULTICAST = "224.0.88.1";
 TEST_CASE("Discovery", "[socket]") {
   std::thread t1([]() {
     boost::asio::io_service ios;
-    a17::utils::BufferPool pool;
+    a17::utils::SizeClassPool pool;
 
     a17::dispatch::Directory directory(ios, "test1", TEST_PORT, TEST_MULTICAST);
     a17::dispatch::Publisher pub(ios, directory, "TEST/PUB",
@@ -79,7 +86,7 @@ TEST_CASE("Discovery", "[socket]") {
 
 TEST_CASE("IPC", "[socket]") {
   a17::dispatch::Address address("ipc", "/tmp/dispatch_ipc_test");
-  a17::utils::BufferPool pool;
+  a17::utils::SizeClassPool pool;
 
   std::thread t1([&]() {
     boost::asio::io_service ios;
@@ -124,7 +131,7 @@ TEST_CASE("IPC", "[socket]") {
 
 TEST_CASE("Inproc", "[socket]") {
   a17::dispatch::Address address("inproc", "test_pub");
-  a17::utils::BufferPool pool;
+  a17::utils::SizeClassPool pool;
 
   std::thread t1([&]() {
     boost::asio::io_service ios;
@@ -166,6 +173,530 @@ TEST_CASE("Inproc", "[socket]") {
   t1.join();
 }
 
+TEST_CASE("Intra-process", "[socket]") {
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Directory directory(ios, "test_local", TEST_PORT, TEST_MULTICAST);
+  a17::dispatch::Publisher pub(ios, directory, "TEST/LOCAL",
+                               {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()});
+
+  bool received = false;
+  a17::dispatch::Subscriber sub(ios, directory, "TEST/LOCAL", [&](azmq::message_vector &msg_vec) {
+    received = true;
+    ios.stop();
+    auto reader = a17::dispatch::SmartCapnpReader(msg_vec);
+    auto log = reader.getRoot<a17::capnp_msgs::test::DispatchTest>();
+    CHECK(!strcmp(log.getTopic().cStr(), "QUEUE"));
+  });
+
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::milliseconds(100));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    CHECK(!ec);
+    // The subscriber should be attached in-process rather than connected through zmq.
+    CHECK(sub.isLocal());
+    CHECK(sub.addresses().empty());
+
+    a17::dispatch::SmartCapnpBuilder builder(pool);
+    builder.initRoot<a17::capnp_msgs::test::DispatchTest>().setTopic("QUEUE");
+    CHECK(!pub.send(builder.getSmartMessage()));
+
+    timer.expires_from_now(boost::posix_time::seconds(5));
+    timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+  });
+
+  ios.run();
+
+  CHECK(received);
+}
+
+TEST_CASE("Keep-last subscriber", "[socket]") {
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Directory directory(ios, "test_keep_last", TEST_PORT, TEST_MULTICAST);
+  a17::dispatch::Publisher pub(ios, directory, "TEST/KEEP_LAST",
+                               {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()});
+
+  std::vector<std::string> received;
+  a17::dispatch::Subscriber sub(ios, directory, "TEST/KEEP_LAST",
+                                [&](azmq::message_vector &msg_vec) {
+                                  auto reader = a17::dispatch::SmartCapnpReader(msg_vec);
+                                  auto log = reader.getRoot<a17::capnp_msgs::test::DispatchTest>();
+                                  received.push_back(log.getTopic());
+                                });
+  sub.setQueue(a17::dispatch::SubscriberQueue::KEEP_LAST);
+
+  const int count = 10;
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::milliseconds(100));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    CHECK(!ec);
+    CHECK(sub.isLocal());
+
+    // All of these are sent before the subscriber's handler gets a chance to run.
+    for (int i = 0; i < count; i++) {
+      a17::dispatch::SmartCapnpBuilder builder(pool);
+      builder.initRoot<a17::capnp_msgs::test::DispatchTest>().setTopic(std::to_string(i));
+      CHECK(!pub.send(builder.getSmartMessage()));
+    }
+
+    timer.expires_from_now(boost::posix_time::milliseconds(100));
+    timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+  });
+
+  ios.run();
+
+  REQUIRE(received.size() == 1);
+  CHECK(received[0] == std::to_string(count - 1));
+  CHECK(sub.dropped() == count - 1);
+
+  auto pub_metrics = pub.metrics();
+  CHECK(pub_metrics.messages_sent == count);
+  CHECK(pub_metrics.bytes_sent > 0);
+  CHECK(pub_metrics.send_errors == 0);
+  auto sub_metrics = sub.metrics();
+  CHECK(sub_metrics.messages_received == 1);
+  CHECK(sub_metrics.dropped == count - 1);
+}
+
+TEST_CASE("Latency tracing", "[socket]") {
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Directory directory(ios, "test_tracing", TEST_PORT, TEST_MULTICAST);
+  a17::dispatch::Publisher pub(ios, directory, "TEST/TRACING",
+                               {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()});
+  pub.setTracing(true);
+
+  int received = 0;
+  a17::dispatch::Subscriber sub(ios, directory, "TEST/TRACING", [&](azmq::message_vector &) {
+    if (++received == 2) ios.stop();
+  });
+  sub.setLatencyTracking(true);
+
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::milliseconds(100));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    CHECK(!ec);
+    for (int i = 0; i < 2; i++) {
+      a17::dispatch::SmartCapnpBuilder builder(pool);
+      builder.initRoot<a17::capnp_msgs::test::DispatchTest>();
+      CHECK(!pub.send(builder.getSmartMessage()));
+    }
+
+    timer.expires_from_now(boost::posix_time::seconds(5));
+    timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+  });
+
+  ios.run();
+
+  REQUIRE(received == 2);
+  REQUIRE(sub.latency());
+  CHECK(sub.latency()->traced() == 2);
+  CHECK(sub.latency()->lost() == 0);
+  CHECK(sub.latency()->latency().count() == 2);
+  CHECK(sub.latency()->handlerTime().count() == 2);
+}
+
+TEST_CASE("Event log", "[socket]") {
+  std::string path = "/tmp/a17_dispatch_test_" + std::to_string(getpid()) + ".events";
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Directory directory(ios, "test_event_log", TEST_PORT, TEST_MULTICAST);
+  a17::dispatch::Publisher pub(ios, directory, "TEST/EVENT_LOG",
+                               {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()});
+  a17::dispatch::Subscriber sub(ios, directory, "TEST/EVENT_LOG",
+                                [&](azmq::message_vector &) { ios.stop(); });
+
+  {
+    a17::dispatch::EventLog::setGlobal(std::make_shared<a17::dispatch::EventLog>(path));
+
+    boost::asio::deadline_timer timer(ios);
+    timer.expires_from_now(boost::posix_time::milliseconds(100));
+    timer.async_wait([&](const boost::system::error_code &ec) {
+      CHECK(!ec);
+      a17::dispatch::SmartCapnpBuilder builder(pool);
+      builder.initRoot<a17::capnp_msgs::test::DispatchTest>();
+      CHECK(!pub.send(builder.getSmartMessage()));
+
+      timer.expires_from_now(boost::posix_time::seconds(5));
+      timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+    });
+    ios.run();
+    // Destroying the log writes the rest of the events.
+    a17::dispatch::EventLog::setGlobal(nullptr);
+  }
+  CHECK(!a17::dispatch::EventLog::global());
+
+  std::vector<a17::dispatch::EventLog::Record> records;
+  FILE *file = fopen(path.c_str(), "rb");
+  REQUIRE(file);
+  a17::dispatch::EventLog::Record record;
+  while (fread(&record, sizeof(record), 1, file) == 1) records.push_back(record);
+  fclose(file);
+  unlink(path.c_str());
+
+  int sends = 0, receives = 0, names = 0;
+  for (size_t i = 0; i < records.size(); i++) {
+    switch (records[i].event) {
+      case a17::dispatch::EventLog::SEND:
+        sends++;
+        CHECK(records[i].message_id ==
+              a17::dispatch::idOf<a17::capnp_msgs::test::DispatchTest>());
+        break;
+      case a17::dispatch::EventLog::RECEIVE:
+        receives++;
+        break;
+      case a17::dispatch::EventLog::NAME:
+        names++;
+        i += (records[i].bytes + sizeof(record) - 1) / sizeof(record);
+        break;
+    }
+  }
+  CHECK(sends == 1);
+  CHECK(receives == 1);
+  CHECK(names == 2);
+}
+
+TEST_CASE("QoS profile", "[socket]") {
+  boost::asio::io_service ios;
+  a17::dispatch::Directory directory(ios, "test_qos", TEST_PORT, TEST_MULTICAST);
+
+  a17::dispatch::Publisher pub(ios, directory, "TEST/QOS",
+                               {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()},
+                               a17::dispatch::Address(), a17::dispatch::QosProfile::sensorBulk());
+  azmq::socket::snd_hwm snd_hwm;
+  pub.socket().get_option(snd_hwm);
+  CHECK(snd_hwm.value() == *a17::dispatch::QosProfile::sensorBulk().send_hwm);
+
+  a17::dispatch::Subscriber sub(ios, directory, "TEST/QOS", [](azmq::message_vector &) {});
+  CHECK(!sub.keepLast());
+  sub.setQos(a17::dispatch::QosProfile::control());
+  CHECK(sub.keepLast());
+  azmq::socket::rcv_hwm rcv_hwm;
+  sub.socket().get_option(rcv_hwm);
+  CHECK(rcv_hwm.value() == *a17::dispatch::QosProfile::control().receive_hwm);
+
+  // Set before the subscriber connects.
+  a17::dispatch::Subscriber control_sub(
+      ios, directory, "TEST/QOS", [](azmq::message_vector &) {}, a17::dispatch::ErrorHandler(),
+      a17::dispatch::ConnectionHandler(), a17::dispatch::ConnectionHandler(), {""},
+      a17::dispatch::QosProfile::control());
+  CHECK(control_sub.keepLast());
+}
+
+TEST_CASE("Chunked publisher", "[socket]") {
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Directory directory(ios, "test_chunked", TEST_PORT, TEST_MULTICAST);
+  a17::dispatch::QosProfile qos;
+  qos.chunk_size = 1024;
+  a17::dispatch::Publisher pub(ios, directory, "TEST/CHUNKED",
+                               {a17::dispatch::typeOf<a17::capnp_msgs::test::TestType>()},
+                               a17::dispatch::Address(), qos);
+  REQUIRE(pub.chunkSize() == 1024);
+
+  const uint count = 4096;
+  int received = 0;
+  int chunks = 0;
+  a17::dispatch::Subscriber sub(ios, directory, "TEST/CHUNKED", [&](azmq::message_vector &msg) {
+    a17::dispatch::SmartCapnpReader reader(msg);
+    auto list = reader.getRoot<a17::capnp_msgs::test::TestType>().getAlist();
+    CHECK(list.size() == count);
+    CHECK(list[count - 1] == count - 1);
+    if (++received == 2) ios.stop();
+  });
+  sub.setProgressHandler([&](const a17::dispatch::ChunkProgress &progress) {
+    CHECK(progress.id == a17::dispatch::idOf<a17::capnp_msgs::test::TestType>());
+    CHECK(progress.size <= 1024);
+    chunks++;
+  });
+
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::milliseconds(100));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    CHECK(!ec);
+    for (int i = 0; i < 2; i++) {
+      a17::dispatch::SmartCapnpBuilder builder(pool);
+      auto list = builder.initRoot<a17::capnp_msgs::test::TestType>().initAlist(count);
+      for (uint j = 0; j < count; j++) {
+        list.set(j, j);
+      }
+      CHECK(!pub.send(builder.getSmartMessage()));
+    }
+
+    timer.expires_from_now(boost::posix_time::seconds(5));
+    timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+  });
+
+  ios.run();
+
+  REQUIRE(received == 2);
+  // more than 16 KB each
+  CHECK(chunks > 2 * 16);
+  CHECK(sub.incompleteChunked() == 0);
+}
+
+TEST_CASE("Multiplexed publishers", "[socket]") {
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Directory directory(ios, "test_mux", TEST_PORT, TEST_MULTICAST);
+  // Go through the mux socket rather than in-process.
+  directory.setIntraProcess(false);
+  auto mux = std::make_shared<a17::dispatch::PublisherMux>(ios);
+  a17::dispatch::Publisher pub_a(ios, directory, "TEST/MUX_A",
+                                 {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()},
+                                 mux);
+  a17::dispatch::Publisher pub_b(ios, directory, "TEST/MUX_B",
+                                 {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()},
+                                 mux);
+  REQUIRE(pub_a.mux() == mux);
+  REQUIRE(!pub_a.isBound());
+  REQUIRE(a17::dispatch::muxTopicHash("TEST/MUX_A") != a17::dispatch::muxTopicHash("TEST/MUX_B"));
+
+  std::vector<std::string> received_a;
+  std::vector<std::string> received_b;
+  auto receive = [&](std::vector<std::string> &received, azmq::message_vector &msg_vec) {
+    // The topic frame is stripped before the handler.
+    CHECK(!a17::dispatch::isMuxTopicFrame(msg_vec[0]));
+    auto reader = a17::dispatch::SmartCapnpReader(msg_vec);
+    received.push_back(reader.getRoot<a17::capnp_msgs::test::DispatchTest>().getTopic());
+    if (received_a.size() == 2 && received_b.size() == 1) ios.stop();
+  };
+  a17::dispatch::Subscriber sub_a(ios, directory, "TEST/MUX_A",
+                                  [&](azmq::message_vector &msg) { receive(received_a, msg); });
+  a17::dispatch::Subscriber sub_b(ios, directory, "TEST/MUX_B",
+                                  [&](azmq::message_vector &msg) { receive(received_b, msg); });
+
+  auto send = [&](a17::dispatch::Publisher &pub, const std::string &text) {
+    a17::dispatch::SmartCapnpBuilder builder(pool);
+    builder.initRoot<a17::capnp_msgs::test::DispatchTest>().setTopic(text);
+    CHECK(!pub.send(builder.getSmartMessage()));
+  };
+
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::milliseconds(100));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    CHECK(!ec);
+    REQUIRE(sub_a.addresses().size() == 1);
+    CHECK(*sub_a.addresses().begin() == mux->advertisedAddress());
+    CHECK(sub_b.addresses() == sub_a.addresses());
+
+    send(pub_a, "A1");
+    send(pub_b, "B1");
+    send(pub_a, "A2");
+
+    timer.expires_from_now(boost::posix_time::seconds(5));
+    timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+  });
+
+  ios.run();
+
+  CHECK(received_a == std::vector<std::string>{"A1", "A2"});
+  CHECK(received_b == std::vector<std::string>{"B1"});
+  CHECK(pub_a.metrics().messages_sent == 2);
+  CHECK(mux->metrics().messages_sent == 3);
+}
+
+TEST_CASE("Filtered subscriber on a mux", "[socket]") {
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Directory directory(ios, "test_mux_filter", TEST_PORT, TEST_MULTICAST);
+  directory.setIntraProcess(false);
+  auto mux = std::make_shared<a17::dispatch::PublisherMux>(ios);
+  a17::dispatch::Publisher pub(ios, directory, "TEST/MUX_FILTER",
+                               {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>(),
+                                a17::dispatch::typeOf<a17::capnp_msgs::test::TestType>()},
+                               mux);
+
+  std::vector<std::string> received;
+  uint64_t other_types = 0;
+  a17::dispatch::Subscriber sub(
+      ios, directory, "TEST/MUX_FILTER",
+      [&](azmq::message_vector &msg_vec) {
+        if (a17::dispatch::idFromSmartMessage(msg_vec) !=
+            a17::dispatch::idOf<a17::capnp_msgs::test::DispatchTest>()) {
+          other_types++;
+          return;
+        }
+        auto reader = a17::dispatch::SmartCapnpReader(msg_vec);
+        received.push_back(reader.getRoot<a17::capnp_msgs::test::DispatchTest>().getTopic());
+        if (received.size() == 2) ios.stop();
+      },
+      a17::dispatch::ErrorHandler(), a17::dispatch::ConnectionHandler(),
+      a17::dispatch::ConnectionHandler(),
+      {a17::dispatch::typeOf<a17::capnp_msgs::test::DispatchTest>()});
+
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::milliseconds(100));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    CHECK(!ec);
+    REQUIRE(sub.addresses().size() == 1);
+
+    // The topic frame is all that zmq matches, so the TestType message reaches the socket.
+    a17::dispatch::SmartCapnpBuilder other(pool);
+    other.initRoot<a17::capnp_msgs::test::TestType>().setTimestamp(1);
+    CHECK(!pub.send(other.getSmartMessage()));
+    for (const std::string &text : {"F1", "F2"}) {
+      a17::dispatch::SmartCapnpBuilder builder(pool);
+      builder.initRoot<a17::capnp_msgs::test::DispatchTest>().setTopic(text);
+      CHECK(!pub.send(builder.getSmartMessage()));
+    }
+
+    timer.expires_from_now(boost::posix_time::seconds(5));
+    timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+  });
+
+  ios.run();
+
+  CHECK(received == std::vector<std::string>{"F1", "F2"});
+  CHECK(other_types == 0);
+}
+
+TEST_CASE("Multi-threaded node", "[socket]") {
+  const uint64_t count = 10;
+  a17::dispatch::Node node("test_threads", 4);
+  a17::dispatch::Address address("inproc", "test_threads_pub");
+  a17::dispatch::Publisher pub(node.service(), address);
+
+  uint64_t received = 0;
+  bool in_order = true;
+  a17::dispatch::Subscriber sub(node.service(), address, [&](azmq::message_vector &msg_vec) {
+    auto reader = a17::dispatch::SmartCapnpReader(msg_vec);
+    auto test_msg = reader.getRoot<a17::capnp_msgs::test::TestType>();
+    if (test_msg.getTimestamp() != received) in_order = false;
+    if (++received == count) node.stop();
+  });
+
+  boost::asio::deadline_timer timer(node.service());
+  timer.expires_from_now(boost::posix_time::milliseconds(500));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    CHECK(!ec);
+    for (uint64_t i = 0; i < count; i++) {
+      auto builder = node.newCapnpMessageBuilder();
+      builder.initRoot<a17::capnp_msgs::test::TestType>().setTimestamp(i);
+      CHECK(!pub.send(builder.getSmartMessage()));
+    }
+  });
+
+  boost::asio::deadline_timer timeout(node.service());
+  timeout.expires_from_now(boost::posix_time::seconds(5));
+  timeout.async_wait([&](const boost::system::error_code &ec) {
+    if (!ec) node.stop();
+  });
+
+  node.run();
+
+  CHECK(received == count);
+  CHECK(in_order);
+}
+
+TEST_CASE("Service", "[socket]") {
+  const uint64_t count = 10;
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Address address("inproc", "test_service");
+
+  // Hold every request until all have arrived, then reply in reverse order. Request 0 never gets a
+  // reply and times out.
+  std::vector<std::pair<uint64_t, a17::dispatch::ReplySender>> requests;
+  a17::dispatch::Service service(ios, address, [&](azmq::message_vector &request,
+                                                   a17::dispatch::ReplySender reply_sender) {
+    auto reader = a17::dispatch::SmartCapnpReader(request);
+    requests.emplace_back(reader.getRoot<a17::capnp_msgs::test::TestType>().getTimestamp(),
+                          reply_sender);
+    if (requests.size() < count) return;
+    for (auto iter = requests.rbegin(); iter != requests.rend(); ++iter) {
+      if (iter->first == 0) continue;
+      a17::dispatch::SmartCapnpBuilder builder(pool);
+      builder.initRoot<a17::capnp_msgs::test::TestType>().setTimestamp(iter->first * 10);
+      iter->second(builder.getSmartMessage());
+    }
+  });
+
+  a17::dispatch::ServiceClient client(ios, address);
+
+  std::vector<uint64_t> replies;
+  bool timed_out = false;
+  for (uint64_t i = 0; i < count; i++) {
+    a17::dispatch::SmartCapnpBuilder builder(pool);
+    builder.initRoot<a17::capnp_msgs::test::TestType>().setTimestamp(i);
+    auto ec = client.request<a17::capnp_msgs::test::TestType>(
+        builder,
+        [&, i](const a17::capnp_msgs::test::TestType::Reader &reply) {
+          CHECK(reply.getTimestamp() == i * 10);
+          replies.push_back(i);
+        },
+        [&, i](const boost::system::error_code &ec) {
+          CHECK(i == 0);
+          CHECK(ec == boost::system::errc::timed_out);
+          timed_out = true;
+        },
+        i == 0 ? 200 : 5000);
+    CHECK(!ec);
+  }
+  CHECK(client.pending() == count);
+
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::seconds(1));
+  timer.async_wait([&](const boost::system::error_code &) { ios.stop(); });
+  ios.run();
+
+  // all requests were in flight at once, and replies were matched out of order
+  REQUIRE(replies.size() == count - 1);
+  CHECK(replies.front() == count - 1);
+  CHECK(replies.back() == 1);
+  CHECK(timed_out);
+  CHECK(client.pending() == 0);
+}
+
+TEST_CASE("Service worker pool", "[socket]") {
+  const int count = 4;
+  boost::asio::io_service ios;
+  a17::utils::SizeClassPool pool;
+  a17::dispatch::Address address("inproc", "test_service_workers");
+  auto workers = std::make_shared<a17::utils::WorkerPool>(count, 0);
+
+  // Each handler blocks for a while off of the node's thread. All of them run at once.
+  auto node_thread = std::this_thread::get_id();
+  a17::dispatch::Service service(ios, address, [&](azmq::message_vector &request,
+                                                   a17::dispatch::ReplySender reply_sender) {
+    CHECK(std::this_thread::get_id() != node_thread);
+    std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    reply_sender(request);
+  });
+  service.setWorkerPool(workers);
+
+  a17::dispatch::ServiceClient client(ios, address);
+  int replies = 0;
+  int busy = 0;
+  for (int i = 0; i < count + 1; i++) {
+    a17::dispatch::SmartCapnpBuilder builder(pool);
+    builder.initRoot<a17::capnp_msgs::test::TestType>().setTimestamp(i);
+    client.request(builder.getSmartMessage(),
+                   [&](azmq::message_vector &) {
+                     if (++replies == count) ios.stop();
+                   },
+                   [&](const boost::system::error_code &ec) {
+                     CHECK(ec == boost::system::errc::resource_unavailable_try_again);
+                     busy++;
+                   },
+                   5000);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  boost::asio::deadline_timer timer(ios);
+  timer.expires_from_now(boost::posix_time::seconds(5));
+  timer.async_wait([&](const boost::system::error_code &ec) {
+    if (!ec) ios.stop();
+  });
+  ios.run();
+
+  CHECK(replies == count);
+  CHECK(busy == 1);
+  CHECK(workers->rejected() == 1);
+  CHECK(std::chrono::steady_clock::now() - start < std::chrono::milliseconds(200 * count));
+}
+
 }  // namespace test
 }  // namespace dispatch
 }  // namespace a17
@@ -13,7 +13,7 @@ void SubServer::applyFilters() {
   }
 
   for (const message_type &filter : filters_) {
-    azmqsocket_.set_option(azmq::socket::subscribe(filter));
+    azmqsocket_->set_option(azmq::socket::subscribe(filter));
   };
 }
 
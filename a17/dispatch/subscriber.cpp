@@ -1,5 +1,7 @@
 #include "subscriber.h"
 
+#include <chrono>
+#include <cstring>
 #include <sstream>
 #include <string>
 
@@ -18,11 +20,110 @@ void Subscriber::applyFilters() {
   for (const message_type &filter : filters_) {
     if (filter != "") {
       unsigned long long id = std::stoull(filter, 0, 0);
-      azmqsocket_.set_option(azmq::socket::subscribe(reinterpret_cast<void *>(&id), sizeof(id)));
+      azmqsocket_->set_option(azmq::socket::subscribe(reinterpret_cast<void *>(&id), sizeof(id)));
+      filter_ids_.insert(id);
     } else {
-      azmqsocket_.set_option(azmq::socket::subscribe());
+      subscribe_all_ = true;
     }
   };
+
+  // Connections made before the filters were known.
+  for (const std::string &address : addresses()) {
+    updateSubscriptions(address, true);
+  }
+}
+
+void Subscriber::connect(const std::string &address) {
+  // Subscribe first, so that the publisher has the subscription as soon as the connection is made.
+  if (!addresses().count(address)) updateSubscriptions(address, true);
+  Client::connect(address);
+}
+
+void Subscriber::disconnect(const std::string &address) {
+  bool connected = addresses().count(address) > 0;
+  Client::disconnect(address);
+  if (connected) updateSubscriptions(address, false);
+}
+
+void Subscriber::updateSubscriptions(const std::string &address, bool connected) {
+  bool mux = Address::parse(address).protocol() == MUX_PROTOCOL;
+  size_t &connections = mux ? mux_connections_ : direct_connections_;
+  // Only the first connection and the last disconnection of each kind change the subscriptions.
+  if (connected ? connections++ > 0 : --connections > 0) return;
+
+  if (mux) {
+    void *frame = const_cast<void *>(mux_topic_frame_.data());
+    if (connected) {
+      azmqsocket_->set_option(azmq::socket::subscribe(frame, mux_topic_frame_.size()));
+    } else {
+      azmqsocket_->set_option(azmq::socket::unsubscribe(frame, mux_topic_frame_.size()));
+    }
+  } else if (subscribe_all_) {
+    if (connected) {
+      azmqsocket_->set_option(azmq::socket::subscribe());
+    } else {
+      azmqsocket_->set_option(azmq::socket::unsubscribe());
+    }
+  }
+}
+
+void Subscriber::setLatencyTracking(bool tracking) {
+  if (tracking == static_cast<bool>(latency_)) return;
+  latency_ = tracking ? std::make_shared<LatencyTracker>() : nullptr;
+  Listener::setMessageHandler(wrapHandler(handler_));
+}
+
+SmartMessageHandler Subscriber::wrapHandler(SmartMessageHandler handler) {
+  if (latency_) {
+    std::shared_ptr<LatencyTracker> latency = latency_;
+    SmartMessageHandler tracked = handler;
+    handler = [tracked, latency](azmq::message_vector &message) {
+      auto start = std::chrono::steady_clock::now();
+      auto realtime = std::chrono::system_clock::now().time_since_epoch();
+      bool traced = latency->record(
+          message, std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch())
+                       .count(),
+          std::chrono::duration_cast<std::chrono::nanoseconds>(realtime).count());
+      tracked(message);
+      if (traced) {
+        latency->recordHandler(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                   std::chrono::steady_clock::now() - start)
+                                   .count());
+      }
+    };
+  }
+  // Chunks may come through shared memory, and latency is measured on the whole message.
+  SmartMessageHandler resolving = ShmResolvingHandler(ChunkAssembler::wrap(chunks_, handler));
+  // Messages from a mux come after the topic frame that they were subscribed to by, which is
+  // stripped once the message is accepted.
+  return [this, resolving](azmq::message_vector &message) {
+    if (!accepts(message)) return;
+    if (isMuxTopicFrame(message[0])) message.erase(message.begin());
+    resolving(message);
+  };
+}
+
+// zmq only matches subscriptions against the first frame, which is the topic frame of a message
+// from a mux, so the subscribe filters are checked again here.
+bool Subscriber::accepts(const azmq::message_vector &message) const {
+  if (message.empty()) return false;
+  size_t first = 0;
+  if (isMuxTopicFrame(message[0])) {
+    // The subscribe-all filter lets the other topics of a mux through.
+    if (memcmp(message[0].data(), mux_topic_frame_.data(), mux_topic_frame_.size()) != 0) {
+      return false;
+    }
+    first = 1;
+  }
+  if (subscribe_all_) return true;
+  if (message.size() <= first || message[first].size() < sizeof(unsigned long long)) return false;
+  unsigned long long id;
+  memcpy(&id, message[first].data(), sizeof(id));
+  return filter_ids_.count(id) > 0;
+}
+
+void Subscriber::deliverLocal(const azmq::message_vector &message) {
+  if (accepts(message)) deliver(message);
 }
 
 }  // namespace dispatch
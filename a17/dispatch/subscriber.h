@@ -1,43 +1,108 @@
 #pragma once
 
+#include "chunked_message.h"
 #include "client.h"
+#include "latency_tracker.h"
 #include "listener.h"
+#include "publisher_mux.h"
+#include "shm_ring.h"
 
 namespace a17 {
 namespace dispatch {
 
+// How a subscriber handles messages that arrive faster than its handler returns.
+enum class SubscriberQueue {
+  // Every message is handled in order, up to the socket's high-water mark.
+  ALL,
+  // Only the newest message is handled. Older messages that are still waiting are dropped, and
+  // counted by Subscriber::dropped().
+  KEEP_LAST,
+};
+
 // Every subscriber receives the same messages.
+// Subscribers to a topic published by the same node receive its messages in-process, without
+// going through zmq (see Directory::deliverLocal). Messages from a ShmPublisher on the same host
+// are copied out of its shared memory segment. Chunked messages (see Publisher::setChunking())
+// are put back together before the handler is called; keep-last subscribers skip chunks, so they
+// only get messages that are sent whole.
+// Topics published through a PublisherMux are subscribed to by their topic frame, which is stripped
+// before the handler is called. The subscribe-all filter is only set while the subscriber is
+// connected to publishers of their own, and lets the other topics of a mux through while it is;
+// messages behind any other topic frame are dropped, and so are mux messages that don't pass the
+// subscribe filters.
 class Subscriber : public Client, public Listener {
  private:
   std::set<message_type> filters_;
+  bool subscribe_all_ = false;
+  std::set<unsigned long long> filter_ids_;
+  azmq::message mux_topic_frame_;
+  size_t direct_connections_ = 0;
+  size_t mux_connections_ = 0;
+  SmartMessageHandler handler_;
+  std::shared_ptr<LatencyTracker> latency_;
+  std::shared_ptr<ChunkAssembler> chunks_ = std::make_shared<ChunkAssembler>();
 
  public:
   Subscriber(boost::asio::io_service &ios, Directory &directory, const std::string &publisherTopic,
              SmartMessageHandler handler, ErrorHandler error = ErrorHandler(),
              ConnectionHandler connectHandler = ConnectionHandler(),
              ConnectionHandler disconnectHandler = ConnectionHandler(),
-             const std::set<message_type> &filters = {""})
-      : Client(ios, ZMQ_SUB, "Subscriber", directory, publisherTopic),
-        Listener(*this, handler, error),
-        filters_(filters) {
+             const std::set<message_type> &filters = {""}, const QosProfile &qos = QosProfile())
+      : Client(ios, ZMQ_SUB, "Subscriber", directory, publisherTopic, connectHandler,
+               disconnectHandler, qos),
+        Listener(*this, ShmResolvingHandler(handler), error),
+        filters_(filters),
+        mux_topic_frame_(muxTopicFrame(topic())),
+        handler_(handler) {
+    Listener::setMessageHandler(wrapHandler(handler_));
     applyFilters();
+    enableLocalDelivery(bind1(&Subscriber::deliverLocal));
   }
 
   Subscriber(boost::asio::io_service &ios, const std::string &publisherAddress,
              SmartMessageHandler handler, ErrorHandler error = ErrorHandler(),
-             const std::set<message_type> &filters = {""})
-      : Client(ios, ZMQ_SUB, "Subscriber", publisherAddress),
-        Listener(*this, handler, error),
-        filters_(filters) {
+             const std::set<message_type> &filters = {""}, const QosProfile &qos = QosProfile())
+      : Client(ios, ZMQ_SUB, "Subscriber", publisherAddress, qos),
+        Listener(*this, ShmResolvingHandler(handler), error),
+        filters_(filters),
+        mux_topic_frame_(muxTopicFrame(topic())),
+        handler_(handler) {
+    Listener::setMessageHandler(wrapHandler(handler_));
     applyFilters();
   }
 
   inline void setMessageHandler(SmartMessageHandler handler) {
-    Listener::setMessageHandler(handler);
+    handler_ = handler;
+    Listener::setMessageHandler(wrapHandler(handler));
   }
 
+  // Record the latency and lost messages of traced messages (see Publisher::setTracing()).
+  void setLatencyTracking(bool tracking);
+  // The latency of received messages, or null if it isn't tracked.
+  inline std::shared_ptr<LatencyTracker> latency() const { return latency_; }
+
+  // Called with each chunk of a chunked message as it arrives, before the handler is called with
+  // the whole message.
+  inline void setProgressHandler(ChunkHandler handler) {
+    chunks_->setProgressHandler(std::move(handler));
+  }
+  // Chunked messages that were discarded because chunks were lost.
+  inline uint64_t incompleteChunked() const { return chunks_->incomplete(); }
+
+  inline void setQueue(SubscriberQueue queue) { setKeepLast(queue == SubscriberQueue::KEEP_LAST); }
+
+  void connect(const std::string &address) override;
+  void disconnect(const std::string &address) override;
+
  private:
   void applyFilters();
+  // Sets or clears the subscriptions that connecting to or disconnecting from address needs.
+  void updateSubscriptions(const std::string &address, bool connected);
+  SmartMessageHandler wrapHandler(SmartMessageHandler handler);
+  // Whether a message is on this subscriber's topic and passes its subscribe filters.
+  bool accepts(const azmq::message_vector &message) const override;
+  // Applies the subscribe filters to a message delivered in-process.
+  void deliverLocal(const azmq::message_vector &message);
 };
 
 }  // namespace dispatch
@@ -225,6 +225,62 @@ TEST_CASE("Topic Map Test", "dispatch") {
     REQUIRE(missing.count(topic3.name) == 1);
   }
 
+  SECTION("Prefix observers") {
+    a17::dispatch::DirectoryTopicStore topic_store("0");
+    auto drone = topic1;
+    drone.name = "drone1/perception/lidar";
+    auto nested = topic1;
+    nested.name = "drone1/perception/camera/front";
+    auto other = topic2;
+    other.name = "drone1/planning/path";
+
+    std::vector<std::string> under, all;
+    topic_store.add(drone);
+    topic_store.observe("drone1/perception/*",
+                        [&under](const std::string &topic_name,
+                                 const a17::dispatch::GuidTopicMap &) {
+                          under.push_back(topic_name);
+                        });
+    topic_store.observe("*", [&all](const std::string &topic_name,
+                                    const a17::dispatch::GuidTopicMap &) {
+      all.push_back(topic_name);
+    });
+    // Patterns aren't searched for.
+    REQUIRE(topic_store.getMissing().empty());
+
+    std::vector<std::string> immediate;
+    topic_store.callImmediate("drone1/perception/*",
+                              [&immediate](const std::string &topic_name,
+                                           const a17::dispatch::GuidTopicMap &) {
+                                immediate.push_back(topic_name);
+                              });
+    REQUIRE(immediate == std::vector<std::string>{drone.name});
+
+    topic_store.add(nested);
+    topic_store.add(other);
+    REQUIRE(under == std::vector<std::string>{nested.name});
+    REQUIRE(all == (std::vector<std::string>{nested.name, other.name}));
+
+    topic_store.evict(drone.guid);
+    REQUIRE(under.size() == 3);
+    REQUIRE(all.size() == 4);
+    REQUIRE(topic_store.size() == 1);
+  }
+
+  SECTION("Missing after remove") {
+    a17::dispatch::DirectoryTopicStore topic_store(topic1.guid);
+    auto ref = topic_store.observe(
+        topic2.name, [](const std::string &, const a17::dispatch::GuidTopicMap &) {});
+    topic_store.add(topic2);
+    REQUIRE(topic_store.getMissing().empty());
+
+    topic_store.remove(topic2.guid, topic2.name);
+    REQUIRE(topic_store.getMissing().count(topic2.name) == 1);
+
+    topic_store.unobserve(topic2.name, ref);
+    REQUIRE(topic_store.getMissing().empty());
+  }
+
   SECTION("Iterate") {
     a17::dispatch::DirectoryTopicStore topic_store(topic1.guid);
 
@@ -0,0 +1,14 @@
+#pragma once
+
+#include <spdlog/spdlog.h>
+
+// Guards trace logging on the per-message paths of dispatch, where even building the arguments
+// (e.g. hex dumps of messages) is too costly to do for a log line that is then discarded:
+//   if (DISPATCH_SHOULD_TRACE(logger_)) logger_->trace("{} sending {}", ...);
+// Define A17_DISPATCH_NO_TRACE (CMake option A17_DISPATCH_TRACE=OFF, or Bazel
+// --define dispatch_trace=off) to compile these log lines out entirely.
+#ifdef A17_DISPATCH_NO_TRACE
+#define DISPATCH_SHOULD_TRACE(logger) false
+#else
+#define DISPATCH_SHOULD_TRACE(logger) ((logger) && (logger)->should_log(spdlog::level::trace))
+#endif
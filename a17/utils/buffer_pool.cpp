@@ -7,23 +7,28 @@
 namespace a17 {
 namespace utils {
 
-BufferPool::BufferPool(size_t bufferSize, uint16_t bufferCount, bool singleThreaded)
+BufferPool::BufferPool(size_t bufferSize, uint16_t bufferCount, bool /*singleThreaded*/)
     : bufferSize_(bufferSize),
       bufferCount_(bufferCount),
-      singleThreaded_(singleThreaded),
-      ptrs_(bufferCount + 1) {
+      enqueuePos_(0),
+      dequeuePos_(0) {
   poolSize_ = bufferCount_ * bufferSize_;
   pool_ = static_cast<uint8_t *>(::malloc(poolSize_));
   poolEnd_ = pool_ + poolSize_;
 
-  head_ = 0;
-  tail_ = bufferCount_;
-
-  for (uint32_t i = 0; i < bufferCount_; i++) {
-    ptrs_[i] = pool_ + i * bufferSize;
+  // A power of two with room to spare, so that a consumer that is preempted between claiming a cell
+  // and releasing it rarely holds up producers.
+  cellCount_ = 1;
+  while (cellCount_ < 2 * static_cast<size_t>(bufferCount_)) cellCount_ <<= 1;
+  cellMask_ = cellCount_ - 1;
+  cells_.reset(new Cell[cellCount_]);
+  for (size_t i = 0; i < cellCount_; i++) {
+    cells_[i].sequence.store(i, std::memory_order_relaxed);
   }
 
-  ptrs_[bufferCount_] = nullptr;
+  for (size_t i = 0; i < bufferCount_; i++) {
+    push(pool_ + i * bufferSize);
+  }
 }
 
 BufferPool::~BufferPool() {
@@ -34,10 +39,8 @@ BufferPool::~BufferPool() {
 }
 
 void *BufferPool::malloc() {
-  if (head_ == tail_) return ::malloc(bufferSize_);
-
-  void *ptr = ptrs_[head_];
-  head_ = next(head_);
+  void *ptr = pop();
+  if (!ptr) return ::malloc(bufferSize_);
   return ptr;
 }
 
@@ -48,18 +51,63 @@ void *BufferPool::calloc() {
 }
 
 void BufferPool::free(void *ptr) {
-  if (ptr < pool_ || ptr >= poolEnd_) {
+  if (!contains(ptr)) {
     ::free(ptr);
     return;
   }
 
-  if (!singleThreaded_) tailMutex_.lock();
-  ptrs_[tail_] = ptr;
-  tail_ = next(tail_);
-  if (!singleThreaded_) tailMutex_.unlock();
+  push(ptr);
 }
 
 void BufferPool::zmqFree(void *ptr, void *hint) { static_cast<BufferPool *>(hint)->free(ptr); }
 
+// Each cell's sequence tells whether it is ready to be written (sequence == pos) or read
+// (sequence == pos + 1) by the producer or consumer that claims position pos.
+void BufferPool::push(void *ptr) {
+  size_t pos = enqueuePos_.load(std::memory_order_relaxed);
+  Cell *cell;
+  for (;;) {
+    cell = &cells_[pos & cellMask_];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+    if (diff == 0) {
+      if (enqueuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      // The consumer that last claimed this cell hasn't released it yet. The queue holds more
+      // cells than there are buffers, so it can't really be full; wait for the consumer.
+      std::this_thread::yield();
+      pos = enqueuePos_.load(std::memory_order_relaxed);
+    } else {
+      pos = enqueuePos_.load(std::memory_order_relaxed);
+    }
+  }
+
+  cell->ptr = ptr;
+  cell->sequence.store(pos + 1, std::memory_order_release);
+}
+
+void *BufferPool::pop() {
+  size_t pos = dequeuePos_.load(std::memory_order_relaxed);
+  Cell *cell;
+  for (;;) {
+    cell = &cells_[pos & cellMask_];
+    size_t sequence = cell->sequence.load(std::memory_order_acquire);
+    intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+    if (diff == 0) {
+      if (dequeuePos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) break;
+    } else if (diff < 0) {
+      // Empty, or a producer hasn't finished publishing this cell. Either way malloc() falls back
+      // to the OS rather than waiting.
+      return nullptr;
+    } else {
+      pos = dequeuePos_.load(std::memory_order_relaxed);
+    }
+  }
+
+  void *ptr = cell->ptr;
+  cell->sequence.store(pos + cellCount_, std::memory_order_release);
+  return ptr;
+}
+
 }  // namespace utils
 }  // namespace a17
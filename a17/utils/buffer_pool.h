@@ -1,9 +1,10 @@
 #ifndef A17_UTILS_BUFFER_POOL_H_
 #define A17_UTILS_BUFFER_POOL_H_
 
-#include <vector>
+#include <atomic>
 #include <functional>
-#include <mutex>
+#include <memory>
+#include <vector>
 
 namespace a17 {
 namespace utils {
@@ -15,12 +16,13 @@ const uint16_t DEFAULT_POOL_BUFFER_COUNT = 64;
 const size_t DEFAULT_POOL_BUFFER_SIZE = 64 * 8;  // 8 == sizeof(capnp::word)
 
 /**
- * multiple-producer single-consumer memory pool for send buffers.
- * Only the free() method is multiple-thread-safe (multiple producers) while the malloc() method is
- * not (single consumer).
- * This enables our use case with zmqq, where one Node thread allocates send buffers, and the Node
- * thread or a zmq thread may free them.
- * Locking behavior in free() can be turned off by constructing with singleThreaded = true.
+ * Multiple-producer multiple-consumer memory pool for send buffers, without locks.
+ * Both malloc() and free() may be called from any number of threads at once. This enables our use
+ * case with zmq, where Node threads allocate send buffers, and the Node threads or a zmq thread
+ * may free them. malloc() never waits, but free() yields until a malloc() that was preempted while
+ * holding the queue cell it needs releases it, so the pool is not strictly lock-free.
+ * Free buffers are kept in a bounded FIFO queue (D. Vyukov's bounded MPMC queue), so buffers are
+ * handed out in the order they were freed.
  * For performance reasons, there aren't any guards in the free() method. It is possible to corrupt
  * the pool by freeing duplicate or invalid pointers.
  * If the pool runs out of buffers, it will return buffers allocated by OS malloc(). This is to
@@ -38,19 +40,27 @@ class BufferPool {
    *
    * @param bufferSize size of a buffer in bytes
    * @param bufferCount total number of buffers in the pool
-   * @param singleThreaded whether to bypass locking in single threaded usage
+   * @param singleThreaded unused, since the pool takes no locks. Kept for compatibility.
    */
   BufferPool(size_t bufferSize = DEFAULT_POOL_BUFFER_SIZE,
              uint16_t bufferCount = DEFAULT_POOL_BUFFER_COUNT, bool singleThreaded = false);
   ~BufferPool();
 
+  BufferPool(const BufferPool &) = delete;
+  BufferPool &operator=(const BufferPool &) = delete;
+
   inline void *pool() const { return pool_; }
   inline size_t bufferSize() const { return bufferSize_; }
   inline uint16_t bufferCount() const { return bufferCount_; }
-  inline bool empty() const { return head_ == tail_; }
-  inline bool full() const { return next(tail_) == head_; }
+  // Whether ptr is one of the pool's own buffers, rather than one allocated by OS malloc().
+  inline bool contains(const void *ptr) const { return ptr >= pool_ && ptr < poolEnd_; }
+  inline bool empty() const { return remaining() == 0; }
+  inline bool full() const { return remaining() == bufferCount_; }
+  // Number of buffers available. Only a snapshot while other threads use the pool.
   inline uint16_t remaining() const {
-    return tail_ > head_ ? tail_ - head_ : bufferCount_ - (head_ - tail_) + 1;
+    size_t enqueued = enqueuePos_.load(std::memory_order_relaxed);
+    size_t dequeued = dequeuePos_.load(std::memory_order_relaxed);
+    return enqueued > dequeued ? enqueued - dequeued : 0;
   }
 
   void *malloc();
@@ -61,19 +71,31 @@ class BufferPool {
   static void zmqFree(void *ptr, void *hint);
 
  private:
-  inline uint16_t next(uint16_t pos) const { return (pos + 1) % (bufferCount_ + 1); }
+  struct Cell {
+    std::atomic<size_t> sequence;
+    void *ptr;
+  };
+
+  static constexpr size_t CACHE_LINE_SIZE = 64;
+
+  void push(void *ptr);
+  void *pop();
 
   uint8_t *pool_;
   uint8_t *poolEnd_;
   size_t poolSize_;
   size_t bufferSize_;
   uint16_t bufferCount_;
-  bool singleThreaded_;
 
-  std::vector<void *> ptrs_;
-  uint16_t head_;
-  uint16_t tail_;
-  std::mutex tailMutex_;
+  size_t cellCount_;
+  size_t cellMask_;
+  std::unique_ptr<Cell[]> cells_;
+  // Kept on separate cache lines, since producers and consumers update them concurrently. Padded
+  // rather than aligned, since new doesn't honour over-aligned types before C++17.
+  char enqueuePad_[CACHE_LINE_SIZE];
+  std::atomic<size_t> enqueuePos_;
+  char dequeuePad_[CACHE_LINE_SIZE - sizeof(std::atomic<size_t>)];
+  std::atomic<size_t> dequeuePos_;
 };
 
 }  // namespace utils
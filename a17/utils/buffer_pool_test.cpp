@@ -1,3 +1,10 @@
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
 #include "catch.hpp"
 #include "buffer_pool.h"
 
@@ -70,3 +77,60 @@ TEST_CASE("calloc", "[pool]") {
 
   pool.free(ptr);
 }
+
+TEST_CASE("multiple threads", "[pool]") {
+  const int threadCount = 4;
+  const int iterations = 10000;
+  a17::utils::BufferPool pool(64, 16);
+  std::atomic<bool> overlapped{false};
+
+  // Every thread allocates and frees buffers, marking each buffer it holds with its own id. If the
+  // pool ever hands the same buffer to two threads, one of them sees the other's mark.
+  std::vector<std::thread> threads;
+  for (int t = 0; t < threadCount; t++) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < iterations; i++) {
+        auto ptr = static_cast<uint8_t *>(pool.malloc());
+        memset(ptr, t, 64);
+        std::this_thread::yield();
+        for (int j = 0; j < 64; j++) {
+          if (ptr[j] != t) overlapped = true;
+        }
+        pool.free(ptr);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+
+  REQUIRE(!overlapped);
+  REQUIRE(pool.full());
+}
+
+// Run with: unittests_A17Utils "[benchmark]"
+TEST_CASE("contention benchmark", "[.][benchmark]") {
+  const int iterations = 1000000;
+  for (int threadCount : {1, 2, 4, 8}) {
+    a17::utils::BufferPool pool(512, 64);
+
+    auto begin = std::chrono::steady_clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < threadCount; t++) {
+      threads.emplace_back([&]() {
+        for (int i = 0; i < iterations; i++) {
+          pool.free(pool.malloc());
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin);
+
+    double ns = elapsed.count() * 1e9 / (static_cast<double>(iterations) * threadCount);
+    std::cout << "BufferPool " << threadCount << " threads: " << ns << " ns per malloc/free"
+              << std::endl;
+    REQUIRE(pool.full());
+  }
+}
@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include "size_class_pool.h"
+
+namespace a17 {
+namespace utils {
+
+namespace {
+
+size_t RoundUpToPowerOf2(size_t size) {
+  size_t rounded = 1;
+  while (rounded < size) rounded <<= 1;
+  return rounded;
+}
+
+}  // namespace
+
+SizeClassPool::SizeClassPool(size_t minBufferSize, size_t maxBufferSize, size_t classBytes,
+                             uint16_t bufferCount)
+    : minBufferSize_(RoundUpToPowerOf2(std::max<size_t>(minBufferSize, sizeof(void *)))),
+      maxBufferSize_(std::max(minBufferSize_, RoundUpToPowerOf2(maxBufferSize))) {
+  for (size_t size = minBufferSize_; size <= maxBufferSize_; size <<= 1) {
+    auto sizeClass = std::unique_ptr<SizeClass>(new SizeClass());
+    sizeClass->bufferSize = size;
+    // At least two buffers, so that a message can be built while the last one is being sent.
+    size_t count = std::min<size_t>(bufferCount, classBytes / size);
+    sizeClass->bufferCount = static_cast<uint16_t>(std::max<size_t>(2, count));
+    classes_.push_back(std::move(sizeClass));
+  }
+}
+
+SizeClassPool::SizeClassPool(BufferPool &pool)
+    : minBufferSize_(pool.bufferSize()), maxBufferSize_(pool.bufferSize()) {
+  auto sizeClass = std::unique_ptr<SizeClass>(new SizeClass());
+  sizeClass->bufferSize = pool.bufferSize();
+  sizeClass->bufferCount = pool.bufferCount();
+  sizeClass->pool.store(&pool, std::memory_order_release);
+  classes_.push_back(std::move(sizeClass));
+}
+
+size_t SizeClassPool::classIndex(size_t size) const {
+  size_t index = 0;
+  for (size_t classSize = minBufferSize_; classSize < size && index < classes_.size();
+       classSize <<= 1) {
+    index++;
+  }
+  return index;
+}
+
+BufferPool &SizeClassPool::classPool(SizeClass &sizeClass) {
+  BufferPool *pool = sizeClass.pool.load(std::memory_order_acquire);
+  if (pool) return *pool;
+
+  std::call_once(sizeClass.created, [&sizeClass]() {
+    sizeClass.owner.reset(new BufferPool(sizeClass.bufferSize, sizeClass.bufferCount));
+    sizeClass.pool.store(sizeClass.owner.get(), std::memory_order_release);
+  });
+  return *sizeClass.owner;
+}
+
+size_t SizeClassPool::bufferSize(size_t size) const {
+  size_t index = classIndex(size);
+  return index < classes_.size() ? classes_[index]->bufferSize : size;
+}
+
+void *SizeClassPool::malloc(size_t size) {
+  size_t index = classIndex(size);
+  if (index >= classes_.size()) {
+    fallbacks_.fetch_add(1, std::memory_order_relaxed);
+    return ::malloc(size);
+  }
+
+  BufferPool &pool = classPool(*classes_[index]);
+  void *ptr = pool.malloc();
+  if (pool.contains(ptr)) {
+    hits_.fetch_add(1, std::memory_order_relaxed);
+  } else {
+    misses_.fetch_add(1, std::memory_order_relaxed);
+  }
+  return ptr;
+}
+
+void *SizeClassPool::calloc(size_t size) {
+  void *ptr = malloc(size);
+  if (ptr) memset(ptr, 0, size);
+  return ptr;
+}
+
+void SizeClassPool::free(void *ptr) {
+  for (auto &sizeClass : classes_) {
+    BufferPool *pool = sizeClass->pool.load(std::memory_order_acquire);
+    if (pool && pool->contains(ptr)) {
+      pool->free(ptr);
+      return;
+    }
+  }
+
+  // Either a miss or a fallback, both of which came from OS malloc().
+  ::free(ptr);
+}
+
+void SizeClassPool::zmqFree(void *ptr, void *hint) {
+  static_cast<SizeClassPool *>(hint)->free(ptr);
+}
+
+}  // namespace utils
+}  // namespace a17
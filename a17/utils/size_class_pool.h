@@ -0,0 +1,100 @@
+#ifndef A17_UTILS_SIZE_CLASS_POOL_H_
+#define A17_UTILS_SIZE_CLASS_POOL_H_
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "buffer_pool.h"
+
+namespace a17 {
+namespace utils {
+
+// Largest buffer handed out by SizeClassPool by default. Larger requests go to OS malloc().
+const size_t DEFAULT_POOL_MAX_BUFFER_SIZE = 16 * 1024 * 1024;
+// Default memory reserved for the buffers of a single size class. Large classes get fewer buffers.
+const size_t DEFAULT_POOL_CLASS_BYTES = 32 * 1024 * 1024;
+
+/**
+ * Memory pool for buffers of many sizes, built from one BufferPool per power-of-two size class.
+ * A request is served by the smallest class that fits it, so a 600 byte request takes a 1 KB
+ * buffer. Each class's BufferPool (its slab) is created the first time the class is used, so
+ * classes that a process never uses cost nothing.
+ *
+ * Like BufferPool, malloc() and free() may be called from any thread.
+ *
+ * Counters:
+ *   hits: requests served from a slab.
+ *   misses: requests that fit a class whose slab was empty, served by OS malloc() instead.
+ *   fallbacks: requests larger than the largest class, served by OS malloc().
+ * A steady rate of misses means a class needs more buffers (raise classBytes or bufferCount), and a
+ * steady rate of fallbacks means maxBufferSize is too small for the process's messages.
+ */
+class SizeClassPool {
+ public:
+  /**
+   * @param minBufferSize size of the smallest class in bytes, rounded up to a power of 2
+   * @param maxBufferSize size of the largest class in bytes, rounded up to a power of 2
+   * @param classBytes memory in bytes to reserve for the buffers of each class
+   * @param bufferCount most buffers in a class, used by the small classes
+   */
+  SizeClassPool(size_t minBufferSize = DEFAULT_POOL_BUFFER_SIZE,
+                size_t maxBufferSize = DEFAULT_POOL_MAX_BUFFER_SIZE,
+                size_t classBytes = DEFAULT_POOL_CLASS_BYTES,
+                uint16_t bufferCount = DEFAULT_POOL_BUFFER_COUNT);
+
+  /**
+   * A single class served by an existing pool, which must outlive this one. Requests larger than
+   * its buffers are fallbacks.
+   */
+  explicit SizeClassPool(BufferPool &pool);
+
+  SizeClassPool(const SizeClassPool &) = delete;
+  SizeClassPool &operator=(const SizeClassPool &) = delete;
+
+  inline size_t minBufferSize() const { return minBufferSize_; }
+  inline size_t maxBufferSize() const { return maxBufferSize_; }
+  inline size_t classCount() const { return classes_.size(); }
+
+  // Usable size of the buffer that malloc(size) returns.
+  size_t bufferSize(size_t size) const;
+
+  void *malloc(size_t size);
+  // Clears the first size bytes of the buffer, which may be larger (see bufferSize()).
+  void *calloc(size_t size);
+  void free(void *ptr);
+
+  // Static free method that conforms to zmq_free_ffn.
+  static void zmqFree(void *ptr, void *hint);
+
+  inline uint64_t hits() const { return hits_.load(std::memory_order_relaxed); }
+  inline uint64_t misses() const { return misses_.load(std::memory_order_relaxed); }
+  inline uint64_t fallbacks() const { return fallbacks_.load(std::memory_order_relaxed); }
+
+ private:
+  struct SizeClass {
+    size_t bufferSize;
+    uint16_t bufferCount;
+    std::once_flag created;
+    std::atomic<BufferPool *> pool{nullptr};
+    std::unique_ptr<BufferPool> owner;
+  };
+
+  // Index of the smallest class that fits size. Equal to classCount() if none does.
+  size_t classIndex(size_t size) const;
+  BufferPool &classPool(SizeClass &sizeClass);
+
+  size_t minBufferSize_;
+  size_t maxBufferSize_;
+  std::vector<std::unique_ptr<SizeClass>> classes_;
+
+  std::atomic<uint64_t> hits_{0};
+  std::atomic<uint64_t> misses_{0};
+  std::atomic<uint64_t> fallbacks_{0};
+};
+
+}  // namespace utils
+}  // namespace a17
+
+#endif  // A17_UTILS_SIZE_CLASS_POOL_H_
@@ -0,0 +1,98 @@
+#include <cstring>
+
+#include "catch.hpp"
+#include "size_class_pool.h"
+
+TEST_CASE("size classes", "[size_class_pool]") {
+  a17::utils::SizeClassPool pool(500, 4000, 4096, 8);
+
+  // sizes are rounded up to powers of 2
+  REQUIRE(pool.minBufferSize() == 512);
+  REQUIRE(pool.maxBufferSize() == 4096);
+  REQUIRE(pool.classCount() == 4);
+
+  REQUIRE(pool.bufferSize(1) == 512);
+  REQUIRE(pool.bufferSize(512) == 512);
+  REQUIRE(pool.bufferSize(513) == 1024);
+  REQUIRE(pool.bufferSize(4096) == 4096);
+  REQUIRE(pool.bufferSize(5000) == 5000);
+}
+
+TEST_CASE("hits misses and fallbacks", "[size_class_pool]") {
+  // 4096 bytes per class leaves two 2 KB buffers
+  a17::utils::SizeClassPool pool(512, 2048, 4096, 8);
+
+  void *first = pool.malloc(2000);
+  void *second = pool.malloc(2000);
+  REQUIRE(pool.hits() == 2);
+  REQUIRE(pool.misses() == 0);
+
+  // the 2 KB class is empty, so the buffer comes from the OS
+  void *third = pool.malloc(2000);
+  REQUIRE(third != nullptr);
+  REQUIRE(pool.misses() == 1);
+
+  // larger than the largest class
+  void *large = pool.malloc(1 << 20);
+  REQUIRE(large != nullptr);
+  REQUIRE(pool.fallbacks() == 1);
+
+  pool.free(third);
+  pool.free(large);
+  pool.free(second);
+
+  // freed slab buffers are reused
+  void *reused = pool.malloc(1500);
+  REQUIRE(reused == second);
+  REQUIRE(pool.hits() == 3);
+
+  pool.free(reused);
+  pool.free(first);
+}
+
+TEST_CASE("calloc clears the requested size", "[size_class_pool]") {
+  a17::utils::SizeClassPool pool(128, 128, 256, 2);
+
+  // dirty both buffers in the class
+  void *first = pool.malloc(100);
+  void *second = pool.malloc(100);
+  memset(first, 0xff, 128);
+  memset(second, 0xff, 128);
+  pool.free(first);
+  pool.free(second);
+
+  auto ptr = static_cast<uint8_t *>(pool.calloc(10));
+  for (int i = 0; i < 10; i++) {
+    REQUIRE(ptr[i] == 0);
+  }
+  pool.free(ptr);
+
+  // and the whole buffer when that is what was asked for
+  ptr = static_cast<uint8_t *>(pool.calloc(pool.bufferSize(10)));
+  for (int i = 0; i < 128; i++) {
+    REQUIRE(ptr[i] == 0);
+  }
+  pool.free(ptr);
+}
+
+TEST_CASE("single class over an existing pool", "[size_class_pool]") {
+  a17::utils::BufferPool buffers(1000, 2);
+  a17::utils::SizeClassPool pool(buffers);
+
+  REQUIRE(pool.classCount() == 1);
+  REQUIRE(pool.bufferSize(10) == 1000);
+  REQUIRE(pool.bufferSize(1001) == 1001);
+
+  void *ptr = pool.malloc(1000);
+  REQUIRE(buffers.contains(ptr));
+  REQUIRE(buffers.remaining() == 1);
+  REQUIRE(pool.hits() == 1);
+
+  void *large = pool.malloc(1001);
+  REQUIRE(!buffers.contains(large));
+  REQUIRE(pool.fallbacks() == 1);
+
+  pool.free(large);
+  pool.free(ptr);
+  REQUIRE(buffers.full());
+}
@@ -0,0 +1,72 @@
+#include "worker_pool.h"
+
+namespace a17 {
+namespace utils {
+
+WorkerPool::WorkerPool(size_t thread_count, size_t max_queue_depth)
+    : max_queue_depth_(max_queue_depth) {
+  if (thread_count == 0) thread_count = 1;
+  for (size_t i = 0; i < thread_count; i++) {
+    threads_.emplace_back([this]() { run(); });
+  }
+}
+
+WorkerPool::~WorkerPool() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  condition_.notify_all();
+  for (auto &thread : threads_) {
+    thread.join();
+  }
+}
+
+bool WorkerPool::post(std::function<void()> task) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    // Tasks waiting for a busy pool count against the queue, but not tasks about to be picked up by
+    // an idle thread.
+    if (stopping_ || queue_.size() + active_ >= threads_.size() + max_queue_depth_) {
+      rejected_++;
+      return false;
+    }
+    queue_.push_back(std::move(task));
+
+    size_t depth = queue_.size();
+    size_t peak = peak_queue_depth_.load();
+    while (depth > peak && !peak_queue_depth_.compare_exchange_weak(peak, depth)) {
+    }
+  }
+  condition_.notify_one();
+  return true;
+}
+
+size_t WorkerPool::queueDepth() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return queue_.size();
+}
+
+void WorkerPool::run() {
+  for (;;) {
+    std::function<void()> task;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      condition_.wait(lock, [this]() { return stopping_ || !queue_.empty(); });
+      if (queue_.empty()) return;
+      task = std::move(queue_.front());
+      queue_.pop_front();
+      active_++;
+    }
+
+    task();
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      active_--;
+    }
+    completed_++;
+  }
+}
+
+}  // namespace utils
+}  // namespace a17
@@ -0,0 +1,65 @@
+#ifndef A17_UTILS_WORKER_POOL_H_
+#define A17_UTILS_WORKER_POOL_H_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace a17 {
+namespace utils {
+
+/// Fixed set of threads that run posted tasks in FIFO order, with a bounded queue.
+/// The number of threads limits how many tasks run at once. Tasks posted while the queue is full are
+/// rejected, so that a slow consumer pushes back on its producer instead of growing without bound.
+/// The destructor rejects new tasks and runs the queued ones before joining the threads, so that a
+/// task that was accepted always runs, e.g. to send the reply that its caller waits for.
+class WorkerPool {
+ public:
+  /// @param thread_count number of tasks that may run at once
+  /// @param max_queue_depth number of tasks that may wait while all threads are busy
+  WorkerPool(size_t thread_count, size_t max_queue_depth);
+  ~WorkerPool();
+
+  WorkerPool(const WorkerPool &) = delete;
+  WorkerPool &operator=(const WorkerPool &) = delete;
+
+  /// Queues a task. Returns false, without queueing it, if the queue is full.
+  bool post(std::function<void()> task);
+
+  inline size_t threadCount() const { return threads_.size(); }
+  inline size_t maxQueueDepth() const { return max_queue_depth_; }
+
+  /// Tasks waiting for a thread.
+  size_t queueDepth();
+  /// Largest queue depth seen since construction or the last resetPeakQueueDepth().
+  inline size_t peakQueueDepth() const { return peak_queue_depth_.load(); }
+  inline void resetPeakQueueDepth() { peak_queue_depth_ = 0; }
+  /// Tasks running now.
+  inline size_t active() const { return active_.load(); }
+  inline uint64_t completed() const { return completed_.load(); }
+  inline uint64_t rejected() const { return rejected_.load(); }
+
+ private:
+  void run();
+
+  size_t max_queue_depth_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::deque<std::function<void()>> queue_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+
+  std::atomic<size_t> peak_queue_depth_{0};
+  std::atomic<size_t> active_{0};
+  std::atomic<uint64_t> completed_{0};
+  std::atomic<uint64_t> rejected_{0};
+};
+
+}  // namespace utils
+}  // namespace a17
+
+#endif  // A17_UTILS_WORKER_POOL_H_
@@ -0,0 +1,76 @@
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "catch.hpp"
+#include "worker_pool.h"
+
+TEST_CASE("runs tasks", "[worker_pool]") {
+  std::atomic<int> count{0};
+  {
+    a17::utils::WorkerPool pool(4, 100);
+    for (int i = 0; i < 100; i++) {
+      REQUIRE(pool.post([&count]() { count++; }));
+    }
+    while (pool.completed() < 100) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    REQUIRE(pool.queueDepth() == 0);
+    REQUIRE(pool.rejected() == 0);
+  }
+  REQUIRE(count == 100);
+}
+
+TEST_CASE("destructor runs queued tasks", "[worker_pool]") {
+  std::atomic<int> count{0};
+  {
+    a17::utils::WorkerPool pool(1, 10);
+    for (int i = 0; i < 10; i++) {
+      REQUIRE(pool.post([&count]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        count++;
+      }));
+    }
+  }
+  REQUIRE(count == 10);
+}
+
+TEST_CASE("concurrency limit and queue depth", "[worker_pool]") {
+  a17::utils::WorkerPool pool(2, 3);
+  std::mutex mutex;
+  std::condition_variable condition;
+  bool release = false;
+  auto blocking_task = [&]() {
+    std::unique_lock<std::mutex> lock(mutex);
+    condition.wait(lock, [&]() { return release; });
+  };
+
+  // two tasks run, three wait, and the rest are rejected
+  for (int i = 0; i < 2; i++) {
+    REQUIRE(pool.post(blocking_task));
+  }
+  while (pool.active() < 2) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  for (int i = 0; i < 3; i++) {
+    REQUIRE(pool.post(blocking_task));
+  }
+  REQUIRE(!pool.post(blocking_task));
+  REQUIRE(pool.active() == 2);
+  REQUIRE(pool.queueDepth() == 3);
+  REQUIRE(pool.peakQueueDepth() == 3);
+  REQUIRE(pool.rejected() == 1);
+
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    release = true;
+  }
+  condition.notify_all();
+  while (pool.completed() < 5) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+  REQUIRE(pool.queueDepth() == 0);
+  REQUIRE(pool.active() == 0);
+}
@@ -0,0 +1,18 @@
+# Find LZ4 Headers/Libs
+
+# Variables
+# LZ4_FOUND - True if LZ4 found
+# LZ4_INCLUDE_DIRS - Location of LZ4 includes
+# LZ4_LIBRARIES - LZ4 libraries
+
+include(FindPackageHandleStandardArgs)
+
+find_path(LZ4_INCLUDE_DIRS NAMES lz4.h)
+find_library(LZ4_LIBRARIES NAMES lz4)
+
+find_package_handle_standard_args(LZ4 FOUND_VAR LZ4_FOUND
+    REQUIRED_VARS LZ4_INCLUDE_DIRS LZ4_LIBRARIES)
+
+if (LZ4_FOUND)
+    mark_as_advanced(LZ4_INCLUDE_DIRS LZ4_LIBRARIES)
+endif()
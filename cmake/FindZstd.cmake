@@ -0,0 +1,18 @@
+# Find Zstandard Headers/Libs
+
+# Variables
+# Zstd_FOUND - True if Zstandard found
+# Zstd_INCLUDE_DIRS - Location of Zstandard includes
+# Zstd_LIBRARIES - Zstandard libraries
+
+include(FindPackageHandleStandardArgs)
+
+find_path(Zstd_INCLUDE_DIRS NAMES zstd.h)
+find_library(Zstd_LIBRARIES NAMES zstd)
+
+find_package_handle_standard_args(Zstd FOUND_VAR Zstd_FOUND
+    REQUIRED_VARS Zstd_INCLUDE_DIRS Zstd_LIBRARIES)
+
+if (Zstd_FOUND)
+    mark_as_advanced(Zstd_INCLUDE_DIRS Zstd_LIBRARIES)
+endif()
@@ -20,6 +20,8 @@ apt-get update && apt-get install -y \
     libgoogle-glog-dev \
     libeigen3-dev \
     libspdlog-dev \
+    liblz4-dev \
+    libzstd-dev \
 
 
 # AZMQ is header-only and not in apt, so we must download it manually.